@@ -0,0 +1,94 @@
+import argparse
+import os
+import time
+import torch
+
+from lib.cpp_extension.wrapper import sample, gather, offload, mt_load
+
+
+# Parse arguments
+argparser = argparse.ArgumentParser()
+argparser.add_argument('--target', type=str, default='remap')
+argparser.add_argument('--num-nodes', type=int, default=111059956)
+argparser.add_argument('--num-ids', type=int, default=1000000)
+argparser.add_argument('--num-batches', type=int, default=10)
+argparser.add_argument('--alpha', type=float, default=3.0)
+argparser.add_argument('--num-rows', type=int, default=1000000)
+argparser.add_argument('--feature-dim', type=int, default=128)
+argparser.add_argument('--dataset', type=str, default='ogbn-papers100M')
+argparser.add_argument('--dataset-root', type=str, default='./data/dataset')
+argparser.add_argument('--io-depth', type=int, default=256)
+argparser.add_argument('--max-gaps', type=str, default='-1,0,8192,65536')
+argparser.add_argument('--cache-bytes', type=int, default=8*1024*1024*1024)
+argparser.add_argument('--hugepages', type=str, default='none,thp,2mb,1gb')
+args = argparser.parse_args()
+
+
+def benchmark_remap():
+    print('Relabeling {} power-law node IDs x {} batches...'.format(args.num_ids, args.num_batches))
+    map_ns, table_ns = sample.benchmark_remap(args.num_nodes, args.num_ids, args.num_batches, args.alpha)
+    print('std::unordered_map: {:.1f} ns/id'.format(map_ns))
+    print('RemapTable: {:.1f} ns/id ({:.2f}x)'.format(table_ns, map_ns / table_ns))
+
+
+def benchmark_row_copy():
+    print('Gathering {} random rows of {} floats x {} batches...'.format(args.num_ids, args.feature_dim, args.num_batches))
+    memcpy_ns, kernel_ns = gather.benchmark_row_copy(args.num_rows, args.num_ids, args.feature_dim, args.num_batches)
+    print('memcpy: {:.1f} ns/row'.format(memcpy_ns))
+    print('RowCopier: {:.1f} ns/row ({:.2f}x)'.format(kernel_ns, memcpy_ns / kernel_ns))
+
+
+def print_io_stats(name, stats, elapsed):
+    rows, bytes_requested, reads, bytes_read = stats
+    print('{}: {} reads for {} rows, {:.1f} MB/s of rows, {:.1f} MB/s read'.format(
+        name, reads, rows, bytes_requested / elapsed / 1e6, bytes_read / elapsed / 1e6))
+
+
+# Read random rows of features.dat with FeatureReader and a CPU Offloader, with
+# every max_gap in --max-gaps. -1 reads the rows one at a time in idx order.
+def benchmark_gather():
+    features_path = os.path.join(args.dataset_root, args.dataset + '-ginex', 'features.dat')
+    num_nodes = os.path.getsize(features_path) // (args.feature_dim * 4)
+    print('Reading {} random rows of {} x {} batches...'.format(args.num_ids, features_path, args.num_batches))
+    batches = [torch.randint(num_nodes, (args.num_ids,)) for _ in range(args.num_batches)]
+    cache = torch.empty((0, args.feature_dim))
+    cache_table = torch.full((num_nodes,), -1, dtype=torch.int32)
+
+    for max_gap in [int(gap) for gap in args.max_gaps.split(',')]:
+        reader = gather.FeatureReader(features_path, args.feature_dim, args.io_depth, max_gap=max_gap)
+        start = time.perf_counter()
+        for idx in batches:
+            reader.gather(idx, cache, cache_table)
+        print_io_stats('FeatureReader max_gap {}'.format(max_gap), reader.get_io_stats(), time.perf_counter() - start)
+
+        offloader = offload.Offloader(features_path, num_nodes, args.feature_dim, args.num_ids, 'cpu', 0, 0,
+                                      max_gap=max_gap)
+        start = time.perf_counter()
+        for idx in batches:
+            idx = idx.unique()
+            offloader.async_load(idx, 0, 1)
+            offloader.release(idx)
+        print_io_stats('Offloader max_gap {}'.format(max_gap), offloader.get_io_stats(), time.perf_counter() - start)
+
+
+# Look up random words of a --cache-bytes buffer with every page kind in
+# --hugepages, and report the pages the buffer got and its dTLB misses
+def benchmark_hugepage():
+    print('Looking up {} random words of {} bytes...'.format(args.num_ids, args.cache_bytes))
+    for hugepage in args.hugepages.split(','):
+        got, page_size, huge_bytes, ns, misses = mt_load.benchmark_hugepage(args.cache_bytes, args.num_ids, hugepage)
+        print('{}: got {} ({} KB kernel pages, {:.0f}% in transparent hugepages), {:.1f} ns/lookup, {}'.format(
+            hugepage, got, page_size // 1024, 100 * huge_bytes / args.cache_bytes, ns,
+            '{:.3f} dTLB misses/lookup'.format(misses) if misses >= 0 else 'dTLB misses not available'))
+
+
+if args.target == 'remap':
+    benchmark_remap()
+elif args.target == 'row_copy':
+    benchmark_row_copy()
+elif args.target == 'gather':
+    benchmark_gather()
+elif args.target == 'hugepage':
+    benchmark_hugepage()
+else:
+    raise NotImplementedError
@@ -0,0 +1,43 @@
+import argparse
+import json
+import os
+
+from lib.data import *
+from lib.cpp_extension.wrapper import sample
+
+
+# Parse arguments
+argparser = argparse.ArgumentParser()
+argparser.add_argument('--dataset', type=str, default='ogbn-papers100M')
+argparser.add_argument('--dataset-root', type=str, default='./data/dataset')
+args = argparser.parse_args()
+
+# Set path
+dataset_path = os.path.join(args.dataset_root, args.dataset + '-ginex')
+split_idx_path = os.path.join(dataset_path, 'split_idx.pth')
+conf_path = os.path.join(dataset_path, 'conf.json')
+
+
+def compress_indices():
+    print('Compressing indices...')
+    dataset = GinexDataset(path=dataset_path, split_idx_path=split_idx_path)
+    indptr, indices = dataset.get_adj_mat()
+    blocks, offsets = sample.compress_indices(indptr, indices, dataset.compressed_indices_path)
+    print('Done!')
+
+    print('Saving index...')
+    blocks.numpy().tofile(dataset.compressed_blocks_path)
+    offsets.numpy().tofile(dataset.compressed_offsets_path)
+
+    conf = json.load(open(conf_path, 'r'))
+    conf['compressed_indices_size'] = os.path.getsize(dataset.compressed_indices_path)
+    json.dump(conf, open(conf_path, 'w'))
+    print('Done!')
+
+    raw_size = os.path.getsize(dataset.indices_path)
+    print('indices.dat: {} bytes, compressed: {} bytes ({:.2f}x)'.format(
+        raw_size, conf['compressed_indices_size'], raw_size / conf['compressed_indices_size']))
+
+
+# Compress indices
+compress_indices()
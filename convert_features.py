@@ -0,0 +1,60 @@
+import argparse
+import os
+import numpy as np
+import torch
+
+from lib.data import *
+
+
+# Parse arguments
+argparser = argparse.ArgumentParser()
+argparser.add_argument('--dataset', type=str, default='ogbn-papers100M')
+argparser.add_argument('--dataset-root', type=str, default='./data/dataset')
+argparser.add_argument('--dtype', type=str, default='float16', choices=['float16', 'bfloat16', 'int8'])
+argparser.add_argument('--chunk-size', type=int, default=1000000)
+args = argparser.parse_args()
+
+# Set path
+dataset_path = os.path.join(args.dataset_root, args.dataset + '-ginex')
+split_idx_path = os.path.join(dataset_path, 'split_idx.pth')
+
+
+# Write features.dat in dtype, chunk_size rows at a time. int8 rows are scaled by
+# max(|x|) / 127 of the row, and the scales are written as float32 next to them.
+def convert_features():
+    print('Converting features to {}...'.format(args.dtype))
+    dataset = GinexDataset(path=dataset_path, split_idx_path=split_idx_path)
+    features = dataset.get_mmapped_features()
+    num_nodes, num_features = features.shape
+
+    features_path = get_features_path(dataset_path, args.dtype)
+    # numpy has no bfloat16, so bfloat16 rows are written through an int16 view
+    np_dtype = {'float16': np.float16, 'bfloat16': np.int16, 'int8': np.int8}[args.dtype]
+    converted = np.memmap(features_path, mode='w+', shape=(num_nodes, num_features), dtype=np_dtype)
+    if args.dtype == 'int8':
+        scales = np.memmap(get_feature_scales_path(dataset_path), mode='w+', shape=(num_nodes,), dtype=np.float32)
+
+    for start in range(0, num_nodes, args.chunk_size):
+        end = min(start + args.chunk_size, num_nodes)
+        chunk = features[start:end].float()
+        if args.dtype == 'float16':
+            converted[start:end] = chunk.half().numpy()
+        elif args.dtype == 'bfloat16':
+            converted[start:end] = chunk.bfloat16().view(torch.int16).numpy()
+        else:
+            scale = chunk.abs().amax(dim=1) / 127
+            q = (chunk / scale.clamp(min=torch.finfo(torch.float32).tiny).unsqueeze(1)).round().clamp(-127, 127)
+            converted[start:end] = q.to(torch.int8).numpy()
+            scales[start:end] = scale.numpy()
+    converted.flush()
+    if args.dtype == 'int8':
+        scales.flush()
+    print('Done!')
+
+    raw_size = os.path.getsize(dataset.features_path)
+    print('features.dat: {} bytes, {}: {} bytes ({:.2f}x)'.format(
+        raw_size, os.path.basename(features_path), os.path.getsize(features_path), raw_size / os.path.getsize(features_path)))
+
+
+# Convert features
+convert_features()
@@ -11,6 +11,8 @@ argparser.add_argument('--dataset', type=str, default='ogbn-papers100M')
 argparser.add_argument('--dataset-root', type=str, default='./data/dataset')
 argparser.add_argument('--neigh-cache-size', type=int, default=45000000000)
 argparser.add_argument('--ginex-num-threads', type=int, default=128)
+argparser.add_argument('--build-chunk-size', type=int, default=8*1024*1024)
+argparser.add_argument('--hugepage', type=str, default='none', choices=['none', 'thp', '2mb', '1gb'])
 args = argparser.parse_args()
 
 # Set environment and path
@@ -26,15 +28,18 @@ def save_neighbor_cache():
     score = dataset.get_score()
     rowptr, col = dataset.get_adj_mat()
     num_nodes = dataset.num_nodes
-    neighbor_cache = NeighborCache(args.neigh_cache_size, score, rowptr, dataset.indices_path, num_nodes)
+    neighbor_cache = NeighborCache(args.neigh_cache_size, score, rowptr, dataset.indices_path, num_nodes,
+                                   chunk_size=args.build_chunk_size, hugepage=args.hugepage)
     del(score)
     print('Done!')
 
     print('Saving neighbor cache...')
     cache_filename = str(dataset_path) + '/nc_size_' + str(args.neigh_cache_size)
     neighbor_cache.save(neighbor_cache.cache.numpy(), cache_filename)
-    cache_tbl_filename = str(dataset_path) + '/nctbl_size_' + str(args.neigh_cache_size)
-    neighbor_cache.save(neighbor_cache.address_table.numpy(), cache_tbl_filename)
+    cache_bitmap_filename = str(dataset_path) + '/ncbits_size_' + str(args.neigh_cache_size)
+    neighbor_cache.save(neighbor_cache.bitmap.numpy(), cache_bitmap_filename)
+    cache_offsets_filename = str(dataset_path) + '/ncoffs_size_' + str(args.neigh_cache_size)
+    neighbor_cache.save(neighbor_cache.offsets.numpy(), cache_offsets_filename)
     print('Done!')
 
 
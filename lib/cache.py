@@ -9,20 +9,13 @@ import os
 from tqdm import tqdm
 
 
-def save(i, in_indices, in_indices_, out_indices, exp_name, sb, trace_dir):
-    path = trace_dir + exp_name + '/sb_' + str(sb) + '_update_' + str(i) + '.pth'
-    torch.save((in_indices.cpu(), in_indices_.cpu(), out_indices.cpu()), path)
+def save(trace_store, i, in_indices, in_indices_, out_indices):
+    trace_store.append(trace.UPDATE, i, [in_indices.cpu(), in_indices_.cpu(), out_indices.cpu()])
 
 
-def load(n_id_list, indices, exp_name, sb, trace_dir):
+def load_into_queue(q, trace_store, indices):
     for i in indices:
-        n_id = torch.load(trace_dir + exp_name + '/sb_' + str(sb) + '_ids_' + str(i) + '.pth')
-        n_id_list[i] = n_id
-
-
-def load_into_queue(q, indices, exp_name, sb, trace_dir):
-    for i in indices:
-        q.put(torch.load(trace_dir + exp_name + '/sb_' + str(sb) + '_ids_' + str(i) + '.pth'))
+        q.put(trace_store.get(trace.IDS, i)[0])
 
 
 def send(q, n_id_list, indices):
@@ -41,29 +34,29 @@ class FeatureCache:
             It is usually same as the superbatch size except the last superbatch of 
             each epoch.
         num_nodes (int): the number of nodes in the graph.
-        mmapped_features (Tensor): the tensor memory-mapped to the feature vectors
+        mmapped_features (Tensor): the tensor memory-mapped to the feature vectors. 
+            The cache is float32 whatever its dtype.
         feature_dim (int): the dimension of the feature vectors
-        exp_name (str): the name of the experiments used to designate the path of the
-            runtime trace files.
-        sb (int): the superbatch number
+        trace_store (TraceStore): the runtime trace of the superbatch. The changesets 
+            are appended to it next to the ids they are computed from.
         verbose (bool): if set, the detailed processing information is displayed
+        feature_scales (Tensor, optional): the per-row scales if mmapped_features 
+            is int8. (default: None)
 
     '''
     def __init__(self, size, effective_sb_size, num_nodes, mmapped_features, 
-            feature_dim, exp_name, sb, trace_dir, verbose):
+            feature_dim, trace_store, verbose, feature_scales=None):
         
         self.size = size
         self.effective_sb_size = effective_sb_size
-        # The current implementation use int16 for 'iters' which limits the number of 
-        # iterations to perform cache state simulation.
-        if self.effective_sb_size > torch.iinfo(torch.int16).max:
+        # The next-access index records iterations as int32 values (see changeset.cpp).
+        if self.effective_sb_size >= torch.iinfo(torch.int32).max:
             raise ValueError
         self.num_nodes = num_nodes
         self.mmapped_features = mmapped_features
+        self.feature_scales = feature_scales
         self.feature_dim = feature_dim
-        self.exp_name = exp_name
-        self.sb = sb
-        self.trace_dir = trace_dir
+        self.trace_store = trace_store
         self.verbose = verbose
 
         # The address table of the cache has num_nodes entries each of which is a single
@@ -81,108 +74,53 @@ class FeatureCache:
         self.address_table[indices] = torch.arange(indices.numel(), dtype=torch.int32)
         orig_num_threads = torch.get_num_threads() 
         torch.set_num_threads(int(os.environ['GINEX_NUM_THREADS']))
-        self.cache = self.mmapped_features[indices]
+        if self.mmapped_features.dtype == torch.float32:
+            self.cache = self.mmapped_features[indices]
+        else:
+            # The cache is filled once, so it gets its own buffer rather than one
+            # that gather_mmap would pool
+            self.cache = torch.empty((indices.numel(), self.feature_dim), dtype=torch.float32)
+            gather_mmap(self.mmapped_features, indices, out=self.cache, scales=self.feature_scales)
         torch.set_num_threads(orig_num_threads) 
 
 
-    # Two passes over ids files to construct data structures for cache state simulation and
-    # figure out the initial cache indices.
+    # Two passes over the ids in the trace to construct the next-access index for
+    # cache state simulation and figure out the initial cache indices. Both run on
+    # CPU threads (see changeset.cpp).
     def pass_1_and_2(self):
         if self.verbose:
             tqdm.write('Loading ids...')
-        num_threads = 16
-        n_id_list = [[]] * self.effective_sb_size
-        loader = list()
-        for t in range(num_threads):
-            loader.append(threading.Thread(target=load, args=( n_id_list, list(range(t, len(n_id_list), num_threads)), self.exp_name, self.sb, self.trace_dir ) ) )
-            loader[t].start()
-        for t in range(num_threads):
-            loader[t].join()
-        if self.verbose:
-            tqdm.write('Done!')
-        
-        # Pass 1
-        if self.verbose:
-            tqdm.write('Pass 1: calculating frequency and initial cache indices...')
-        frq = torch.zeros(self.num_nodes, dtype=torch.int16, device='cuda')
-        filled=False
-        count=0
-        initial_cache_indices = torch.empty((0,), dtype=torch.int64, device='cuda')
-        for n_id in n_id_list:
-            n_id = n_id.cuda()
-            if not filled:
-                to_cache = n_id[frq[n_id] == 0]
-                count += to_cache.numel()
-                if count >= self.num_entries:
-                    to_cache = to_cache[:self.num_entries-(count-to_cache.numel())]
-                    initial_cache_indices = torch.cat([initial_cache_indices, to_cache])
-                    filled=True
-                else:
-                    initial_cache_indices = torch.cat([initial_cache_indices, to_cache])
-
-            frq[n_id] += 1
+        # The ids point into the trace, so nothing is copied
+        n_id_list = [self.trace_store.get(trace.IDS, i)[0] for i in range(self.effective_sb_size)]
         if self.verbose:
             tqdm.write('Done!')
 
-        # Pass 2
         if self.verbose:
-            tqdm.write('Pass 2: making two key data structures (iterptr & iters)...')
-        msb = (torch.tensor([1], dtype=torch.int16) << 15).cuda()
-
-        cumsum = frq.cumsum(dim=0)
-        iterptr = torch.cat([torch.tensor([0,0], device='cuda'), cumsum[:-1]]); del(cumsum)
-        frq_sum = frq.sum(); del(frq)
-
-        iters = torch.zeros(frq_sum+1, dtype=torch.int16, device='cuda')
-        iters[-1] = self.effective_sb_size
-
-        for i, n_id in enumerate(n_id_list):
-            n_id_cuda = n_id.cuda()
-            tmp = iterptr[n_id_cuda+1]
-            iters[tmp] = i; del(tmp)
-            iterptr[n_id_cuda+1] += 1; del(n_id_cuda)
-        iters[iterptr[1:]] |= msb
-        iterptr = iterptr[:-1]
-        iterptr[0] = 0
+            tqdm.write('Pass 1 and 2: making the next-access index and initial cache indices...')
+        num_threads = int(os.environ['GINEX_NUM_THREADS'])
+        access_ptr, accesses, initial_cache_indices = changeset.build_access_index(
+            n_id_list, self.num_nodes, self.num_entries, num_threads)
 
         del(n_id_list)
         if self.verbose:
-            tqdm.write('Done!')
+            tqdm.write('Done! The next-access index takes {} bytes'.format(
+                access_ptr.numel() * access_ptr.element_size() + accesses.numel()))
 
-        return iterptr, iters, initial_cache_indices
+        return access_ptr, accesses, initial_cache_indices
 
 
-    # The last pass over ids files to simulate the cache state.
-    def pass_3(self, iterptr, iters, initial_cache_indices):
+    # The last pass over the ids in the trace to simulate the cache state. The
+    # simulation runs on CPU threads (see changeset.cpp).
+    def pass_3(self, access_ptr, accesses, initial_cache_indices):
         if self.verbose:
             tqdm.write('Pass 3: Computing changesets...')
 
-        # Two auxiliary data structures for efficient cache state simulation
-        #
-        # cache_table: a table recording each node's state which is updated every
-        #   iteration of the simulation. It has entries as many as the total number 
-        #   of the nodes in the graph. Specifically, the last three bits of each 
-        #   entires are used.
-        #   bit 0: set if the feature vector of the corresponindg node is in the  
-        #   cache at the current iteration
-        #   bit 1: set if the feature vector of the corresponding node is accessed  
-        #   at the current interation
-        #   bit 2: set if the node is selected to be kept in the cache for the next 
-        #   iteration
-        #   bit 3~7: don't care
-        #
-        # map_table: mapping table that directly maps relative indices of the feature 
-        #   vectors in the batch inputs, which is the output of gather, to their 
-        #   absolute indices
-
-        cache_table = torch.zeros(self.num_nodes, dtype=torch.int8, device='cuda')
-        cache_table[initial_cache_indices] += 1; del(initial_cache_indices)
-        map_table = torch.full((self.num_nodes,), -1, dtype=torch.int32, device='cuda')
-        
-        msb = (torch.tensor([1], dtype=torch.int16) << 15).cuda()
+        num_threads = int(os.environ['GINEX_NUM_THREADS'])
+        simulator = changeset.ChangesetSimulator(access_ptr, accesses, initial_cache_indices,
+                                                 self.num_nodes, self.num_entries, self.effective_sb_size, num_threads)
+        del(access_ptr); del(accesses); del(initial_cache_indices)
 
         save_p = None
-        threshold = 0
 
         # Multi-threaded streaming of n_ids
         q = list()
@@ -190,88 +128,28 @@ class FeatureCache:
         num_threads = 16
         for t in range(num_threads):
             q.append(Queue(maxsize=2))
-            loader.append(threading.Thread(target=load_into_queue, args=(q[t], list(range(t, self.effective_sb_size, num_threads)), self.exp_name, self.sb, self.trace_dir), daemon=True))
+            loader.append(threading.Thread(target=load_into_queue, args=(q[t], self.trace_store, list(range(t, self.effective_sb_size, num_threads))), daemon=True))
             loader[t].start()
 
         for i in range(self.effective_sb_size):
-            # Get n_id from the queue and send n_id to GPU
             n_id = q[i % num_threads].get()
-            n_id_cuda = n_id.cuda()
-            del(n_id)
-
-            # Map table update
-            map_table[n_id_cuda] = torch.arange(n_id_cuda.numel(), dtype=torch.int32, device='cuda')
-            
-            # Update iterptr
-            iterptr[n_id_cuda] += 1
-            last_access = n_id_cuda[(iters[iterptr[n_id_cuda]] < 0)]
-            iterptr[last_access] = iters.numel()-1; del(last_access)
-
-            # Get candidates
-            # candidates = union(current cache indices, incoming indices)
-            cache_table[n_id_cuda] += 2
-            candidates = (cache_table > 0).nonzero().squeeze(); del(n_id_cuda)
-
-            # Get next access iterations of candidates
-            next_access_iters = iters[iterptr[candidates]]
-            next_access_iters.bitwise_and_(~msb)
-            
-            # Find num_entries elements in candidates with the smallest next access
-            # iteration by incrementally tracking threshold
-            count = (next_access_iters <= threshold).sum()
-            prev_status = (count >= self.num_entries)
-
-            if prev_status:
-                # Current threshold is high
-                threshold -= 1
-            else:
-                # Current threshold is low
-                threshold += 1
-            while (True):
-                if threshold > self.effective_sb_size:
-                    num_remains = 0
-                    break
-
-                count = (next_access_iters <= threshold).sum()
-                curr_status = (count >= self.num_entries)
-                if (prev_status ^ curr_status):
-                    if curr_status:
-                        num_remains = self.num_entries - (next_access_iters <= (threshold-1)).sum()
-                        threshold -= 1
-                    else:
-                        num_remains = self.num_entries - count
-                    break
-                elif (curr_status): threshold -= 1
-                else: threshold += 1
-            
-            cache_table[candidates[next_access_iters <= threshold]] |= 4
-            cache_table[candidates[next_access_iters == (threshold+1)][:num_remains]] |= 4
-            del(candidates)
-            del(next_access_iters)
-           
+
             # in_indices: indices to newly insert into cache
             # in_positions: relative positions of nodes in in_indices within batch input
             # out_indices: indices to evict from cache
-            in_indices = (cache_table == 2+4).nonzero().squeeze()
-            in_positions = map_table[in_indices]
-            out_indices = ((cache_table == 1) | (cache_table == 3)).nonzero().squeeze()
+            in_indices, in_positions, out_indices = simulator.step(n_id)
 
-            # Configure cache table & map table for the next iteration
-            cache_table >>= 2
-            map_table[:] = -1
-
-            # Multi-threaded save of changeset precomputation result
-            save_p = threading.Thread(target=save, args=(i, in_indices, in_positions, out_indices, self.exp_name, self.sb, self.trace_dir))
+            # Save the changeset while the next one is computed. Both release
+            # the GIL, and a save at a time bounds the changesets held.
+            if save_p is not None:
+                save_p.join()
+            save_p = threading.Thread(target=save, args=(self.trace_store, i, in_indices, in_positions, out_indices))
             save_p.start()
-            
-            del(in_indices); del(out_indices); del(in_positions);
-
-            #####################################################################
+            del(n_id); del(in_indices); del(in_positions); del(out_indices)
 
-        del(cache_table)
-        del(iterptr)
-        del(iters)
-        del(map_table)
+        if save_p is not None:
+            save_p.join()
+        del(simulator)
 
         if self.verbose:
             tqdm.write('Done!')
@@ -295,40 +173,60 @@ class NeighborCache:
         indptr (Tensor): the indptr tensor.
         indices (Tensor): the (memory-mapped) indices tensor.
         num_nodes (int): the number of nodes in the graph.
+        chunk_size (int): the size in bytes of the sequential reads of indices used to 
+            fill the cache. (default: 8388608)
+        hugepage (str): the pages of the cache data, 'none', 'thp', '2mb' or '1gb'. 
+            (default: 'none')
+
+    Cached rows are stored in node ID order without a count, as 32-bit IDs if the
+    graph has at most 2^32 nodes. A bitmap over the nodes marks the cached rows,
+    and offsets holds the start of the k-th cached row in the cache.
     '''
-    def __init__(self, size, score, indptr, indices, num_nodes):
+    def __init__(self, size, score, indptr, indices, num_nodes, chunk_size=8*1024*1024, hugepage='none'):
         self.size = size
         self.indptr = indptr
         self.indices = indices
         self.num_nodes = num_nodes
+        self.chunk_size = chunk_size
+        self.hugepage = hugepage
 
-        self.cache, self.address_table, self.num_entries = self.init_by_score(score)
+        self.cache, self.bitmap, self.offsets, self.num_entries = self.init_by_score(score)
 
 
     def init_by_score(self, score):
         sorted_indices = score.argsort(descending=True)
         neighbor_counts = self.indptr[1:] - self.indptr[:-1]
-        neighbor_counts = neighbor_counts[sorted_indices]
 
-        table_size = self.num_nodes*8
-        cache_size = int((self.size - table_size)/8)
+        dtype = torch.int32 if self.num_nodes <= 2**32 else torch.int64
+        id_size = 4 if dtype == torch.int32 else 8
+        num_words = (self.num_nodes + 63) // 64
+
+        # The bitmap and the last offset are paid for up front
+        cache_size = self.size - num_words*8 - 8
         if cache_size < 0:
             raise ValueError
 
-        address_table = torch.full((self.num_nodes,), -1, dtype=torch.int64)
-
         # Fetch neighborhood information of nodes into the cache one by one in order
-        # of score until the cache gets full
-        cumulative_size = torch.cumsum(neighbor_counts+1, dim=0)
+        # of score until the cache gets full. A row costs its offset and neighbors.
+        cumulative_size = torch.cumsum(neighbor_counts[sorted_indices]*id_size + 8, dim=0)
         num_entries = (cumulative_size <= cache_size).sum().item()
-        address_table[sorted_indices[:num_entries]] = torch.cat([torch.zeros(1).long(), cumulative_size[:num_entries-1]])
-        cached_idx = (address_table >= 0).nonzero().squeeze()
+        cached_idx = sorted_indices[:num_entries].sort().values
+
+        offsets = torch.zeros(num_entries+1, dtype=torch.int64)
+        torch.cumsum(neighbor_counts[cached_idx], dim=0, out=offsets[1:])
+
+        bits = np.zeros(num_words*64, dtype=np.bool_)
+        bits[cached_idx.numpy()] = True
+        bitmap = torch.from_numpy(np.packbits(bits, bitorder='little').view(np.int64))
 
         # Multi-threaded load of neighborhood information
-        cache = torch.zeros(cache_size, dtype=torch.int64)
-        fill_neighbor_cache(cache, self.indptr, self.indices, cached_idx, address_table, num_entries)
+        cache = alloc_tensor(offsets[-1].item(), 'int32' if dtype == torch.int32 else 'int64', self.hugepage)
+        bytes_stored, bytes_read, seconds = fill_neighbor_cache(cache, self.indptr, self.indices, cached_idx, offsets, num_entries,
+                                                                chunk_size=self.chunk_size)
+        print('Filled {} rows: {:.2f} GB stored, {:.2f} GB read in {:.1f} s ({:.2f} GB/s)'.format(
+            num_entries, bytes_stored/1e9, bytes_read/1e9, seconds, bytes_read/1e9/max(seconds, 1e-9)))
                     
-        return cache, address_table, num_entries
+        return cache, bitmap, offsets, num_entries
 
 
     def save(self, data, filename):
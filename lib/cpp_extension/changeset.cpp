@@ -0,0 +1,320 @@
+#include <stdlib.h>
+#include <omp.h>
+#include <torch/extension.h>
+#include <Python.h>
+#include <pybind11/pybind11.h>
+#include <pybind11/stl.h>
+#include <errno.h>
+#include <cstring>
+#include <inttypes.h>
+#include <algorithm>
+#include <vector>
+#define CHANGESET_CACHED 1
+#define CHANGESET_INCOMING 2
+#define CHANGESET_REJECTED 4
+
+
+int changeset_num_threads(){
+    char* env = getenv("GINEX_NUM_THREADS");
+    return env ? atoi(env) : omp_get_max_threads();
+}
+
+
+// The next-access index of a superbatch lists the iterations that access each
+// node as LEB128 varints in a byte array. The first varint of a node is its
+// first access plus one and the others are the distances to the previous
+// access, so all of them are at least 1 and a 0 byte ends the list. Most
+// distances fit in one or two bytes, and iterations may go up to INT32_MAX.
+inline int varint_size(int64_t value){
+    int size = 1;
+    while (value >= 0x80) {
+        value >>= 7;
+        size++;
+    }
+    return size;
+}
+
+
+inline uint8_t* varint_write(uint8_t* ptr, int64_t value){
+    while (value >= 0x80) {
+        *ptr++ = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    *ptr++ = (uint8_t)value;
+    return ptr;
+}
+
+
+inline int64_t varint_read(const uint8_t* ptr){
+    int64_t value = 0;
+    int shift = 0;
+    while (*ptr & 0x80) {
+        value |= (int64_t)(*ptr++ & 0x7f) << shift;
+        shift += 7;
+    }
+    return value | ((int64_t)*ptr << shift);
+}
+
+
+inline const uint8_t* varint_skip(const uint8_t* ptr){
+    while (*ptr++ & 0x80);
+    return ptr;
+}
+
+
+// Pass 1 and 2 of the changeset precomputation over the ids of every iteration
+// of a superbatch. Return the offsets of the nodes' lists in the next-access
+// index, the index itself, and the initial cache indices: the first num_entries
+// nodes to be accessed, in the order they are. Each pass goes over the
+// iterations in order and over the nodes of an iteration on num_threads
+// threads, which needs no atomics as n_id has no duplicates.
+std::tuple<torch::Tensor, torch::Tensor, torch::Tensor>
+build_access_index(std::vector<torch::Tensor> n_id_list, int64_t num_nodes, int64_t num_entries, int num_threads){
+    int64_t num_iters = n_id_list.size();
+    TORCH_CHECK(num_iters < INT32_MAX, "a superbatch has at most ", INT32_MAX - 1, " iterations");
+    num_threads = num_threads > 0 ? num_threads : changeset_num_threads();
+    for (torch::Tensor &n_id : n_id_list) {
+        TORCH_CHECK(!n_id.is_cuda() && n_id.scalar_type() == torch::kInt64, "n_id must be an int64 CPU tensor");
+        n_id = n_id.contiguous();
+    }
+
+    // Pass 1: the bytes of every node's list and the initial cache indices
+    std::vector<int32_t> last(num_nodes, -1);
+    std::vector<int64_t> cursor(num_nodes + 1, 0);
+    std::vector<int64_t> initial;
+    bool filled = num_entries <= 0;
+    for (int64_t i = 0; i < num_iters; i++) {
+        int64_t* n_id_data = n_id_list[i].data_ptr<int64_t>();
+        int64_t batch_size = n_id_list[i].numel();
+        for (int64_t p = 0; p < batch_size && !filled; p++) {
+            if (last[n_id_data[p]] == -1) {
+                initial.push_back(n_id_data[p]);
+                filled = (int64_t)initial.size() >= num_entries;
+            }
+        }
+        #pragma omp parallel for num_threads(num_threads)
+        for (int64_t p = 0; p < batch_size; p++) {
+            int64_t v = n_id_data[p];
+            cursor[v] += varint_size(i - last[v]);
+            last[v] = i;
+        }
+    }
+
+    // The offsets of the lists, each with its 0 byte
+    auto access_ptr = torch::empty({num_nodes + 1}, torch::kInt64);
+    int64_t* access_ptr_data = access_ptr.data_ptr<int64_t>();
+    std::vector<int64_t> chunk_offsets(num_threads + 1, 0);
+    #pragma omp parallel num_threads(num_threads)
+    {
+        int t = omp_get_thread_num(), nt = omp_get_num_threads();
+        int64_t begin = num_nodes * t / nt, end = num_nodes * (t + 1) / nt;
+        int64_t bytes = 0;
+        for (int64_t v = begin; v < end; v++) {
+            if (last[v] != -1)
+                cursor[v]++;
+            bytes += cursor[v];
+        }
+        chunk_offsets[t + 1] = bytes;
+        #pragma omp barrier
+        #pragma omp single
+        for (int n = 0; n < nt; n++)
+            chunk_offsets[n + 1] += chunk_offsets[n];
+        int64_t offset = chunk_offsets[t];
+        for (int64_t v = begin; v < end; v++) {
+            int64_t size = cursor[v];
+            access_ptr_data[v] = offset;
+            cursor[v] = offset;
+            offset += size;
+        }
+        if (t == nt - 1)
+            access_ptr_data[num_nodes] = offset;
+    }
+    int64_t total_bytes = access_ptr_data[num_nodes];
+
+    // Pass 2: the lists
+    auto accesses = torch::empty({total_bytes}, torch::kUInt8);
+    uint8_t* accesses_data = accesses.data_ptr<uint8_t>();
+    std::fill(last.begin(), last.end(), -1);
+    for (int64_t i = 0; i < num_iters; i++) {
+        int64_t* n_id_data = n_id_list[i].data_ptr<int64_t>();
+        int64_t batch_size = n_id_list[i].numel();
+        #pragma omp parallel for num_threads(num_threads)
+        for (int64_t p = 0; p < batch_size; p++) {
+            int64_t v = n_id_data[p];
+            cursor[v] = varint_write(accesses_data + cursor[v], i - last[v]) - accesses_data;
+            last[v] = i;
+        }
+    }
+    #pragma omp parallel for num_threads(num_threads)
+    for (int64_t v = 0; v < num_nodes; v++)
+        if (last[v] != -1)
+            accesses_data[cursor[v]] = 0;
+
+    auto initial_cache_indices = torch::empty({(int64_t)initial.size()}, torch::kInt64);
+    if (!initial.empty())
+        memcpy(initial_cache_indices.data_ptr<int64_t>(), initial.data(), initial.size()*sizeof(int64_t));
+    return std::make_tuple(access_ptr, accesses, initial_cache_indices);
+}
+
+
+// Simulates the feature cache of a superbatch with Belady's policy and gives
+// the changeset of every iteration, as FeatureCache.pass_3 did on the GPU. At
+// each iteration the cache keeps the num_entries nodes among the cached and the
+// incoming ones that are accessed again the soonest, and the smallest node IDs
+// among those accessed next at the same iteration.
+//
+// The candidates are kept in buckets by their next access iteration, with a
+// max-heap of node IDs in each. Nodes that are not accessed again in the
+// superbatch are in the bucket of effective_sb_size. A cached node accessed at
+// iteration i is always in bucket i, so a step empties bucket i, puts the batch
+// into the buckets of their next accesses and evicts from the top bucket down
+// until num_entries nodes are left. It costs O(batch size * log) whatever the
+// number of nodes in the graph.
+//
+// access_ptr and accesses are the next-access index from build_access_index.
+// The simulator advances access_ptr[v] in place to the varint that leads to the
+// next access of node v.
+class ChangesetSimulator
+{
+public:
+    ChangesetSimulator(torch::Tensor access_ptr, torch::Tensor accesses, torch::Tensor initial_cache_indices,
+                       int64_t num_nodes, int64_t num_entries, int64_t effective_sb_size, int num_threads){
+        TORCH_CHECK(!access_ptr.is_cuda() && !accesses.is_cuda() && !initial_cache_indices.is_cuda(),
+                    "the changeset simulator runs on the CPU");
+        TORCH_CHECK(access_ptr.scalar_type() == torch::kInt64 && accesses.scalar_type() == torch::kUInt8 &&
+                    initial_cache_indices.scalar_type() == torch::kInt64, "access_ptr, accesses and initial_cache_indices must be int64, uint8 and int64");
+        TORCH_CHECK(access_ptr.numel() >= num_nodes, "access_ptr must have an entry for every node");
+
+        this->access_ptr = access_ptr.contiguous();
+        this->accesses = accesses.contiguous();
+        this->num_nodes = num_nodes;
+        this->num_entries = num_entries;
+        this->effective_sb_size = effective_sb_size;
+        this->num_threads = num_threads > 0 ? num_threads : changeset_num_threads();
+        this->iteration = 0;
+        this->num_candidates = 0;
+        this->top = 0;
+        this->state.assign(num_nodes, 0);
+        this->buckets.resize(effective_sb_size + 1);
+
+        int64_t* access_ptr_data = this->access_ptr.data_ptr<int64_t>();
+        uint8_t* accesses_data = this->accesses.data_ptr<uint8_t>();
+        int64_t* initial_data = initial_cache_indices.contiguous().data_ptr<int64_t>();
+        for (int64_t n = 0; n < initial_cache_indices.numel(); n++) {
+            int64_t v = initial_data[n];
+            this->insert(v, varint_read(accesses_data + access_ptr_data[v]) - 1);
+            this->state[v] = CHANGESET_CACHED;
+        }
+    }
+
+    // Advance the simulation by the batch n_id of the next iteration, and return
+    // the nodes to insert into the cache, their positions in n_id and the nodes
+    // to evict from the cache, in ascending order of node IDs
+    std::tuple<torch::Tensor, torch::Tensor, torch::Tensor> step(torch::Tensor n_id){
+        TORCH_CHECK(this->iteration < this->effective_sb_size, "the simulation is past its ", this->effective_sb_size, " iterations");
+        TORCH_CHECK(!n_id.is_cuda() && n_id.scalar_type() == torch::kInt64, "n_id must be an int64 CPU tensor");
+        n_id = n_id.contiguous();
+        int64_t* n_id_data = n_id.data_ptr<int64_t>();
+        int64_t batch_size = n_id.numel();
+        int64_t* access_ptr_data = this->access_ptr.data_ptr<int64_t>();
+        uint8_t* accesses_data = this->accesses.data_ptr<uint8_t>();
+        int64_t iteration = this->iteration;
+
+        // The next accesses of the batch. n_id has no duplicates, so each node
+        // is advanced by one thread.
+        std::vector<int64_t> next(batch_size);
+        #pragma omp parallel for num_threads(this->num_threads)
+        for (int64_t p = 0; p < batch_size; p++) {
+            int64_t v = n_id_data[p];
+            const uint8_t* ptr = varint_skip(accesses_data + access_ptr_data[v]);
+            access_ptr_data[v] = ptr - accesses_data;
+            next[p] = *ptr ? iteration + varint_read(ptr) : this->effective_sb_size;
+            if (!(this->state[v] & CHANGESET_CACHED))
+                this->state[v] = CHANGESET_INCOMING;
+        }
+
+        // The cached nodes of the batch are all in this iteration's bucket
+        std::vector<int64_t> &current = this->buckets[this->iteration];
+        this->num_candidates -= current.size();
+        std::vector<int64_t>().swap(current);
+        for (int64_t p = 0; p < batch_size; p++)
+            this->insert(n_id_data[p], next[p]);
+
+        std::vector<int64_t> out_indices;
+        while (this->num_candidates > this->num_entries) {
+            while (this->buckets[this->top].empty())
+                this->top--;
+            std::vector<int64_t> &bucket = this->buckets[this->top];
+            std::pop_heap(bucket.begin(), bucket.end());
+            int64_t v = bucket.back();
+            bucket.pop_back();
+            this->num_candidates--;
+            if (this->state[v] & CHANGESET_CACHED) {
+                this->state[v] = 0;
+                out_indices.push_back(v);
+            }
+            else {
+                this->state[v] |= CHANGESET_REJECTED;
+            }
+        }
+
+        std::vector<std::pair<int64_t, int32_t>> in_nodes;
+        for (int64_t p = 0; p < batch_size; p++) {
+            int64_t v = n_id_data[p];
+            if (this->state[v] == CHANGESET_INCOMING)
+                in_nodes.push_back({v, (int32_t)p});
+            if (this->state[v] & CHANGESET_INCOMING)
+                this->state[v] = this->state[v] & CHANGESET_REJECTED ? 0 : CHANGESET_CACHED;
+        }
+        std::sort(in_nodes.begin(), in_nodes.end());
+        std::sort(out_indices.begin(), out_indices.end());
+        this->iteration++;
+
+        auto in_indices = torch::empty({(int64_t)in_nodes.size()}, torch::kInt64);
+        auto in_positions = torch::empty({(int64_t)in_nodes.size()}, torch::kInt32);
+        int64_t* in_indices_data = in_indices.data_ptr<int64_t>();
+        int32_t* in_positions_data = in_positions.data_ptr<int32_t>();
+        for (size_t n = 0; n < in_nodes.size(); n++) {
+            in_indices_data[n] = in_nodes[n].first;
+            in_positions_data[n] = in_nodes[n].second;
+        }
+        auto out = torch::empty({(int64_t)out_indices.size()}, torch::kInt64);
+        if (!out_indices.empty())
+            memcpy(out.data_ptr<int64_t>(), out_indices.data(), out_indices.size()*sizeof(int64_t));
+
+        return std::make_tuple(in_indices, in_positions, out);
+    }
+
+private:
+    void insert(int64_t v, int64_t next){
+        std::vector<int64_t> &bucket = this->buckets[next];
+        bucket.push_back(v);
+        std::push_heap(bucket.begin(), bucket.end());
+        this->num_candidates++;
+        this->top = std::max(this->top, next);
+    }
+
+    torch::Tensor access_ptr;
+    torch::Tensor accesses;
+    int64_t num_nodes;
+    int64_t num_entries;
+    int64_t effective_sb_size;
+    int num_threads;
+    int64_t iteration;
+    int64_t num_candidates;
+    int64_t top;
+    std::vector<uint8_t> state;
+    std::vector<std::vector<int64_t>> buckets;
+};
+
+
+PYBIND11_MODULE(changeset, m) {
+    m.def("build_access_index", &build_access_index, "pass 1 and 2 of the changeset precomputation",
+          py::arg("n_id_list"), py::arg("num_nodes"), py::arg("num_entries"), py::arg("num_threads") = -1,
+          py::call_guard<py::gil_scoped_release>());
+    py::class_<ChangesetSimulator>(m, "ChangesetSimulator")
+        .def(py::init<torch::Tensor, torch::Tensor, torch::Tensor, int64_t, int64_t, int64_t, int>(),
+             py::arg("access_ptr"), py::arg("accesses"), py::arg("initial_cache_indices"), py::arg("num_nodes"),
+             py::arg("num_entries"), py::arg("effective_sb_size"), py::arg("num_threads") = -1)
+        .def("step", &ChangesetSimulator::step, py::arg("n_id"), py::call_guard<py::gil_scoped_release>());
+}
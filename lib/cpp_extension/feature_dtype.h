@@ -0,0 +1,107 @@
+#pragma once
+#include <torch/extension.h>
+#include <strings.h>
+#include <cstring>
+#include <string>
+
+// Dtypes of feature rows on disk and in the feature caches. features.dat is
+// float32; convert_features.py writes float16, bfloat16 and int8 copies of it.
+// int8 rows are scaled per row (value = q * scale), and the float32 scales are
+// kept in a file of their own, so the row stride of every dtype stays
+// dim * sizeof(dtype) with no header in front of a row.
+enum class FeatureDtype {
+    Float32,
+    Float16,
+    BFloat16,
+    Int8
+};
+
+inline FeatureDtype parse_feature_dtype(const std::string &name) {
+    if (strcasecmp(name.c_str(), "float32") == 0)
+        return FeatureDtype::Float32;
+    if (strcasecmp(name.c_str(), "float16") == 0)
+        return FeatureDtype::Float16;
+    if (strcasecmp(name.c_str(), "bfloat16") == 0)
+        return FeatureDtype::BFloat16;
+    if (strcasecmp(name.c_str(), "int8") == 0)
+        return FeatureDtype::Int8;
+    TORCH_CHECK(false, "unsupported feature dtype ", name);
+}
+
+inline FeatureDtype feature_dtype_of(torch::ScalarType type) {
+    switch (type) {
+    case torch::kFloat32: return FeatureDtype::Float32;
+    case torch::kFloat16: return FeatureDtype::Float16;
+    case torch::kBFloat16: return FeatureDtype::BFloat16;
+    case torch::kInt8: return FeatureDtype::Int8;
+    default: TORCH_CHECK(false, "unsupported feature dtype ", type);
+    }
+}
+
+inline torch::ScalarType feature_scalar_type(FeatureDtype dtype) {
+    switch (dtype) {
+    case FeatureDtype::Float16: return torch::kFloat16;
+    case FeatureDtype::BFloat16: return torch::kBFloat16;
+    case FeatureDtype::Int8: return torch::kInt8;
+    default: return torch::kFloat32;
+    }
+}
+
+inline int64_t feature_dtype_size(FeatureDtype dtype) {
+    switch (dtype) {
+    case FeatureDtype::Float16:
+    case FeatureDtype::BFloat16: return 2;
+    case FeatureDtype::Int8: return 1;
+    default: return 4;
+    }
+}
+
+template <typename S, typename D>
+inline void convert_values(D* dst, const S* src, int64_t count, float scale) {
+    for (int64_t i = 0; i < count; i++)
+        dst[i] = static_cast<D>(static_cast<float>(src[i]) * scale);
+}
+
+template <typename S>
+inline void convert_rows_from(void* dst, FeatureDtype cache_dtype, const S* src,
+                              int64_t dim, int64_t num_rows, const float* scales) {
+    for (int64_t r = 0; r < num_rows; r++) {
+        float scale = scales ? scales[r] : 1.0f;
+        switch (cache_dtype) {
+        case FeatureDtype::Float32:
+            convert_values((float*)dst + r*dim, src + r*dim, dim, scale);
+            break;
+        case FeatureDtype::Float16:
+            convert_values((c10::Half*)dst + r*dim, src + r*dim, dim, scale);
+            break;
+        case FeatureDtype::BFloat16:
+            convert_values((c10::BFloat16*)dst + r*dim, src + r*dim, dim, scale);
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+// Convert num_rows rows of dim values from src in dtype to dst in cache_dtype,
+// which must not be int8. scales holds the scale of each row if dtype is int8.
+inline void convert_rows(void* dst, FeatureDtype cache_dtype, const void* src, FeatureDtype dtype,
+                         int64_t dim, int64_t num_rows, const float* scales) {
+    switch (dtype) {
+    case FeatureDtype::Float32:
+        if (cache_dtype == FeatureDtype::Float32)
+            memcpy(dst, src, num_rows*dim*sizeof(float));
+        else
+            convert_rows_from(dst, cache_dtype, (const float*)src, dim, num_rows, NULL);
+        break;
+    case FeatureDtype::Float16:
+        convert_rows_from(dst, cache_dtype, (const c10::Half*)src, dim, num_rows, NULL);
+        break;
+    case FeatureDtype::BFloat16:
+        convert_rows_from(dst, cache_dtype, (const c10::BFloat16*)src, dim, num_rows, NULL);
+        break;
+    case FeatureDtype::Int8:
+        convert_rows_from(dst, cache_dtype, (const int8_t*)src, dim, num_rows, scales);
+        break;
+    }
+}
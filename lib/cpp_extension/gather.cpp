@@ -12,110 +12,600 @@
 #include <inttypes.h>
 #include <ATen/ATen.h>
 #include <pthread.h>
+#include <liburing.h>
+#include <vector>
+#include <algorithm>
+#include <mutex>
+#include <memory>
+#include <unordered_map>
+#include <chrono>
+#include <random>
+#include "row_copy.h"
+#include "feature_dtype.h"
 #define ALIGNMENT 4096
+#define GATHER_IO_DEPTH 256
+#define GATHER_MAX_READ (64*1024)
+#define GATHER_MAX_GAP (8*1024)
+#define GATHER_POOL_BUFFERS 4
+#define GATHER_POOL_BYTES (1024L*1024*1024)
+#define GATHER_POOL_MAX_BUFFER (256L*1024*1024)
 
-torch::Tensor gather_mmap(torch::Tensor features, torch::Tensor idx, int64_t feature_dim){
+// Recycles the aligned buffers of gather results. Sizes are rounded up to one of
+// eight steps per power of two, and up to GATHER_POOL_BUFFERS free buffers are
+// kept per size, GATHER_POOL_BYTES in all. Buffers over GATHER_POOL_MAX_BUFFER
+// are freed with their tensor. A result tensor hands its buffer back from its
+// deleter, which also keeps the pool alive.
+class BufferPool : public std::enable_shared_from_this<BufferPool>
+{
+public:
+    torch::Tensor get(int64_t num_rows, int64_t feature_dim) {
+        int64_t size = round_size(std::max(num_rows*feature_dim*(int64_t)sizeof(float), (int64_t)1));
+        void* buffer = NULL;
+        if (size <= GATHER_POOL_MAX_BUFFER) {
+            std::lock_guard<std::mutex> guard(this->mutex);
+            auto entry = this->free_buffers.find(size);
+            if (entry != this->free_buffers.end() && !entry->second.empty()) {
+                buffer = entry->second.back();
+                entry->second.pop_back();
+                this->free_bytes -= size;
+            }
+        }
+        if (!buffer)
+            buffer = aligned_alloc(ALIGNMENT, size);
+        TORCH_CHECK(buffer != NULL, "cannot allocate ", size, " bytes for the gather result");
+
+        std::shared_ptr<BufferPool> pool = shared_from_this();
+        auto options = torch::TensorOptions()
+            .dtype(torch::kFloat32)
+            .layout(torch::kStrided)
+            .device(torch::kCPU)
+            .requires_grad(false);
+        return torch::from_blob(buffer, {num_rows, feature_dim},
+                                [pool, size](void* data) { pool->put(data, size); }, options);
+    }
+
+    ~BufferPool() {
+        for (auto &entry : this->free_buffers)
+            for (void* buffer : entry.second)
+                free(buffer);
+    }
+
+private:
+    std::mutex mutex;
+    std::unordered_map<int64_t, std::vector<void*>> free_buffers;
+    int64_t free_bytes = 0;
+
+    static int64_t round_size(int64_t size) {
+        int64_t step = std::max((int64_t)ALIGNMENT, (int64_t)1 << (63 - __builtin_clzll(size)) >> 3);
+        return (size + step - 1) / step * step;
+    }
+
+    void put(void* buffer, int64_t size) {
+        if (size <= GATHER_POOL_MAX_BUFFER) {
+            std::lock_guard<std::mutex> guard(this->mutex);
+            std::vector<void*> &buffers = this->free_buffers[size];
+            if (buffers.size() < GATHER_POOL_BUFFERS && this->free_bytes + size <= GATHER_POOL_BYTES) {
+                buffers.push_back(buffer);
+                this->free_bytes += size;
+                return;
+            }
+        }
+        free(buffer);
+    }
+};
+
+std::shared_ptr<BufferPool> gather_pool = std::make_shared<BufferPool>();
+
+
+// Rows [0, num_idx) of out if it is given, else a tensor from gather_pool. out
+// must be a contiguous float32 CPU tensor of at least num_idx rows of feature_dim,
+// so a caller can reuse, say, a ring of pinned buffers sized for its largest batch.
+torch::Tensor get_output(const c10::optional<torch::Tensor> &out, int64_t num_idx, int64_t feature_dim){
+    if (!out.has_value())
+        return gather_pool->get(num_idx, feature_dim);
+
+    TORCH_CHECK(out->scalar_type() == torch::kFloat32 && !out->is_cuda() && out->is_contiguous() &&
+                out->dim() == 2 && out->size(1) == feature_dim && out->size(0) >= num_idx,
+                "out must be a contiguous float32 CPU tensor with at least ", num_idx, " rows of ", feature_dim);
+    return out->narrow(0, 0, num_idx);
+}
+
+
+// The per-row scales of int8 features of num_rows rows, or NULL for other dtypes
+const float* get_scales(const c10::optional<torch::Tensor> &scales, FeatureDtype dtype, int64_t num_rows){
+    if (dtype != FeatureDtype::Int8)
+        return NULL;
+
+    TORCH_CHECK(scales.has_value(), "int8 features need their scales");
+    TORCH_CHECK(scales->scalar_type() == torch::kFloat32 && !scales->is_cuda() && scales->is_contiguous() &&
+                scales->numel() >= num_rows, "scales must be a contiguous float32 CPU tensor of ", num_rows, " rows");
+    return scales->data_ptr<float>();
+}
+
+
+// Copy row idx_data[n] of features to row n of result_buffer for every n, and
+// prefetch the row ROW_COPY_PREFETCH ahead if prefetch is set
+void gather_rows(const float* features_data, const int64_t* idx_data, int64_t num_idx, int64_t feature_dim,
+                 float* result_buffer, const RowCopier &copy_row, bool prefetch){
+
+    #pragma omp parallel
+    {
+        #pragma omp for
+        for (int64_t n = 0; n < num_idx; n++) {
+            if (prefetch && n + ROW_COPY_PREFETCH < num_idx)
+                copy_row.prefetch(features_data+idx_data[n + ROW_COPY_PREFETCH]*feature_dim);
+            copy_row(result_buffer+feature_dim*n, features_data+idx_data[n]*feature_dim);
+        }
+        copy_row.finish();
+    }
+}
+
+
+// features may be float32, float16, bfloat16 or int8 with scales, and rows are
+// converted to float32
+torch::Tensor gather_mmap(torch::Tensor features, torch::Tensor idx, int64_t feature_dim,
+                          c10::optional<torch::Tensor> out, c10::optional<torch::Tensor> scales){
 
-    // open file
     int64_t feature_size = feature_dim*sizeof(float);
-    int64_t read_size = feature_size;
+    FeatureDtype dtype = feature_dtype_of(features.scalar_type());
+    const float* scales_data = get_scales(scales, dtype, features.numel() / feature_dim);
 
     int64_t num_idx = idx.numel();
-    float* result_buffer = (float*)aligned_alloc(ALIGNMENT, feature_size*num_idx);
+    auto result = get_output(out, num_idx, feature_dim);
+    float* result_buffer = result.data_ptr<float>();
 
-    auto features_data = features.data_ptr<float>();
     auto idx_data = idx.data_ptr<int64_t>();
 
+    if (dtype == FeatureDtype::Float32) {
+        RowCopier copy_row(feature_dim, num_idx*feature_size, result_buffer);
+        gather_rows(features.data_ptr<float>(), idx_data, num_idx, feature_dim, result_buffer, copy_row, true);
+        return result;
+    }
+
+    const char* features_data = (const char*)features.data_ptr();
+    int64_t row_size = feature_dim*feature_dtype_size(dtype);
+
     #pragma omp parallel for
     for (int64_t n = 0; n < num_idx; n++) {
-        int64_t i;
-        int64_t offset;
- 
-        i = idx_data[n];
-        memcpy(result_buffer+feature_dim*n, features_data+i*feature_dim, feature_size);
+        int64_t i = idx_data[n];
+        convert_rows(result_buffer+feature_dim*n, FeatureDtype::Float32, features_data+i*row_size, dtype,
+                     feature_dim, 1, scales_data ? scales_data+i : NULL);
     }
 
-    auto options = torch::TensorOptions()
-        .dtype(torch::kFloat32)
-        .layout(torch::kStrided)
-        .device(torch::kCPU)
-        .requires_grad(false);
-    auto result = torch::from_blob(result_buffer, {num_idx, feature_dim}, options).clone();
-    free(result_buffer);
-
     return result;
 
 }
 
 
-torch::Tensor gather_ginex(std::string feature_file, torch::Tensor idx, int64_t feature_dim, torch::Tensor cache, torch::Tensor cache_table){
+int gather_num_threads(){
+    char* env = getenv("GINEX_NUM_THREADS");
+    return env ? atoi(env) : omp_get_max_threads();
+}
+
+
+// Reads feature rows for gather_ginex. It keeps the feature file open, and an
+// io_uring with io_depth aligned read slots. The file and the slots are
+// registered with the ring, so the kernel does not look up the file or pin the
+// slot pages on every read. Calls are serialized.
+//
+// Misses are read in file order, and rows at most max_gap bytes apart share a
+// read. A negative max_gap reads every row on its own in idx order instead.
+//
+// The feature file holds rows of dtype (see feature_dtype.h), which are
+// converted to float32 as their reads complete. The cache is float32.
+class FeatureReader
+{
+public:
+    FeatureReader(const std::string &feature_file, int64_t feature_dim,
+                  int64_t io_depth = GATHER_IO_DEPTH, int num_threads = -1,
+                  const std::string &dtype = "float32", c10::optional<torch::Tensor> scales = c10::nullopt,
+                  int64_t max_gap = GATHER_MAX_GAP);
+    ~FeatureReader();
 
-    // open file
-    int feature_fd = open(feature_file.c_str(), O_RDONLY | O_DIRECT);
+    // Gather the features of idx into out (see get_output), from the cache for rows
+    // whose cache_table entry is not negative and from the feature file for the others
+    torch::Tensor gather(torch::Tensor idx, torch::Tensor cache, torch::Tensor cache_table,
+                         c10::optional<torch::Tensor> out = c10::nullopt);
 
-    int64_t feature_size = feature_dim*sizeof(float);
-    int64_t read_size = feature_size;
+    // Rows read, bytes of those rows, reads issued and bytes read
+    std::tuple<int64_t, int64_t, int64_t, int64_t> get_io_stats(bool reset);
+
+private:
+    // Pages [aligned_offset, aligned_offset + size) of the feature file, which
+    // hold the rows misses[first, last)
+    typedef struct gather_read_s
+    {
+        int64_t first;
+        int64_t last;
+        int64_t aligned_offset;
+        int64_t size;
+    } gather_read;
+
+    const std::string feature_file;
+    int feature_fd = -1;
+    int64_t feature_dim;
+    FeatureDtype dtype;
+    int64_t feature_size;
+    torch::Tensor scales;
+    const float* scales_data = NULL;
+    int num_threads;
+
+    int io_depth;
+    int64_t max_gap;
+    int64_t slot_size;
+    char* read_buffer = NULL;
+    bool use_ring = false;
+    bool fixed = false;
+    io_uring ring;
+
+    std::vector<std::vector<std::pair<int64_t, int64_t>>> thread_misses;
+    std::vector<std::pair<int64_t, int64_t>> misses;
+    std::vector<gather_read> reads;
+    std::mutex gather_mutex;
+
+    int64_t stat_rows = 0;
+    int64_t stat_bytes_requested = 0;
+    int64_t stat_reads = 0;
+    int64_t stat_bytes_read = 0;
+
+    void read_misses(float* result_buffer, const RowCopier &copy_row);
+    // Bytes of read up to the end of its last row, which a read must return,
+    // as the last page may run past the end of the file
+    int64_t needed_bytes(const gather_read &read);
+    void copy_rows(const gather_read &read, const char* data, float* result_buffer,
+                   const RowCopier &copy_row);
+};
+
+
+FeatureReader::FeatureReader(const std::string &feature_file, int64_t feature_dim, int64_t io_depth, int num_threads,
+                             const std::string &dtype, c10::optional<torch::Tensor> scales, int64_t max_gap)
+    : feature_file(feature_file), feature_dim(feature_dim), dtype(parse_feature_dtype(dtype)),
+      io_depth(std::max(io_depth, (int64_t)1)), max_gap(max_gap)
+{
+    this->feature_size = feature_dim*feature_dtype_size(this->dtype);
+    if (this->dtype == FeatureDtype::Int8) {
+        this->scales_data = get_scales(scales, this->dtype, 0);
+        this->scales = *scales;
+    }
+
+    this->feature_fd = open(feature_file.c_str(), O_RDONLY | O_DIRECT);
+    if (this->feature_fd < 0) {
+        fprintf(stderr, "open file %s failed %s\n", feature_file.c_str(), strerror(errno));
+    }
+
+    this->num_threads = num_threads > 0 ? num_threads : gather_num_threads();
+    this->thread_misses.resize(this->num_threads);
+
+    // A slot holds GATHER_MAX_READ bytes, or a row starting at the end of a page
+    this->slot_size = std::max((int64_t)GATHER_MAX_READ,
+                               (this->feature_size + 2*ALIGNMENT - 1)&(long)~(ALIGNMENT-1));
+
+    int ret = io_uring_queue_init(this->io_depth, &this->ring, 0);
+    if (ret) {
+        fprintf(stderr, "Unable to setup io_uring, fall back to pread: %s\n", strerror(-ret));
+        this->io_depth = 1;
+    }
+    else {
+        this->use_ring = true;
+    }
+    this->read_buffer = (char*)aligned_alloc(ALIGNMENT, this->slot_size*this->io_depth);
+
+    if (this->use_ring) {
+        std::vector<iovec> iovecs(this->io_depth);
+        for (int s = 0; s < this->io_depth; s++) {
+            iovecs[s].iov_base = this->read_buffer + this->slot_size*s;
+            iovecs[s].iov_len = this->slot_size;
+        }
+        if (io_uring_register_files(&this->ring, &this->feature_fd, 1) == 0) {
+            if (io_uring_register_buffers(&this->ring, iovecs.data(), this->io_depth) == 0)
+                this->fixed = true;
+            else
+                io_uring_unregister_files(&this->ring);
+        }
+    }
+}
+
+
+FeatureReader::~FeatureReader()
+{
+    if (this->use_ring) {
+        if (this->fixed) {
+            io_uring_unregister_buffers(&this->ring);
+            io_uring_unregister_files(&this->ring);
+        }
+        io_uring_queue_exit(&this->ring);
+    }
+    free(this->read_buffer);
+    if (this->feature_fd >= 0)
+        close(this->feature_fd);
+}
+
+
+// Cache hits are copied by OpenMP threads, the misses are then read in file order
+// by read_misses
+torch::Tensor FeatureReader::gather(torch::Tensor idx, torch::Tensor cache, torch::Tensor cache_table,
+                                    c10::optional<torch::Tensor> out){
+
+    std::lock_guard<std::mutex> guard(this->gather_mutex);
 
+    int64_t feature_dim = this->feature_dim;
+    int64_t feature_size = this->feature_size;
     int64_t num_idx = idx.numel();
 
-    float* read_buffer = (float*)aligned_alloc(ALIGNMENT, ALIGNMENT*2*atoi(getenv("GINEX_NUM_THREADS")));
-    float* result_buffer = (float*)aligned_alloc(ALIGNMENT, feature_size*num_idx);
+    auto result = get_output(out, num_idx, feature_dim);
+    float* result_buffer = result.data_ptr<float>();
 
     auto idx_data = idx.data_ptr<int64_t>();
     auto cache_data = cache.data_ptr<float>();
     auto cache_table_data = cache_table.data_ptr<int32_t>();
 
-    #pragma omp parallel for num_threads(atoi(getenv("GINEX_NUM_THREADS")))
-    for (int64_t n = 0; n < num_idx; n++) {
-        int64_t i;
-        int64_t offset;
-        int64_t aligned_offset;
-        int64_t residual;
-        int64_t cache_entry;
-        int64_t read_size;
-
-        i = idx_data[n];
-        cache_entry = cache_table_data[i];
-        if (cache_entry >= 0) {
-            memcpy(result_buffer+feature_dim*n, cache_data+cache_entry*feature_dim, feature_size);
-        }
-        else {
-            offset = i * feature_size;
-            aligned_offset = offset&(long)~(ALIGNMENT-1);
-            residual = offset - aligned_offset;
+    for (std::vector<std::pair<int64_t, int64_t>> &v : this->thread_misses)
+        v.clear();
+
+    RowCopier copy_row(feature_dim, num_idx*feature_dim*(int64_t)sizeof(float), result_buffer);
 
-            if (residual+feature_size > ALIGNMENT){
-                read_size = ALIGNMENT * 2;
+    #pragma omp parallel num_threads(this->num_threads)
+    {
+        #pragma omp for
+        for (int64_t n = 0; n < num_idx; n++) {
+            if (n + ROW_COPY_PREFETCH < num_idx) {
+                int64_t ahead = cache_table_data[idx_data[n + ROW_COPY_PREFETCH]];
+                if (ahead >= 0)
+                    copy_row.prefetch(cache_data+ahead*feature_dim);
+            }
+
+            int64_t i = idx_data[n];
+            int64_t cache_entry = cache_table_data[i];
+            if (cache_entry >= 0) {
+                copy_row(result_buffer+feature_dim*n, cache_data+cache_entry*feature_dim);
             }
             else {
-                read_size = ALIGNMENT;
+                this->thread_misses[omp_get_thread_num()].push_back(std::make_pair(i * feature_size, n));
             }
+        }
+        copy_row.finish();
+    }
+
+    this->misses.clear();
+    for (std::vector<std::pair<int64_t, int64_t>> &v : this->thread_misses)
+        this->misses.insert(this->misses.end(), v.begin(), v.end());
+    if (this->max_gap >= 0)
+        std::sort(this->misses.begin(), this->misses.end());
+
+    read_misses(result_buffer, copy_row);
+    copy_row.finish();
+
+    return result;
 
-            if (pread(feature_fd, read_buffer+(ALIGNMENT*2*omp_get_thread_num())/sizeof(float), read_size, aligned_offset) == -1){
-                fprintf(stderr, "ERROR: %s\n", strerror(errno));
+}
+
+
+int64_t FeatureReader::needed_bytes(const gather_read &read){
+    return this->misses[read.last - 1].first + this->feature_size - read.aligned_offset;
+}
+
+
+void FeatureReader::copy_rows(const gather_read &read, const char* data, float* result_buffer,
+                              const RowCopier &copy_row){
+    for (int64_t k = read.first; k < read.last; k++) {
+        const std::pair<int64_t, int64_t> &miss = this->misses[k];
+        const char* row = data + (miss.first - read.aligned_offset);
+        if (this->dtype == FeatureDtype::Float32)
+            copy_row(result_buffer+this->feature_dim*miss.second, (const float*)row);
+        else
+            convert_rows(result_buffer+this->feature_dim*miss.second, FeatureDtype::Float32, row, this->dtype,
+                         this->feature_dim, 1, this->scales_data ? this->scales_data+miss.first/this->feature_size : NULL);
+    }
+}
+
+
+// Read the rows in misses, which holds (file offset, n) pairs sorted by offset,
+// so rows that share a page or lie at most max_gap bytes apart are adjacent and
+// served by one read of up to slot_size bytes. Up to io_depth reads are kept in
+// flight, and rows are copied out to their positions n as their reads complete.
+// A failed or short read raises an error once the reads in flight are done.
+void FeatureReader::read_misses(float* result_buffer, const RowCopier &copy_row){
+
+    int64_t feature_size = this->feature_size;
+    int64_t num_misses = this->misses.size();
+
+    std::vector<gather_read> &reads = this->reads;
+    reads.clear();
+    for (int64_t k = 0; k < num_misses; k++) {
+        int64_t aligned_begin = this->misses[k].first&(long)~(ALIGNMENT-1);
+        int64_t aligned_end = (this->misses[k].first + feature_size + ALIGNMENT - 1)&(long)~(ALIGNMENT-1);
+        if (!reads.empty() && this->max_gap >= 0) {
+            gather_read &read = reads.back();
+            int64_t read_end = read.aligned_offset + read.size;
+            if (aligned_begin <= read_end + this->max_gap && aligned_end - read.aligned_offset <= this->slot_size) {
+                read.size = std::max(read_end, aligned_end) - read.aligned_offset;
+                read.last = k + 1;
+                continue;
             }
-            memcpy(result_buffer+feature_dim*n, read_buffer+(ALIGNMENT*2*omp_get_thread_num()+residual)/sizeof(float), feature_size);
         }
+        reads.push_back(gather_read{k, k + 1, aligned_begin, aligned_end - aligned_begin});
     }
 
-    auto options = torch::TensorOptions()
-        .dtype(torch::kFloat32)
-        .layout(torch::kStrided)
-        .device(torch::kCPU)
-        .requires_grad(false);
-    auto result = torch::from_blob(result_buffer, {num_idx, feature_dim}, options);
+    int64_t num_reads = reads.size();
 
-    free(read_buffer);
-    close(feature_fd);
+    this->stat_rows += num_misses;
+    this->stat_bytes_requested += num_misses * feature_size;
+    this->stat_reads += num_reads;
+    for (const gather_read &read : reads)
+        this->stat_bytes_read += read.size;
 
-    return result;
+    if (!this->use_ring) {
+        for (int64_t r = 0; r < num_reads; r++) {
+            int64_t res = pread(this->feature_fd, this->read_buffer, reads[r].size, reads[r].aligned_offset);
+            TORCH_CHECK(res >= 0, "feature read at ", reads[r].aligned_offset, " failed: ", strerror(errno));
+            TORCH_CHECK(res >= needed_bytes(reads[r]), "short feature read at ", reads[r].aligned_offset,
+                        ": ", res, " of ", needed_bytes(reads[r]), " bytes");
+            copy_rows(reads[r], this->read_buffer, result_buffer, copy_row);
+        }
+        return;
+    }
+
+    std::vector<int> free_slots;
+    for (int s = this->io_depth - 1; s >= 0; s--)
+        free_slots.push_back(s);
+    std::vector<int64_t> slot_read(this->io_depth);
 
+    // After an error no more reads are submitted, but the ones in flight are
+    // waited for, as they write into read_buffer
+    std::string error;
+    int64_t submitted = 0;
+    int64_t finished = 0;
+    while (finished < submitted || (submitted < num_reads && error.empty())) {
+        // Keep the ring full
+        int queued = 0;
+        while (submitted < num_reads && error.empty() && !free_slots.empty()) {
+            io_uring_sqe *sqe = io_uring_get_sqe(&this->ring);
+            if (!sqe)
+                break;
+
+            int s = free_slots.back();
+            free_slots.pop_back();
+            slot_read[s] = submitted;
+
+            char* slot_buffer = this->read_buffer + this->slot_size*s;
+            const gather_read &read = reads[submitted];
+            if (this->fixed) {
+                io_uring_prep_read_fixed(sqe, 0, slot_buffer, read.size, read.aligned_offset, s);
+                sqe->flags |= IOSQE_FIXED_FILE;
+            }
+            else {
+                io_uring_prep_read(sqe, this->feature_fd, slot_buffer, read.size, read.aligned_offset);
+            }
+            sqe->user_data = static_cast<uint64_t>(s);
+            submitted += 1;
+            queued += 1;
+        }
+        if (queued > 0)
+            io_uring_submit(&this->ring);
+
+        // Copy rows in completion order
+        io_uring_cqe *cqe;
+        int ret = io_uring_wait_cqe(&this->ring, &cqe);
+        if (ret < 0) {
+            if (ret == -EINTR)
+                continue;
+            // The reads in flight can no longer be waited for, so the ring and
+            // read_buffer are left to them, and later calls pread into a new buffer
+            io_uring_queue_exit(&this->ring);
+            this->use_ring = false;
+            this->fixed = false;
+            this->read_buffer = (char*)aligned_alloc(ALIGNMENT, this->slot_size);
+            TORCH_CHECK(false, "waiting for feature reads failed: ", strerror(-ret));
+        }
+        do {
+            int s = static_cast<int>(cqe->user_data);
+            int res = cqe->res;
+            io_uring_cqe_seen(&this->ring, cqe);
+
+            const gather_read &read = reads[slot_read[s]];
+            if (error.empty()) {
+                if (res < 0)
+                    error = "feature read at " + std::to_string(read.aligned_offset) + " failed: " + strerror(-res);
+                else if (res < needed_bytes(read))
+                    error = "short feature read at " + std::to_string(read.aligned_offset) + ": " +
+                            std::to_string(res) + " of " + std::to_string(needed_bytes(read)) + " bytes";
+                else
+                    copy_rows(read, this->read_buffer + this->slot_size*s, result_buffer, copy_row);
+            }
+            free_slots.push_back(s);
+            finished += 1;
+        } while (io_uring_peek_cqe(&this->ring, &cqe) == 0);
+    }
+    TORCH_CHECK(error.empty(), error);
+}
+
+
+std::tuple<int64_t, int64_t, int64_t, int64_t> FeatureReader::get_io_stats(bool reset){
+    std::lock_guard<std::mutex> guard(this->gather_mutex);
+    auto stats = std::make_tuple(this->stat_rows, this->stat_bytes_requested, this->stat_reads, this->stat_bytes_read);
+    if (reset)
+        this->stat_rows = this->stat_bytes_requested = this->stat_reads = this->stat_bytes_read = 0;
+    return stats;
+}
+
+
+torch::Tensor gather_ginex(std::string feature_file, torch::Tensor idx, int64_t feature_dim, torch::Tensor cache, torch::Tensor cache_table,
+                           int64_t io_depth, c10::optional<torch::Tensor> out, const std::string &dtype,
+                           c10::optional<torch::Tensor> scales, int64_t max_gap){
+
+    FeatureReader reader(feature_file, feature_dim, io_depth, -1, dtype, scales, max_gap);
+    return reader.gather(idx, cache, cache_table, out);
+}
+
+
+// Gather num_batches batches of num_idx random rows out of num_rows rows of
+// feature_dim floats with the per-row memcpy loop gather used before and with
+// RowCopier and prefetching. Return the average time per row in nanoseconds for
+// both.
+std::tuple<double, double>
+benchmark_row_copy(int64_t num_rows, int64_t num_idx, int64_t feature_dim, int64_t num_batches){
+
+    int64_t feature_size = feature_dim*sizeof(float);
+    float* features_data = (float*)aligned_alloc(ALIGNMENT, (num_rows*feature_size + ALIGNMENT - 1)&(long)~(ALIGNMENT-1));
+    float* result_buffer = (float*)aligned_alloc(ALIGNMENT, (num_idx*feature_size + ALIGNMENT - 1)&(long)~(ALIGNMENT-1));
+    if (features_data == NULL || result_buffer == NULL) {
+        fprintf(stderr, "benchmark_row_copy: out of memory\n");
+        free(features_data);
+        free(result_buffer);
+        return std::make_tuple(0.0, 0.0);
+    }
+    for (int64_t k = 0; k < num_rows*feature_dim; k++)
+        features_data[k] = (float)k;
+
+    std::vector<int64_t> idx(num_idx);
+    std::mt19937_64 rng(0);
+    for (int64_t n = 0; n < num_idx; n++)
+        idx[n] = rng() % num_rows;
+
+    RowCopier memcpy_row(feature_dim, num_idx*feature_size, result_buffer, true);
+    RowCopier copy_row(feature_dim, num_idx*feature_size, result_buffer);
+
+    double memcpy_ns = 0, kernel_ns = 0;
+    for (int64_t b = 0; b < num_batches; b++) {
+        auto start = std::chrono::steady_clock::now();
+        gather_rows(features_data, idx.data(), num_idx, feature_dim, result_buffer, memcpy_row, false);
+        auto mid = std::chrono::steady_clock::now();
+        gather_rows(features_data, idx.data(), num_idx, feature_dim, result_buffer, copy_row, true);
+        auto end = std::chrono::steady_clock::now();
+
+        memcpy_ns += std::chrono::duration<double, std::nano>(mid - start).count();
+        kernel_ns += std::chrono::duration<double, std::nano>(end - mid).count();
+    }
+    if (num_idx > 0 && result_buffer[(num_idx - 1)*feature_dim] != features_data[idx[num_idx - 1]*feature_dim])
+        fprintf(stderr, "benchmark_row_copy: rows differ\n");
+
+    free(features_data);
+    free(result_buffer);
+    return std::make_tuple(memcpy_ns / (num_idx * num_batches), kernel_ns / (num_idx * num_batches));
 }
 
 
 PYBIND11_MODULE(gather, m) {
-    m.def("gather_ginex", &gather_ginex, "gather for ginex", py::call_guard<py::gil_scoped_release>());
-    m.def("gather_mmap", &gather_mmap, "gather for PyG+", py::call_guard<py::gil_scoped_release>());
+    py::class_<FeatureReader>(m, "FeatureReader")
+        .def(py::init<const std::string &, int64_t, int64_t, int, const std::string &, c10::optional<torch::Tensor>,
+                      int64_t>(),
+             py::arg("feature_file"), py::arg("feature_dim"), py::arg("io_depth") = GATHER_IO_DEPTH,
+             py::arg("num_threads") = -1, py::arg("dtype") = "float32", py::arg("scales") = py::none(),
+             py::arg("max_gap") = GATHER_MAX_GAP)
+        .def("get_io_stats", &FeatureReader::get_io_stats, py::arg("reset") = false)
+        .def("gather", &FeatureReader::gather, py::arg("idx"), py::arg("cache"), py::arg("cache_table"),
+             py::arg("out") = py::none(), py::call_guard<py::gil_scoped_release>());
+
+    m.def("gather_ginex", &gather_ginex, "gather for ginex",
+          py::arg("feature_file"), py::arg("idx"), py::arg("feature_dim"), py::arg("cache"), py::arg("cache_table"),
+          py::arg("io_depth") = GATHER_IO_DEPTH, py::arg("out") = py::none(), py::arg("dtype") = "float32",
+          py::arg("scales") = py::none(), py::arg("max_gap") = GATHER_MAX_GAP,
+          py::call_guard<py::gil_scoped_release>());
+    m.def("gather_mmap", &gather_mmap, "gather for PyG+",
+          py::arg("features"), py::arg("idx"), py::arg("feature_dim"), py::arg("out") = py::none(),
+          py::arg("scales") = py::none(), py::call_guard<py::gil_scoped_release>());
+    m.def("benchmark_row_copy", &benchmark_row_copy, "time feature row gathers with memcpy and RowCopier",
+          py::arg("num_rows"), py::arg("num_idx"), py::arg("feature_dim"), py::arg("num_batches"));
 }
 
 
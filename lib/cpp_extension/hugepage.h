@@ -0,0 +1,145 @@
+#pragma once
+#include <torch/extension.h>
+#include <sys/mman.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <strings.h>
+#include <unistd.h>
+#include <algorithm>
+#include <string>
+
+// Hugepage-backed memory for the feature and neighbor caches, whose rows are
+// looked up at random and miss the TLB on almost every access with 4KB pages.
+// "2mb" and "1gb" ask for reserved hugepages (MAP_HUGETLB / SHM_HUGETLB) and fall
+// back to the next smaller size, then to transparent hugepages if none are
+// reserved. "thp" only asks for transparent hugepages with madvise, and "none"
+// uses base pages.
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#ifndef SHM_HUGE_SHIFT
+#define SHM_HUGE_SHIFT 26
+#endif
+#define HUGEPAGE_2MB (2L*1024*1024)
+#define HUGEPAGE_1GB (1024L*1024*1024)
+
+enum class HugePage {
+    None,
+    Transparent,
+    Huge2MB,
+    Huge1GB
+};
+
+inline HugePage parse_hugepage(const std::string &name) {
+    if (strcasecmp(name.c_str(), "none") == 0)
+        return HugePage::None;
+    if (strcasecmp(name.c_str(), "thp") == 0)
+        return HugePage::Transparent;
+    if (strcasecmp(name.c_str(), "2mb") == 0)
+        return HugePage::Huge2MB;
+    if (strcasecmp(name.c_str(), "1gb") == 0)
+        return HugePage::Huge1GB;
+    TORCH_CHECK(false, "unsupported hugepage mode ", name, ", expected none, thp, 2mb or 1gb");
+}
+
+inline const char* hugepage_name(HugePage page) {
+    switch (page) {
+    case HugePage::Transparent: return "thp";
+    case HugePage::Huge2MB: return "2mb";
+    case HugePage::Huge1GB: return "1gb";
+    default: return "none";
+    }
+}
+
+// The size that mappings with pages of page are rounded up to
+inline int64_t hugepage_size(HugePage page) {
+    switch (page) {
+    case HugePage::Huge1GB: return HUGEPAGE_1GB;
+    case HugePage::Huge2MB:
+    case HugePage::Transparent: return HUGEPAGE_2MB;
+    default: return sysconf(_SC_PAGESIZE);
+    }
+}
+
+inline size_t hugepage_round(size_t size, HugePage page) {
+    size_t page_size = hugepage_size(page);
+    return std::max((size + page_size - 1) / page_size * page_size, page_size);
+}
+
+// A mapping from huge_alloc, with the kind of pages it got
+struct HugeAlloc
+{
+    void* ptr;
+    size_t size;
+    HugePage page;
+};
+
+// Map at least size bytes of zeroed memory with the given kind of pages, falling
+// back as described above. ptr is NULL if there is no memory at all.
+inline HugeAlloc huge_alloc(size_t size, HugePage page) {
+    if (page == HugePage::Huge1GB || page == HugePage::Huge2MB) {
+        int huge_flags = page == HugePage::Huge1GB ? (30 << MAP_HUGE_SHIFT) : (21 << MAP_HUGE_SHIFT);
+        size_t mapped_size = hugepage_round(size, page);
+        void* ptr = mmap(NULL, mapped_size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | huge_flags, -1, 0);
+        if (ptr != MAP_FAILED)
+            return HugeAlloc{ptr, mapped_size, page};
+        return huge_alloc(size, page == HugePage::Huge1GB ? HugePage::Huge2MB : HugePage::Transparent);
+    }
+
+    size_t mapped_size = hugepage_round(size, page);
+    void* ptr = mmap(NULL, mapped_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED)
+        return HugeAlloc{NULL, 0, page};
+    if (page == HugePage::Transparent)
+        madvise(ptr, mapped_size, MADV_HUGEPAGE);
+    return HugeAlloc{ptr, mapped_size, page};
+}
+
+inline void huge_free(const HugeAlloc &alloc) {
+    if (alloc.ptr)
+        munmap(alloc.ptr, alloc.size);
+}
+
+// A tensor of sizes in memory from huge_alloc, unmapped when the tensor is freed
+inline torch::Tensor huge_empty(std::vector<int64_t> sizes, torch::ScalarType type, HugePage page) {
+    int64_t numel = 1;
+    for (int64_t s : sizes)
+        numel *= s;
+    HugeAlloc alloc = huge_alloc(numel * torch::elementSize(type), page);
+    TORCH_CHECK(alloc.ptr != NULL, "out of memory allocating ", numel * torch::elementSize(type), " bytes");
+
+    auto options = torch::TensorOptions()
+        .dtype(type)
+        .layout(torch::kStrided)
+        .device(torch::kCPU)
+        .requires_grad(false);
+    return torch::from_blob(alloc.ptr, sizes, [alloc](void*) { huge_free(alloc); }, options);
+}
+
+// shmget a segment of at least size bytes with the given kind of pages, falling
+// back as huge_alloc does, and set size and page to what it got. Every process
+// sharing the segment must ask for the same size and page. Call
+// huge_shm_advise once the segment is attached.
+inline int huge_shmget(key_t key, size_t &size, HugePage &page, int flags) {
+    if (page == HugePage::Huge1GB || page == HugePage::Huge2MB) {
+        int huge_flags = page == HugePage::Huge1GB ? (30 << SHM_HUGE_SHIFT) : (21 << SHM_HUGE_SHIFT);
+        size_t mapped_size = hugepage_round(size, page);
+        int shmid = shmget(key, mapped_size, flags | SHM_HUGETLB | huge_flags);
+        if (shmid != -1) {
+            size = mapped_size;
+            return shmid;
+        }
+        page = page == HugePage::Huge1GB ? HugePage::Huge2MB : HugePage::Transparent;
+        return huge_shmget(key, size, page, flags);
+    }
+
+    if (page == HugePage::Transparent)
+        size = hugepage_round(size, page);
+    return shmget(key, size, flags);
+}
+
+inline void huge_shm_advise(void* ptr, size_t size, HugePage page) {
+    if (page == HugePage::Transparent)
+        madvise(ptr, size, MADV_HUGEPAGE);
+}
@@ -3,6 +3,8 @@
 #include <omp.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <torch/extension.h>
 #include <Python.h>
 #include <pybind11/pybind11.h>
@@ -11,74 +13,255 @@
 #include <cstring>
 #include <inttypes.h>
 #include <ATen/ATen.h>
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <fstream>
+#include <sstream>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include "hugepage.h"
 #define ALIGNMENT 4096
+#define LOAD_CHUNK_SIZE (16*1024*1024)
 
-torch::Tensor load_float32(std::string file, int64_t size){
 
-    // open file
-    int fd = open(file.c_str(), O_RDONLY | O_DIRECT);
+int load_num_threads(){
+    char* env = getenv("GINEX_NUM_THREADS");
+    return env ? atoi(env) : omp_get_max_threads();
+}
 
-    int64_t result_buffer_size = size*sizeof(float)+ALIGNMENT;
-    int64_t num_blocks = result_buffer_size / ALIGNMENT;
-    float* result_buffer = (float*)aligned_alloc(ALIGNMENT, result_buffer_size);
+
+torch::ScalarType parse_load_dtype(const std::string &name){
+    if (name == "float32") return torch::kFloat32;
+    if (name == "float64") return torch::kFloat64;
+    if (name == "float16") return torch::kFloat16;
+    if (name == "bfloat16") return torch::kBFloat16;
+    if (name == "int64") return torch::kInt64;
+    if (name == "int32") return torch::kInt32;
+    if (name == "int16") return torch::kInt16;
+    if (name == "int8") return torch::kInt8;
+    if (name == "uint8") return torch::kUInt8;
+    if (name == "bool") return torch::kBool;
+    TORCH_CHECK(false, "unsupported dtype ", name);
+}
 
 
-    #pragma omp parallel for num_threads(atoi(getenv("GINEX_NUM_THREADS")))
-    for (int64_t n = 0; n < num_blocks; n++) {
-        int64_t offset = n*ALIGNMENT;
-            
-        if (pread(fd, result_buffer+(ALIGNMENT/sizeof(float))*n, ALIGNMENT, offset) == -1){
-            fprintf(stderr, "load.cpp::1::ERROR: %s\n", strerror(errno));
+bool pread_full(int fd, char* buffer, int64_t len, int64_t offset){
+    while (len > 0) {
+        ssize_t ret = pread(fd, buffer, len, offset);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0) {
+            fprintf(stderr, "mt_load: read at %" PRId64 " failed: %s\n", offset, ret < 0 ? strerror(errno) : "end of file");
+            return false;
         }
+        buffer += ret;
+        offset += ret;
+        len -= ret;
+    }
+    return true;
+}
+
+
+// Load size values of dtype from the start of file, or the whole file if size is
+// negative, in chunk_size reads on num_threads threads. The file is read with
+// O_DIRECT if the filesystem and the output allow it, and a tail that is not a
+// whole ALIGNMENT block is read through a bounce buffer. The result goes to out
+// if given, and otherwise to memory with pages of the hugepage mode (see
+// hugepage.h), which is unmapped when the tensor is freed.
+torch::Tensor load(std::string file, int64_t size, const std::string &dtype, int64_t chunk_size,
+                   const std::string &hugepage, c10::optional<torch::Tensor> out, int num_threads){
+
+    torch::ScalarType type = parse_load_dtype(dtype);
+    HugePage page = parse_hugepage(hugepage);
+    int64_t element_size = torch::elementSize(type);
+
+    bool direct = true;
+    int fd = open(file.c_str(), O_RDONLY | O_DIRECT);
+    if (fd < 0) {
+        direct = false;
+        fd = open(file.c_str(), O_RDONLY);
+    }
+    TORCH_CHECK(fd >= 0, "cannot open ", file, ": ", strerror(errno));
+
+    struct stat st;
+    fstat(fd, &st);
+    if (size < 0)
+        size = st.st_size / element_size;
+    int64_t bytes = size*element_size;
+    if (bytes > st.st_size) {
+        close(fd);
+        TORCH_CHECK(false, file, " holds fewer than ", size, " ", dtype, " values");
+    }
+
+    torch::Tensor result;
+    if (out.has_value()) {
+        TORCH_CHECK(out->scalar_type() == type && !out->is_cuda() && out->is_contiguous() && out->numel() >= size,
+                    "out must be a contiguous ", dtype, " CPU tensor of at least ", size, " values");
+        result = out->view({-1}).narrow(0, 0, size);
+    }
+    else {
+        result = huge_empty({size}, type, page);
+    }
+    char* buffer = (char*)result.data_ptr();
+
+    if (direct && ((uintptr_t)buffer & (ALIGNMENT-1))) {
+        close(fd);
+        direct = false;
+        fd = open(file.c_str(), O_RDONLY);
+        TORCH_CHECK(fd >= 0, "cannot open ", file, ": ", strerror(errno));
+    }
+
+    chunk_size = std::max((chunk_size + ALIGNMENT - 1)&(long)~(ALIGNMENT-1), (int64_t)ALIGNMENT);
+    int64_t body = direct ? bytes&(long)~(ALIGNMENT-1) : bytes;
+    int64_t num_chunks = (body + chunk_size - 1) / chunk_size;
+    num_threads = std::max(1, (int)std::min((int64_t)(num_threads > 0 ? num_threads : load_num_threads()), num_chunks));
+
+    bool ok = true;
+    #pragma omp parallel for num_threads(num_threads) schedule(dynamic) reduction(&&:ok)
+    for (int64_t n = 0; n < num_chunks; n++) {
+        int64_t offset = n*chunk_size;
+        ok = pread_full(fd, buffer + offset, std::min(chunk_size, body - offset), offset) && ok;
     }
 
-    auto options = torch::TensorOptions()
-        .dtype(torch::kFloat32)
-        .layout(torch::kStrided)
-        .device(torch::kCPU)
-        .requires_grad(false);
-    auto result = torch::from_blob(result_buffer, {size}, options);
+    if (ok && body < bytes) {
+        // A direct read of the last block stops at the end of the file
+        char* tail = (char*)aligned_alloc(ALIGNMENT, ALIGNMENT);
+        ssize_t ret = pread(fd, tail, ALIGNMENT, body);
+        ok = ret >= bytes - body;
+        if (ok)
+            memcpy(buffer + body, tail, bytes - body);
+        else
+            fprintf(stderr, "mt_load: read at %" PRId64 " failed: %s\n", body, ret < 0 ? strerror(errno) : "end of file");
+        free(tail);
+    }
 
     close(fd);
+    TORCH_CHECK(ok, "failed to load ", file);
 
     return result;
+}
 
+
+torch::Tensor load_float32(std::string file, int64_t size){
+    return load(file, size, "float32", LOAD_CHUNK_SIZE, "none", c10::nullopt, -1);
 }
 
 
 torch::Tensor load_int64(std::string file, int64_t size){
+    return load(file, size, "int64", LOAD_CHUNK_SIZE, "none", c10::nullopt, -1);
+}
 
-    // open file
-    int fd = open(file.c_str(), O_RDONLY | O_DIRECT);
 
-    int64_t result_buffer_size = size*sizeof(int64_t)+ALIGNMENT;
-    int64_t num_blocks = result_buffer_size / ALIGNMENT;
-    int64_t* result_buffer = (int64_t*)aligned_alloc(ALIGNMENT, result_buffer_size);
+// A zeroed tensor of size values of dtype with pages of the hugepage mode
+torch::Tensor empty(int64_t size, const std::string &dtype, const std::string &hugepage){
+    return huge_empty({size}, parse_load_dtype(dtype), parse_hugepage(hugepage));
+}
+
 
-    #pragma omp parallel for num_threads(atoi(getenv("GINEX_NUM_THREADS")))
-    for (int64_t n = 0; n < num_blocks; n++) {
-        int64_t offset = n*ALIGNMENT;
-            
-        if (pread(fd, result_buffer+(ALIGNMENT/sizeof(int64_t))*n, ALIGNMENT, offset) == -1){
-            fprintf(stderr, "load.cpp::2::ERROR: %s\n", strerror(errno));
+// The kernel page size of the mapping that holds ptr, and how many of its bytes
+// are backed by transparent hugepages, from /proc/self/smaps
+std::tuple<int64_t, int64_t> mapping_pages(const void* ptr){
+    std::ifstream smaps("/proc/self/smaps");
+    std::string line;
+    bool found = false;
+    int64_t page_size = -1, huge_bytes = 0;
+    while (std::getline(smaps, line)) {
+        uintptr_t begin, end;
+        if (sscanf(line.c_str(), "%" SCNxPTR "-%" SCNxPTR " ", &begin, &end) == 2 && line.find(':') > line.find(' ')) {
+            if (found)
+                break;
+            found = begin <= (uintptr_t)ptr && (uintptr_t)ptr < end;
+            continue;
         }
+        if (!found)
+            continue;
+        std::istringstream fields(line);
+        std::string name;
+        int64_t kb;
+        fields >> name >> kb;
+        if (name == "KernelPageSize:")
+            page_size = kb*1024;
+        else if (name == "AnonHugePages:")
+            huge_bytes = kb*1024;
     }
+    return std::make_tuple(page_size, huge_bytes);
+}
 
-    auto options = torch::TensorOptions()
-        .dtype(torch::kInt64)
-        .layout(torch::kStrided)
-        .device(torch::kCPU)
-        .requires_grad(false);
-    auto result = torch::from_blob(result_buffer, {size}, options);
 
-    close(fd);
+// dTLB load misses of the calling thread, or -1 if perf events are not allowed
+int open_dtlb_counter(){
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
 
-    return result;
 
+// Look up num_lookups random 8-byte words of a bytes-long buffer allocated with
+// the hugepage mode, as the caches are looked up. Return the mode the buffer
+// got, its kernel page size, the bytes of it in transparent hugepages, the time
+// per lookup in nanoseconds and the dTLB load misses per lookup (-1 if they
+// cannot be counted).
+std::tuple<std::string, int64_t, int64_t, double, double>
+benchmark_hugepage(int64_t bytes, int64_t num_lookups, const std::string &hugepage){
+
+    HugeAlloc alloc = huge_alloc(bytes, parse_hugepage(hugepage));
+    TORCH_CHECK(alloc.ptr != NULL, "out of memory allocating ", bytes, " bytes");
+    int64_t num_words = bytes / sizeof(int64_t);
+    int64_t* words = (int64_t*)alloc.ptr;
+    for (int64_t k = 0; k < num_words; k++)
+        words[k] = k;
+
+    int64_t page_size, huge_bytes;
+    std::tie(page_size, huge_bytes) = mapping_pages(alloc.ptr);
+
+    std::vector<int64_t> idx(num_lookups);
+    std::mt19937_64 rng(0);
+    for (int64_t n = 0; n < num_lookups; n++)
+        idx[n] = rng() % num_words;
+
+    int counter = open_dtlb_counter();
+    if (counter >= 0) {
+        ioctl(counter, PERF_EVENT_IOC_RESET, 0);
+        ioctl(counter, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    auto start = std::chrono::steady_clock::now();
+    int64_t sum = 0;
+    for (int64_t n = 0; n < num_lookups; n++)
+        sum += words[idx[n]];
+    auto end = std::chrono::steady_clock::now();
+    double misses = -1;
+    if (counter >= 0) {
+        ioctl(counter, PERF_EVENT_IOC_DISABLE, 0);
+        uint64_t count = 0;
+        if (read(counter, &count, sizeof(count)) == sizeof(count))
+            misses = (double)count / num_lookups;
+        close(counter);
+    }
+    if (sum == -1)
+        fprintf(stderr, "benchmark_hugepage: %" PRId64 "\n", sum);
+
+    huge_free(alloc);
+    return std::make_tuple(std::string(hugepage_name(alloc.page)), page_size, huge_bytes,
+                           std::chrono::duration<double, std::nano>(end - start).count() / num_lookups, misses);
 }
 
 PYBIND11_MODULE(mt_load, m) {
+    m.def("load", &load, "multi-threaded load of any dtype",
+          py::arg("file"), py::arg("size") = -1, py::arg("dtype") = "int64", py::arg("chunk_size") = LOAD_CHUNK_SIZE,
+          py::arg("hugepage") = "none", py::arg("out") = py::none(), py::arg("num_threads") = -1,
+          py::call_guard<py::gil_scoped_release>());
+    m.def("empty", &empty, "zeroed tensor in hugepage-backed memory",
+          py::arg("size"), py::arg("dtype"), py::arg("hugepage") = "none");
+    m.def("benchmark_hugepage", &benchmark_hugepage, "time random lookups into memory of a hugepage mode",
+          py::arg("bytes"), py::arg("num_lookups"), py::arg("hugepage"));
     m.def("load_float32", &load_float32, "multi-threaded load (float32)");
 	m.def("load_int64", &load_int64, "multi-threaded load (int64)");
 }
-
@@ -16,8 +16,12 @@
 #include <liburing.h>
 #include <cuda_runtime.h>
 #include <cstring>
+#include <memory>
+#include <algorithm>
+#include "feature_dtype.h"
+#include "hugepage.h"
+#include "offload_groups.h"
 
-#define ALIGNMENT 512
 #define ASYNC_ENYRY_NUM 80
 
 
@@ -35,12 +39,15 @@ typedef struct map_info_s
     int32_t valid;
 } map_info;
 
-class Offloader
+class Offloader : public OffloadGroups
 {
 public:
     Offloader(const std::string &filename, const int64_t node_num, 
         const int64_t dim, const int64_t buffer_size, 
-        const std::string &type = "cpu", int device_id = 0, int stage_size = 0);
+        const std::string &type = "cpu", int device_id = 0, int stage_size = 0,
+        const std::string &dtype = "float32", const std::string &cache_dtype = "float32",
+        c10::optional<torch::Tensor> scales = c10::nullopt, int64_t max_gap = OFFLOAD_MAX_GAP,
+        const std::string &hugepage = "none");
     ~Offloader();
 
     torch::Tensor get_tensor();
@@ -49,6 +56,10 @@ public:
 
     void release(torch::Tensor &idx);
 
+    // Groups read, bytes of those groups, reads issued and bytes read by the
+    // CPU loads
+    std::tuple<int64_t, int64_t, int64_t, int64_t> get_io_stats(bool reset);
+
 private:
     AsyncType async_type;
 
@@ -56,17 +67,17 @@ private:
     int fd;
 
     torch::Tensor feature_tensor;
-    float *cache_data;
-    int64_t feature_dim;
+    char *cache_data;
+    // The CPU cache, mapped with the pages of hugepage
+    HugePage hugepage;
+    HugeAlloc cache_alloc = {NULL, 0, HugePage::None};
     int64_t cache_size;
     std::vector<int64_t> back_index;
     size_t mem_size = 0;
 
     std::mutex update_mutex;
-    int64_t node_size;
     std::vector<map_info> map_table;
     // free table
-    int group_size;
     int64_t free_index_size;
     std::list<int64_t> free_lru_list;
     std::unordered_map<int64_t, std::list<int64_t>::iterator> free_map_table;
@@ -112,7 +123,8 @@ private:
     size_t stage_mem_size = 0;
     std::vector<int64_t> stage_map_table;
 
-    float *device_cache;
+    char *device_cache;
+    char *convert_data = NULL;
     void init_gpu(int device_id);
     torch::Tensor gpu_async_load(torch::Tensor &idx, int t_id = 0, int t_total = 1);
 
@@ -124,14 +136,12 @@ private:
 
 
 Offloader::Offloader(const std::string &filename, const int64_t node_num, 
-    const int64_t dim, const int64_t buffer_size, const std::string &type, int device_id, int stage_size) 
-    : filename(filename), node_size(node_num), feature_dim(dim), cache_size(buffer_size), stage_size(stage_size)
+    const int64_t dim, const int64_t buffer_size, const std::string &type, int device_id, int stage_size,
+    const std::string &dtype, const std::string &cache_dtype, c10::optional<torch::Tensor> scales, int64_t max_gap,
+    const std::string &hugepage) 
+    : OffloadGroups(node_num, dim, dtype, cache_dtype, scales, max_gap),
+      filename(filename), cache_size(buffer_size), stage_size(stage_size), hugepage(parse_hugepage(hugepage))
 {
-    this->group_size = ALIGNMENT / (this->feature_dim * sizeof(float));
-    if (this->group_size < 1) {
-        this->group_size = 1;
-    }
-
     this->free_index_size = this->cache_size;
     this->cache_size = this->cache_size * group_size;
 
@@ -172,14 +182,23 @@ Offloader::Offloader(const std::string &filename, const int64_t node_num,
 
 void Offloader::init_cpu() 
 {
-    this->mem_size = this->cache_size * this->feature_dim * sizeof(float);
+    this->mem_size = this->cache_size * this->cache_row_size;
     if (this->mem_size % ALIGNMENT)
         this->mem_size = (this->mem_size / ALIGNMENT + 1) * ALIGNMENT;
 
-    this->cache_data = (float *)aligned_alloc(4096, this->mem_size);
+    this->cache_alloc = huge_alloc(this->mem_size, this->hugepage);
+    if (this->cache_alloc.ptr == NULL) {
+        // The destructor does not run if the constructor throws
+        close(this->fd);
+        TORCH_CHECK(false, "out of memory allocating ", this->mem_size, " bytes for the cache");
+    }
+    this->cache_data = (char *)this->cache_alloc.ptr;
+    if (this->cache_alloc.page != this->hugepage)
+        fprintf(stderr, "Offloader: no %s pages for the cache, using %s\n",
+                hugepage_name(this->hugepage), hugepage_name(this->cache_alloc.page));
 
     auto options = torch::TensorOptions()
-        .dtype(torch::kFloat32)
+        .dtype(feature_scalar_type(this->cache_dtype))
         .layout(torch::kStrided)
         .device(torch::kCPU)
         .requires_grad(false);
@@ -192,24 +211,26 @@ void Offloader::init_cpu()
 
 void Offloader::init_gpu(int device_id) 
 {
-    this->mem_size = this->cache_size * this->feature_dim * sizeof(float);
+    this->mem_size = this->cache_size * this->cache_row_size;
     if (this->mem_size % ALIGNMENT)
         this->mem_size = (this->mem_size / ALIGNMENT + 1) * ALIGNMENT;
 
-    this->stage_mem_size = this->stage_size * this->group_size * this->feature_dim * sizeof(float);
-    if (this->stage_mem_size % ALIGNMENT)
-        this->stage_mem_size = (this->stage_mem_size / ALIGNMENT + 1) * ALIGNMENT;
+    // A stage slot holds a read, whose rows are converted into the slot of
+    // convert_data if the dtypes differ
+    this->stage_mem_size = this->stage_size * this->read_size;
 
     this->stage_map_table.resize(this->node_size);
 
     cudaSetDevice(device_id);
 
     cudaMallocHost(&this->cache_data, this->stage_mem_size);
+    if (this->convert)
+        cudaMallocHost(&this->convert_data, this->stage_size * this->group_size * this->cache_row_size);
 
     cudaMalloc(&this->device_cache, this->mem_size);
 
     auto options = torch::TensorOptions()
-        .dtype(torch::kFloat32)
+        .dtype(feature_scalar_type(this->cache_dtype))
         .layout(torch::kStrided)
         .device(torch::kCUDA, device_id)
         .requires_grad(false);
@@ -225,10 +246,12 @@ Offloader::~Offloader()
     switch (this->async_type)
     {
     case AsyncType::CPU:
-        free(this->cache_data);
+        huge_free(this->cache_alloc);
         break;
     case AsyncType::GPU:
         cudaFreeHost(this->cache_data);
+        if (this->convert_data)
+            cudaFreeHost(this->convert_data);
         cudaFree(this->device_cache);
         break;
     case AsyncType::GDS:
@@ -270,6 +293,9 @@ torch::Tensor Offloader::cpu_async_load(torch::Tensor &idx)
     omp_init_lock(&lock);
     bool need_load = false;
     std::unordered_set<int64_t> need_wait;
+    // Groups first seen unloaded in this call, whose index is only assigned
+    // when they are read below
+    std::unordered_set<int64_t> loading;
 
     torch::Tensor remap_idx = torch::zeros_like(idx);
     int64_t num_idx = idx.numel();
@@ -295,7 +321,7 @@ torch::Tensor Offloader::cpu_async_load(torch::Tensor &idx)
                 omp_unset_lock(&lock);
             }
         } else {
-            if (this->map_table[key].ref > 0) {
+            if (this->map_table[key].ref > 0 && loading.count(key) == 0) {
                 remap_data[n] = this->map_table[key].index * this->group_size + offset;
                 omp_set_lock(&lock);
                 need_wait.insert(key);
@@ -303,6 +329,7 @@ torch::Tensor Offloader::cpu_async_load(torch::Tensor &idx)
             } else {
                 remap_data[n] = -1;
                 need_load = true;
+                loading.insert(key);
             }
         }
         this->map_table[key].ref += 1;
@@ -312,13 +339,12 @@ torch::Tensor Offloader::cpu_async_load(torch::Tensor &idx)
         io_uring ring;
         int64_t finished = 0;
         int64_t async_loading = 0;
-        
-        int ret = io_uring_queue_init(ASYNC_ENYRY_NUM, &ring, 0);
-        if (ret)
-        {
-            fprintf(stderr, "Unable to setup io_uring: %s\n", strerror(-ret));
-            goto err_lock;
-        }
+        std::vector<int64_t> keys;
+        std::vector<offload_read> reads;
+        std::vector<iovec> iovecs;
+        auto cache_slot = [&](int64_t key) {
+            return this->cache_data + this->map_table[key].index * this->group_size * this->cache_row_size;
+        };
 
         for (int64_t n = 0; n < num_idx; n++)
         {
@@ -328,20 +354,13 @@ torch::Tensor Offloader::cpu_async_load(torch::Tensor &idx)
             int64_t key = idx_data[n];
             int64_t offset = 0;
             if (this->group_size > 1) {
-                // loaded before
                 offset = key % this->group_size;
                 key = key / this->group_size * this->group_size;
-                if (this->back_index[this->map_table[key].index] == key) {
-                    remap_data[n] = this->map_table[key].index * this->group_size + offset;
-                    continue;
-                }
             }
-
-            io_uring_sqe *sqe = io_uring_get_sqe(&ring);
-            if (!sqe)
-            {
-                fprintf(stderr, "Could not get SQE.\n");
-                goto err_lock;
+            // loaded before, for an earlier node of the group or the same node
+            if (this->back_index[this->map_table[key].index] == key) {
+                remap_data[n] = this->map_table[key].index * this->group_size + offset;
+                continue;
             }
 
             int64_t index = get_free_index();
@@ -353,15 +372,77 @@ torch::Tensor Offloader::cpu_async_load(torch::Tensor &idx)
             remap_data[n] = index * this->group_size + offset;
             this->map_table[key].index = index;            
             this->back_index[index] = key;
+            keys.push_back(key);
+        }
 
-            float *f_buffer;
-            f_buffer = this->cache_data + index * this->group_size * this->feature_dim;
-            unsigned f_nbytes = this->feature_dim * sizeof(float);
-            if (f_nbytes < ALIGNMENT)
-                f_nbytes = ALIGNMENT;
-            uint64_t f_offset = key * this->feature_dim * sizeof(float);
-            io_uring_prep_read(sqe, this->fd, f_buffer, f_nbytes, f_offset);
-            sqe->user_data = static_cast<uint64_t>(key);
+        plan_reads(keys, reads);
+
+        // Rows to convert are read into ASYNC_ENYRY_NUM stage slots, and are
+        // converted into the cache as their reads complete
+        int64_t slot_size = this->read_size;
+        for (const offload_read &read : reads)
+            slot_size = std::max(slot_size, read.size);
+        std::unique_ptr<char, void (*)(void *)> stage(NULL, free);
+        std::unique_ptr<char, void (*)(void *)> gap(NULL, free);
+        std::vector<int> free_slots;
+        if (this->convert) {
+            stage.reset((char *)aligned_alloc(ALIGNMENT, ASYNC_ENYRY_NUM * slot_size));
+            for (int s = ASYNC_ENYRY_NUM - 1; s >= 0; s--)
+                free_slots.push_back(s);
+        } else {
+            gap.reset(scatter_reads(keys, reads, iovecs, cache_slot));
+        }
+
+        auto complete = [&](io_uring_cqe *cqe) {
+            offload_read &read = reads[cqe->user_data];
+            complete_read(read, cqe->res, keys, cache_slot);
+            if (stage)
+                free_slots.push_back(read.slot);
+            io_uring_cqe_seen(&ring, cqe);
+            for (size_t k = read.first; k < read.last; k++)
+                this->map_table[keys[k]].valid = 1;
+            finished += 1;
+        };
+        
+        int ret = io_uring_queue_init(ASYNC_ENYRY_NUM, &ring, 0);
+        if (ret)
+        {
+            fprintf(stderr, "Unable to setup io_uring: %s\n", strerror(-ret));
+            goto err_lock;
+        }
+
+        for (size_t r = 0; r < reads.size(); r++)
+        {
+            offload_read &read = reads[r];
+
+            while (stage && free_slots.empty())
+            {
+                io_uring_cqe *cqe;
+                ret = io_uring_wait_cqe(&ring, &cqe);
+                if (ret < 0)
+                {
+                    fprintf(stderr, "Error waiting for completion: %s\n", strerror(-ret));
+                    goto err_lock;
+                }
+                complete(cqe);
+            }
+
+            io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+            if (!sqe)
+            {
+                fprintf(stderr, "Could not get SQE.\n");
+                goto err_lock;
+            }
+
+            if (stage) {
+                read.slot = free_slots.back();
+                free_slots.pop_back();
+                read.stage = stage.get() + read.slot * slot_size;
+                io_uring_prep_read(sqe, this->fd, read.stage, read.size, read.offset);
+            } else {
+                io_uring_prep_readv(sqe, this->fd, &iovecs[read.iov_first], read.iov_last - read.iov_first, read.offset);
+            }
+            sqe->user_data = static_cast<uint64_t>(r);
             io_uring_submit(&ring);
             async_loading += 1;
 
@@ -369,14 +450,7 @@ torch::Tensor Offloader::cpu_async_load(torch::Tensor &idx)
             ret = io_uring_peek_cqe(&ring, &cqe);
             if (ret == 0)
             {
-                int64_t cqe_key = static_cast<int64_t>(cqe->user_data);
-                if (cqe->res < 0)
-                {
-                    fprintf(stderr, "Error in async operation in cpu: %s %d\n", strerror(-cqe->res), cqe_key);
-                }
-                io_uring_cqe_seen(&ring, cqe);
-                this->map_table[cqe_key].valid = 1;
-                finished += 1;
+                complete(cqe);
             }
         }
         this->update_mutex.unlock();
@@ -390,14 +464,7 @@ torch::Tensor Offloader::cpu_async_load(torch::Tensor &idx)
                 fprintf(stderr, "Error waiting for completion: %s\n", strerror(-ret));
                 goto err;
             }
-            int64_t cqe_key = static_cast<int64_t>(cqe->user_data);
-            if (cqe->res < 0)
-            {
-                fprintf(stderr, "Error in async operation in cpu: %s %d\n", strerror(-cqe->res), cqe_key);
-            }
-            io_uring_cqe_seen(&ring, cqe);
-            this->map_table[cqe_key].valid = 1;
-            finished += 1;
+            complete(cqe);
         }
         io_uring_queue_exit(&ring);
     } else {
@@ -428,13 +495,16 @@ void Offloader::load_callback(int key, cudaStream_t& cuda_read_stream)
 
     this->map_table[key].valid = 1;
 
-    float *host_buffer;
-    host_buffer = this->cache_data + host_index * this->group_size * this->feature_dim;
-    float *dev_buffer;
-    dev_buffer = this->device_cache + index * this->group_size * this->feature_dim;
-    unsigned cuda_nbytes = this->feature_dim * sizeof(float);
-    if (cuda_nbytes < ALIGNMENT)
-        cuda_nbytes = ALIGNMENT;
+    char *host_buffer;
+    host_buffer = this->cache_data + host_index * this->read_size;
+    if (this->convert) {
+        char *convert_buffer = this->convert_data + host_index * this->group_size * this->cache_row_size;
+        convert_group(key, host_buffer, convert_buffer);
+        host_buffer = convert_buffer;
+    }
+    char *dev_buffer;
+    dev_buffer = this->device_cache + index * this->group_size * this->cache_row_size;
+    unsigned cuda_nbytes = this->group_size * this->cache_row_size;
     cudaMemcpyAsync(dev_buffer, host_buffer, cuda_nbytes,
                     cudaMemcpyHostToDevice, cuda_read_stream);
 }
@@ -446,6 +516,9 @@ torch::Tensor Offloader::gpu_async_load(torch::Tensor &idx, int t_id, int t_tota
     omp_init_lock(&lock);
     bool need_load = false;
     std::unordered_set<int64_t> need_wait;
+    // Groups first seen unloaded in this call, whose index is only assigned
+    // when they are read below
+    std::unordered_set<int64_t> loading;
 
     torch::Tensor remap_idx = torch::zeros_like(idx);
     int64_t num_idx = idx.numel();
@@ -471,7 +544,7 @@ torch::Tensor Offloader::gpu_async_load(torch::Tensor &idx, int t_id, int t_tota
                 omp_unset_lock(&lock);
             }
         } else {
-            if (this->map_table[key].ref > 0) {
+            if (this->map_table[key].ref > 0 && loading.count(key) == 0) {
                 remap_data[n] = this->map_table[key].index * this->group_size + offset;
                 omp_set_lock(&lock);
                 need_wait.insert(key);
@@ -479,6 +552,7 @@ torch::Tensor Offloader::gpu_async_load(torch::Tensor &idx, int t_id, int t_tota
             } else {
                 remap_data[n] = -1;
                 need_load = true;
+                loading.insert(key);
             }
         }
         this->map_table[key].ref += 1;
@@ -506,13 +580,13 @@ torch::Tensor Offloader::gpu_async_load(torch::Tensor &idx, int t_id, int t_tota
             int64_t key = idx_data[n];
             int64_t offset = 0;
             if (this->group_size > 1) {
-                // loaded before
                 offset = key % this->group_size;
                 key = key / this->group_size * this->group_size;
-                if (this->back_index[this->map_table[key].index] == key) {
-                    remap_data[n] = this->map_table[key].index * this->group_size + offset;
-                    continue;
-                }
+            }
+            // loaded before, for an earlier node of the group or the same node
+            if (this->back_index[this->map_table[key].index] == key) {
+                remap_data[n] = this->map_table[key].index * this->group_size + offset;
+                continue;
             }
 
             io_uring_sqe *sqe = io_uring_get_sqe(&ring);
@@ -541,13 +615,10 @@ torch::Tensor Offloader::gpu_async_load(torch::Tensor &idx, int t_id, int t_tota
             this->map_table[key].index = index;            
             this->back_index[index] = key;
 
-            float *f_buffer;
-            f_buffer = this->cache_data + host_index * this->group_size * this->feature_dim;
-            unsigned f_nbytes = this->feature_dim * sizeof(float);
-            if (f_nbytes < ALIGNMENT)
-                f_nbytes = ALIGNMENT;
-            uint64_t f_offset = key * this->feature_dim * sizeof(float);
-            io_uring_prep_read(sqe, this->fd, f_buffer, f_nbytes, f_offset);
+            char *f_buffer;
+            f_buffer = this->cache_data + host_index * this->read_size;
+            uint64_t f_offset = key * this->row_size;
+            io_uring_prep_read(sqe, this->fd, f_buffer, this->read_size, f_offset);
             sqe->user_data = static_cast<uint64_t>(key);
             io_uring_submit(&ring);
             async_loading += 1;
@@ -636,15 +707,29 @@ void Offloader::release(torch::Tensor &idx)
 }
 
 
+std::tuple<int64_t, int64_t, int64_t, int64_t> Offloader::get_io_stats(bool reset)
+{
+    std::lock_guard<std::mutex> guard(this->update_mutex);
+    auto stats = std::make_tuple(this->stat_groups, this->stat_bytes_requested, this->stat_reads, this->stat_bytes_read);
+    if (reset)
+        this->stat_groups = this->stat_bytes_requested = this->stat_reads = this->stat_bytes_read = 0;
+    return stats;
+}
+
+
 namespace py = pybind11;
 
 PYBIND11_MODULE(offload, m)
 {
     py::class_<Offloader>(m, "Offloader")
         .def(py::init<const std::string &, const int64_t, const int64_t, const int64_t, 
-             const std::string &, int, int>(),
+             const std::string &, int, int, const std::string &, const std::string &, c10::optional<torch::Tensor>,
+             int64_t, const std::string &>(),
              py::arg("filename"), py::arg("node_num"), py::arg("dim"), py::arg("buffer_size"), 
-             py::arg("type"), py::arg("device_id"), py::arg("stage_size"))
+             py::arg("type"), py::arg("device_id"), py::arg("stage_size"),
+             py::arg("dtype") = "float32", py::arg("cache_dtype") = "float32", py::arg("scales") = py::none(),
+             py::arg("max_gap") = OFFLOAD_MAX_GAP, py::arg("hugepage") = "none")
+        .def("get_io_stats", &Offloader::get_io_stats, py::arg("reset") = false)
         .def("async_load", &Offloader::async_load, py::arg("tensor"), py::arg("t_id"), py::arg("t_total"))
         .def("release", &Offloader::release, py::arg("tensor"))
         .def("get_tensor", &Offloader::get_tensor);
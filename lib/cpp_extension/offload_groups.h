@@ -0,0 +1,158 @@
+#pragma once
+#include <torch/extension.h>
+#include <sys/uio.h>
+#include <stdlib.h>
+#include <cstring>
+#include <algorithm>
+#include <vector>
+#include "feature_dtype.h"
+
+#define ALIGNMENT 512
+#define OFFLOAD_MAX_READ (128*1024)
+#define OFFLOAD_MAX_GAP (8*1024)
+
+// A read of the groups keys[first, last), which lie in the file from offset on.
+// Direct reads scatter into the cache slots through iovecs[iov_first, iov_last),
+// with the gaps between groups going to a scratch buffer. Reads whose rows are
+// converted go to stage, which may be the slot-th of a set of stage buffers.
+typedef struct offload_read_s
+{
+    size_t first;
+    size_t last;
+    int64_t offset;
+    int64_t size;
+    size_t iov_first;
+    size_t iov_last;
+    int slot;
+    char *stage;
+} offload_read;
+
+// How the offloaders lay out rows in groups and read them, shared by the io_uring
+// and the libaio Offloader. A group is the group_size rows that start at a key
+// (a node ID that is a multiple of group_size) and takes a read of read_size
+// bytes of the file and a slot of group_size rows of the cache.
+//
+// Rows are row_size bytes of dtype in the file and cache_row_size bytes of
+// cache_dtype in the cache. If the dtypes differ, rows are read into a stage
+// buffer and converted as their reads complete.
+//
+// The CPU loads read groups in file order, and groups at most max_gap bytes
+// apart share a read of up to OFFLOAD_MAX_READ bytes if merge is set. A
+// negative max_gap reads every group on its own in idx order.
+class OffloadGroups
+{
+protected:
+    OffloadGroups(int64_t node_num, int64_t dim, const std::string &dtype, const std::string &cache_dtype,
+                  c10::optional<torch::Tensor> scales, int64_t max_gap)
+        : node_size(node_num), feature_dim(dim), dtype(parse_feature_dtype(dtype)),
+          cache_dtype(parse_feature_dtype(cache_dtype)), max_gap(max_gap)
+    {
+        TORCH_CHECK(this->cache_dtype != FeatureDtype::Int8, "the cache dtype must be float32, float16 or bfloat16");
+        if (this->dtype == FeatureDtype::Int8) {
+            TORCH_CHECK(scales.has_value() && scales->scalar_type() == torch::kFloat32 && scales->is_contiguous() &&
+                        scales->numel() >= node_num, "int8 features need a float32 tensor of ", node_num, " scales");
+            this->scales = *scales;
+            this->scales_data = this->scales.data_ptr<float>();
+        }
+        this->row_size = this->feature_dim * feature_dtype_size(this->dtype);
+        this->cache_row_size = this->feature_dim * feature_dtype_size(this->cache_dtype);
+        this->convert = this->dtype != this->cache_dtype;
+
+        this->group_size = ALIGNMENT / this->row_size;
+        if (this->group_size < 1) {
+            this->group_size = 1;
+        }
+        this->read_size = std::max(this->group_size * this->row_size, (int64_t)ALIGNMENT);
+        // Groups of a merged read must start on aligned offsets and fill their read_size
+        this->merge = this->max_gap >= 0 && this->group_size * this->row_size % ALIGNMENT == 0;
+    }
+
+    int64_t node_size;
+    int64_t feature_dim;
+    FeatureDtype dtype;
+    FeatureDtype cache_dtype;
+    int64_t row_size;
+    int64_t cache_row_size;
+    int64_t read_size;
+    bool convert;
+    torch::Tensor scales;
+    const float *scales_data = NULL;
+    int group_size;
+    int64_t max_gap;
+    bool merge;
+    int64_t stat_groups = 0;
+    int64_t stat_bytes_requested = 0;
+    int64_t stat_reads = 0;
+    int64_t stat_bytes_read = 0;
+
+    // Convert the rows of the group at key, read into src, to dst
+    void convert_group(int64_t key, const char *src, char *dst) {
+        int64_t num_rows = std::min((int64_t)this->group_size, this->node_size - key);
+        convert_rows(dst, this->cache_dtype, src, this->dtype, this->feature_dim, num_rows,
+                     this->scales_data ? this->scales_data + key : NULL);
+    }
+
+    // Sort keys unless max_gap is negative, and plan the reads of the groups
+    void plan_reads(std::vector<int64_t> &keys, std::vector<offload_read> &reads) {
+        if (this->max_gap >= 0)
+            std::sort(keys.begin(), keys.end());
+        for (size_t k = 0; k < keys.size(); k++) {
+            int64_t begin = keys[k] * this->row_size;
+            if (!reads.empty() && this->merge) {
+                offload_read &read = reads.back();
+                int64_t read_end = read.offset + read.size;
+                if (begin >= read_end && begin - read_end <= this->max_gap &&
+                    begin + this->read_size - read.offset <= OFFLOAD_MAX_READ) {
+                    read.size = begin + this->read_size - read.offset;
+                    read.last = k + 1;
+                    continue;
+                }
+            }
+            reads.push_back(offload_read{k, k + 1, begin, this->read_size, 0, 0, -1, NULL});
+        }
+
+        this->stat_groups += keys.size();
+        this->stat_bytes_requested += keys.size() * this->read_size;
+        this->stat_reads += reads.size();
+        for (const offload_read &read : reads)
+            this->stat_bytes_read += read.size;
+    }
+
+    // Point the direct reads at the cache slots slot(key) of their groups, and
+    // return the scratch buffer their gaps go to, if any
+    template <typename F>
+    char *scatter_reads(const std::vector<int64_t> &keys, std::vector<offload_read> &reads,
+                        std::vector<iovec> &iovecs, F slot) {
+        char *gap = NULL;
+        if (reads.size() < keys.size())
+            gap = (char *)aligned_alloc(ALIGNMENT, std::min(this->max_gap + ALIGNMENT - 1, (int64_t)OFFLOAD_MAX_READ) & ~(int64_t)(ALIGNMENT - 1));
+        for (offload_read &read : reads) {
+            int64_t read_end = read.offset;
+            read.iov_first = iovecs.size();
+            for (size_t k = read.first; k < read.last; k++) {
+                int64_t begin = keys[k] * this->row_size;
+                if (begin > read_end)
+                    iovecs.push_back(iovec{gap, (size_t)(begin - read_end)});
+                iovecs.push_back(iovec{slot(keys[k]), (size_t)this->read_size});
+                read_end = begin + this->read_size;
+            }
+            read.iov_last = iovecs.size();
+        }
+        return gap;
+    }
+
+    // Finish read, which returned res bytes or an error: staged groups are
+    // converted into their cache slots slot(key)
+    template <typename F>
+    void complete_read(const offload_read &read, int64_t res, const std::vector<int64_t> &keys, F slot) {
+        if (res < 0)
+        {
+            fprintf(stderr, "Error in async operation in cpu: %s %ld\n", strerror(-res), keys[read.first]);
+        }
+        else if (read.stage)
+        {
+            for (size_t k = read.first; k < read.last; k++)
+                convert_group(keys[k], read.stage + keys[k] * this->row_size - read.offset, slot(keys[k]));
+        }
+    }
+};
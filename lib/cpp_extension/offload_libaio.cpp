@@ -18,8 +18,11 @@
 #include <cstring>
 #include <cstdlib>
 #include <fstream>
+#include <algorithm>
+#include "feature_dtype.h"
+#include "hugepage.h"
+#include "offload_groups.h"
 
-#define ALIGNMENT 512
 #define DEFAULT_AIO_MAX_NR 65536
 #define EVENT_BUFFER_SIZE 4
 
@@ -39,12 +42,15 @@ typedef struct map_info_s
     struct iocb *iocb;
 } map_info;
 
-class Offloader
+class Offloader : public OffloadGroups
 {
 public:
     Offloader(const std::string &filename, const int64_t node_num, 
         const int64_t dim, const int64_t buffer_size, 
-        const std::string &type = "cpu", int device_id = 0, int stage_size = 0);
+        const std::string &type = "cpu", int device_id = 0, int stage_size = 0,
+        const std::string &dtype = "float32", const std::string &cache_dtype = "float32",
+        c10::optional<torch::Tensor> scales = c10::nullopt, int64_t max_gap = OFFLOAD_MAX_GAP,
+        const std::string &hugepage = "none");
     ~Offloader();
 
     torch::Tensor get_tensor();
@@ -53,6 +59,10 @@ public:
 
     void release(torch::Tensor &idx);
 
+    // Groups read, bytes of those groups, reads issued and bytes read by the
+    // CPU loads
+    std::tuple<int64_t, int64_t, int64_t, int64_t> get_io_stats(bool reset);
+
 private:
     AsyncType async_type;
 
@@ -61,17 +71,17 @@ private:
     int max_aio_requests;
 
     torch::Tensor feature_tensor;
-    float *cache_data;
-    int64_t feature_dim;
+    char *cache_data;
+    // The CPU cache, mapped with the pages of hugepage
+    HugePage hugepage;
+    HugeAlloc cache_alloc = {NULL, 0, HugePage::None};
     int64_t cache_size;
     std::vector<int64_t> back_index;
     size_t mem_size = 0;
 
     std::mutex update_mutex;
-    int64_t node_size;
     std::vector<map_info> map_table;
     // free table
-    int group_size;
     int64_t free_index_size;
     std::list<int64_t> free_lru_list;
     std::unordered_map<int64_t, std::list<int64_t>::iterator> free_map_table;
@@ -133,7 +143,8 @@ private:
     size_t stage_mem_size = 0;
     std::vector<int64_t> stage_map_table;
 
-    float *device_cache;
+    char *device_cache;
+    char *convert_data = NULL;
     void init_gpu(int device_id);
     torch::Tensor gpu_async_load(torch::Tensor &idx, int t_id = 0, int t_total = 1);
 
@@ -145,14 +156,12 @@ private:
 
 
 Offloader::Offloader(const std::string &filename, const int64_t node_num, 
-    const int64_t dim, const int64_t buffer_size, const std::string &type, int device_id, int stage_size) 
-    : filename(filename), node_size(node_num), feature_dim(dim), cache_size(buffer_size), stage_size(stage_size)
+    const int64_t dim, const int64_t buffer_size, const std::string &type, int device_id, int stage_size,
+    const std::string &dtype, const std::string &cache_dtype, c10::optional<torch::Tensor> scales, int64_t max_gap,
+    const std::string &hugepage) 
+    : OffloadGroups(node_num, dim, dtype, cache_dtype, scales, max_gap),
+      filename(filename), cache_size(buffer_size), stage_size(stage_size), hugepage(parse_hugepage(hugepage))
 {
-    this->group_size = ALIGNMENT / (this->feature_dim * sizeof(float));
-    if (this->group_size < 1) {
-        this->group_size = 1;
-    }
-
     this->free_index_size = this->cache_size;
     this->cache_size = this->cache_size * group_size;
 
@@ -195,14 +204,23 @@ Offloader::Offloader(const std::string &filename, const int64_t node_num,
 
 void Offloader::init_cpu() 
 {
-    this->mem_size = this->cache_size * this->feature_dim * sizeof(float);
+    this->mem_size = this->cache_size * this->cache_row_size;
     if (this->mem_size % ALIGNMENT)
         this->mem_size = (this->mem_size / ALIGNMENT + 1) * ALIGNMENT;
 
-    this->cache_data = (float *)aligned_alloc(4096, this->mem_size);
+    this->cache_alloc = huge_alloc(this->mem_size, this->hugepage);
+    if (this->cache_alloc.ptr == NULL) {
+        // The destructor does not run if the constructor throws
+        close(this->fd);
+        TORCH_CHECK(false, "out of memory allocating ", this->mem_size, " bytes for the cache");
+    }
+    this->cache_data = (char *)this->cache_alloc.ptr;
+    if (this->cache_alloc.page != this->hugepage)
+        fprintf(stderr, "Offloader: no %s pages for the cache, using %s\n",
+                hugepage_name(this->hugepage), hugepage_name(this->cache_alloc.page));
 
     auto options = torch::TensorOptions()
-        .dtype(torch::kFloat32)
+        .dtype(feature_scalar_type(this->cache_dtype))
         .layout(torch::kStrided)
         .device(torch::kCPU)
         .requires_grad(false);
@@ -215,24 +233,26 @@ void Offloader::init_cpu()
 
 void Offloader::init_gpu(int device_id) 
 {
-    this->mem_size = this->cache_size * this->feature_dim * sizeof(float);
+    this->mem_size = this->cache_size * this->cache_row_size;
     if (this->mem_size % ALIGNMENT)
         this->mem_size = (this->mem_size / ALIGNMENT + 1) * ALIGNMENT;
 
-    this->stage_mem_size = this->stage_size * this->group_size * this->feature_dim * sizeof(float);
-    if (this->stage_mem_size % ALIGNMENT)
-        this->stage_mem_size = (this->stage_mem_size / ALIGNMENT + 1) * ALIGNMENT;
+    // A stage slot holds a read, whose rows are converted into the slot of
+    // convert_data if the dtypes differ
+    this->stage_mem_size = this->stage_size * this->read_size;
 
     this->stage_map_table.resize(this->node_size);
 
     cudaSetDevice(device_id);
 
     cudaMallocHost(&this->cache_data, this->stage_mem_size);
+    if (this->convert)
+        cudaMallocHost(&this->convert_data, this->stage_size * this->group_size * this->cache_row_size);
 
     cudaMalloc(&this->device_cache, this->mem_size);
 
     auto options = torch::TensorOptions()
-        .dtype(torch::kFloat32)
+        .dtype(feature_scalar_type(this->cache_dtype))
         .layout(torch::kStrided)
         .device(torch::kCUDA, device_id)
         .requires_grad(false);
@@ -248,16 +268,18 @@ Offloader::~Offloader()
     switch (this->async_type)
     {
     case AsyncType::CPU:
-        if(this->cache_data){
-            free(this->cache_data);
-            this->cache_data = nullptr;
-        }
+        huge_free(this->cache_alloc);
+        this->cache_data = nullptr;
         break;
     case AsyncType::GPU:
         if(this->cache_data){
             cudaFreeHost(this->cache_data);
             this->cache_data = nullptr;
         }
+        if(this->convert_data){
+            cudaFreeHost(this->convert_data);
+            this->convert_data = nullptr;
+        }
         if(this->device_cache){
             cudaFree(this->device_cache);
             this->device_cache = nullptr;
@@ -302,6 +324,9 @@ torch::Tensor Offloader::cpu_async_load(torch::Tensor &idx, int t_total)
     omp_init_lock(&lock);
     bool need_load = false;
     std::unordered_set<int64_t> need_wait;
+    // Groups first seen unloaded in this call, whose index is only assigned
+    // when they are read below
+    std::unordered_set<int64_t> loading;
     int max_aio_events = (max_aio_requests/2)/t_total;
     assert(max_aio_events > 0);
 
@@ -329,7 +354,7 @@ torch::Tensor Offloader::cpu_async_load(torch::Tensor &idx, int t_total)
                 omp_unset_lock(&lock);
             }
         } else {
-            if (this->map_table[key].ref > 0) {
+            if (this->map_table[key].ref > 0 && loading.count(key) == 0) {
                 remap_data[n] = this->map_table[key].index * this->group_size + offset;
                 omp_set_lock(&lock);
                 need_wait.insert(key);
@@ -337,6 +362,7 @@ torch::Tensor Offloader::cpu_async_load(torch::Tensor &idx, int t_total)
             } else {
                 remap_data[n] = -1;
                 need_load = true;
+                loading.insert(key);
             }
         }
         this->map_table[key].ref += 1;
@@ -347,15 +373,13 @@ torch::Tensor Offloader::cpu_async_load(torch::Tensor &idx, int t_total)
         int64_t finished = 0;
         int64_t async_loading = 0;
         struct io_event events[EVENT_BUFFER_SIZE];
-
-        memset(&ctx, 0, sizeof(ctx));
-        int ret = io_setup(max_aio_events, &ctx);
-        if (ret != 0)
-        {
-            fprintf(stderr, "Unable to setup io_context: %s\n", strerror(-ret));
-            io_destroy(ctx);
-            goto err_lock;
-        }
+        std::vector<int64_t> keys;
+        std::vector<offload_read> reads;
+        std::vector<iovec> iovecs;
+        std::vector<struct iocb> iocbs;
+        auto cache_slot = [&](int64_t key) {
+            return this->cache_data + this->map_table[key].index * this->group_size * this->cache_row_size;
+        };
 
         for (int64_t n = 0; n < num_idx; n++)
         {
@@ -365,44 +389,71 @@ torch::Tensor Offloader::cpu_async_load(torch::Tensor &idx, int t_total)
             int64_t key = idx_data[n];
             int64_t offset = 0;
             if (this->group_size > 1) {
-                // loaded before
                 offset = key % this->group_size;
                 key = key / this->group_size * this->group_size;
-                if (this->back_index[this->map_table[key].index] == key) {
-                    remap_data[n] = this->map_table[key].index * this->group_size + offset;
-                    continue;
-                }
+            }
+            // loaded before, for an earlier node of the group or the same node
+            if (this->back_index[this->map_table[key].index] == key) {
+                remap_data[n] = this->map_table[key].index * this->group_size + offset;
+                continue;
             }
 
             int64_t index = get_free_index();
             if (index < 0)
             {
                 fprintf(stderr, "No free table.\n");
-                io_destroy(ctx);
                 goto err_lock;
             }
             remap_data[n] = index * this->group_size + offset;
             this->map_table[key].index = index;
-            struct iocb *iocb_ptr = new struct iocb;
-            this->map_table[key].iocb = iocb_ptr;
             this->back_index[index] = key;
+            keys.push_back(key);
+        }
 
-            float *f_buffer;
-            f_buffer = this->cache_data + index * this->group_size * this->feature_dim;
-            unsigned f_nbytes = this->feature_dim * sizeof(float);
-            if (f_nbytes < ALIGNMENT)
-                f_nbytes = ALIGNMENT;
-            uint64_t f_offset = key * this->feature_dim * sizeof(float);
-            io_prep_pread(iocb_ptr, this->fd, f_buffer, f_nbytes, f_offset);
-            int64_t *keyptr = new int64_t;
-            *keyptr = key;
-            iocb_ptr->data = reinterpret_cast<void *>(keyptr);
+        plan_reads(keys, reads);
+        iocbs.resize(reads.size());
+
+        // Rows to convert are read into a stage buffer of their own, which is
+        // freed once they are converted
+        std::unique_ptr<char, void (*)(void *)> gap(NULL, free);
+        if (!this->convert)
+            gap.reset(scatter_reads(keys, reads, iovecs, cache_slot));
+
+        auto complete = [&](struct io_event &event) {
+            offload_read &read = reads[reinterpret_cast<uintptr_t>(event.data)];
+            complete_read(read, static_cast<long>(event.res), keys, cache_slot);
+            free(read.stage);
+            for (size_t k = read.first; k < read.last; k++)
+                this->map_table[keys[k]].valid = 1;
+            finished += 1;
+        };
+
+        memset(&ctx, 0, sizeof(ctx));
+        int ret = io_setup(max_aio_events, &ctx);
+        if (ret != 0)
+        {
+            fprintf(stderr, "Unable to setup io_context: %s\n", strerror(-ret));
+            io_destroy(ctx);
+            goto err_lock;
+        }
+
+        for (size_t r = 0; r < reads.size(); r++)
+        {
+            offload_read &read = reads[r];
+            struct iocb *iocb_ptr = &iocbs[r];
+
+            if (this->convert) {
+                read.stage = (char *)aligned_alloc(ALIGNMENT, read.size);
+                io_prep_pread(iocb_ptr, this->fd, read.stage, read.size, read.offset);
+            } else {
+                io_prep_preadv(iocb_ptr, this->fd, &iovecs[read.iov_first], read.iov_last - read.iov_first, read.offset);
+            }
+            iocb_ptr->data = reinterpret_cast<void *>(static_cast<uintptr_t>(r));
             ret = io_submit(ctx, 1, &iocb_ptr);
             if (ret < 0)
             {
                 fprintf(stderr, "Error in io_submit: %s\n", strerror(-ret));
-                delete iocb_ptr;
-                delete keyptr;
+                free(read.stage);
                 io_destroy(ctx);
                 goto err_lock;
             }
@@ -411,15 +462,7 @@ torch::Tensor Offloader::cpu_async_load(torch::Tensor &idx, int t_total)
             ret = io_getevents(ctx, 0, 1, events, nullptr);
             if (ret > 0)
             {
-                int64_t cqe_key = *reinterpret_cast<int64_t *>(events[0].data);
-                delete reinterpret_cast<int64_t *>(events[0].data);
-                if (events[0].res < 0)
-                {
-                    fprintf(stderr, "Error in async operation in cpu: %s %d\n", strerror(-events[0].res), cqe_key);
-                }
-                this->map_table[cqe_key].valid = 1;
-                delete this->map_table[cqe_key].iocb;
-                finished += 1;
+                complete(events[0]);
             }
         }
         this->update_mutex.unlock();
@@ -435,15 +478,7 @@ torch::Tensor Offloader::cpu_async_load(torch::Tensor &idx, int t_total)
             }
             for (int i = 0; i < ret; i++)
             {
-                int64_t cqe_key = *reinterpret_cast<int64_t *>(events[i].data);
-                delete reinterpret_cast<int64_t *>(events[i].data);
-                if (events[i].res < 0)
-                {
-                    fprintf(stderr, "Error in async operation in cpu: %s %d\n", strerror(-events[i].res), cqe_key);
-                }
-                this->map_table[cqe_key].valid = 1;
-                delete this->map_table[cqe_key].iocb;
-                finished += 1;
+                complete(events[i]);
             }
         }
         io_destroy(ctx);
@@ -475,13 +510,16 @@ void Offloader::load_callback(int key, cudaStream_t& cuda_read_stream)
     this->map_table[key].valid = 1;
     delete this->map_table[key].iocb;
 
-    float *host_buffer;
-    host_buffer = this->cache_data + host_index * this->group_size * this->feature_dim;
-    float *dev_buffer;
-    dev_buffer = this->device_cache + index * this->group_size * this->feature_dim;
-    unsigned cuda_nbytes = this->feature_dim * sizeof(float);
-    if (cuda_nbytes < ALIGNMENT)
-        cuda_nbytes = ALIGNMENT;
+    char *host_buffer;
+    host_buffer = this->cache_data + host_index * this->read_size;
+    if (this->convert) {
+        char *convert_buffer = this->convert_data + host_index * this->group_size * this->cache_row_size;
+        convert_group(key, host_buffer, convert_buffer);
+        host_buffer = convert_buffer;
+    }
+    char *dev_buffer;
+    dev_buffer = this->device_cache + index * this->group_size * this->cache_row_size;
+    unsigned cuda_nbytes = this->group_size * this->cache_row_size;
     cudaMemcpyAsync(dev_buffer, host_buffer, cuda_nbytes,
                     cudaMemcpyHostToDevice, cuda_read_stream);
 }
@@ -493,6 +531,9 @@ torch::Tensor Offloader::gpu_async_load(torch::Tensor &idx, int t_id, int t_tota
     omp_init_lock(&lock);
     bool need_load = false;
     std::unordered_set<int64_t> need_wait;
+    // Groups first seen unloaded in this call, whose index is only assigned
+    // when they are read below
+    std::unordered_set<int64_t> loading;
     int max_aio_events = (max_aio_requests/2)/t_total;
     assert(max_aio_events > 0);
 
@@ -520,7 +561,7 @@ torch::Tensor Offloader::gpu_async_load(torch::Tensor &idx, int t_id, int t_tota
                 omp_unset_lock(&lock);
             }
         } else {
-            if (this->map_table[key].ref > 0) {
+            if (this->map_table[key].ref > 0 && loading.count(key) == 0) {
                 remap_data[n] = this->map_table[key].index * this->group_size + offset;
                 omp_set_lock(&lock);
                 need_wait.insert(key);
@@ -528,6 +569,7 @@ torch::Tensor Offloader::gpu_async_load(torch::Tensor &idx, int t_id, int t_tota
             } else {
                 remap_data[n] = -1;
                 need_load = true;
+                loading.insert(key);
             }
         }
         this->map_table[key].ref += 1;
@@ -558,13 +600,13 @@ torch::Tensor Offloader::gpu_async_load(torch::Tensor &idx, int t_id, int t_tota
             int64_t key = idx_data[n];
             int64_t offset = 0;
             if (this->group_size > 1) {
-                // loaded before
                 offset = key % this->group_size;
                 key = key / this->group_size * this->group_size;
-                if (this->back_index[this->map_table[key].index] == key) {
-                    remap_data[n] = this->map_table[key].index * this->group_size + offset;
-                    continue;
-                }
+            }
+            // loaded before, for an earlier node of the group or the same node
+            if (this->back_index[this->map_table[key].index] == key) {
+                remap_data[n] = this->map_table[key].index * this->group_size + offset;
+                continue;
             }
 
             int64_t host_index = this->stage_size / t_total * t_id + n;
@@ -590,13 +632,10 @@ torch::Tensor Offloader::gpu_async_load(torch::Tensor &idx, int t_id, int t_tota
             this->map_table[key].iocb = iocb_ptr;        
             this->back_index[index] = key;
 
-            float *f_buffer;
-            f_buffer = this->cache_data + host_index * this->group_size * this->feature_dim;
-            unsigned f_nbytes = this->feature_dim * sizeof(float);
-            if (f_nbytes < ALIGNMENT)
-                f_nbytes = ALIGNMENT;
-            uint64_t f_offset = key * this->feature_dim * sizeof(float);
-            io_prep_pread(iocb_ptr, this->fd, f_buffer, f_nbytes, f_offset);
+            char *f_buffer;
+            f_buffer = this->cache_data + host_index * this->read_size;
+            uint64_t f_offset = key * this->row_size;
+            io_prep_pread(iocb_ptr, this->fd, f_buffer, this->read_size, f_offset);
             int64_t *keyptr = new int64_t;
             *keyptr = key;
             iocb_ptr->data = reinterpret_cast<void *>(keyptr);
@@ -696,15 +735,29 @@ void Offloader::release(torch::Tensor &idx)
 }
 
 
+std::tuple<int64_t, int64_t, int64_t, int64_t> Offloader::get_io_stats(bool reset)
+{
+    std::lock_guard<std::mutex> guard(this->update_mutex);
+    auto stats = std::make_tuple(this->stat_groups, this->stat_bytes_requested, this->stat_reads, this->stat_bytes_read);
+    if (reset)
+        this->stat_groups = this->stat_bytes_requested = this->stat_reads = this->stat_bytes_read = 0;
+    return stats;
+}
+
+
 namespace py = pybind11;
 
 PYBIND11_MODULE(offload, m)
 {
     py::class_<Offloader>(m, "Offloader")
         .def(py::init<const std::string &, const int64_t, const int64_t, const int64_t, 
-             const std::string &, int, int>(),
+             const std::string &, int, int, const std::string &, const std::string &, c10::optional<torch::Tensor>,
+             int64_t, const std::string &>(),
              py::arg("filename"), py::arg("node_num"), py::arg("dim"), py::arg("buffer_size"), 
-             py::arg("type"), py::arg("device_id"), py::arg("stage_size"))
+             py::arg("type"), py::arg("device_id"), py::arg("stage_size"),
+             py::arg("dtype") = "float32", py::arg("cache_dtype") = "float32", py::arg("scales") = py::none(),
+             py::arg("max_gap") = OFFLOAD_MAX_GAP, py::arg("hugepage") = "none")
+        .def("get_io_stats", &Offloader::get_io_stats, py::arg("reset") = false)
         .def("async_load", &Offloader::async_load, py::arg("tensor"), py::arg("t_id"), py::arg("t_total"))
         .def("release", &Offloader::release, py::arg("tensor"))
         .def("get_tensor", &Offloader::get_tensor);
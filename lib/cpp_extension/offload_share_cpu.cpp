@@ -19,6 +19,7 @@
 #include <sys/ipc.h>
 #include <sys/shm.h>
 #include <semaphore.h>
+#include "hugepage.h"
 
 #define ALIGNMENT 512
 #define ASYNC_ENYRY_NUM 80
@@ -45,7 +46,8 @@ class CPUOffloader
 {
 public:
     CPUOffloader(const std::string &filename, const int64_t node_num, 
-    const int64_t dim, const int64_t buffer_size, int rank, int world_size);
+    const int64_t dim, const int64_t buffer_size, int rank, int world_size,
+    const std::string &hugepage = "none");
     ~CPUOffloader();
 
     torch::Tensor get_tensor();
@@ -125,7 +127,8 @@ retry:
 
 
 CPUOffloader::CPUOffloader(const std::string &filename, const int64_t node_num, 
-    const int64_t dim, const int64_t buffer_size, int rank, int world_size) 
+    const int64_t dim, const int64_t buffer_size, int rank, int world_size,
+    const std::string &hugepage) 
     : filename(filename), node_size(node_num), feature_dim(dim), cache_size(buffer_size), rank(rank), world_size(world_size)
 {
     this->group_size = ALIGNMENT / (this->feature_dim * sizeof(float));
@@ -154,13 +157,21 @@ CPUOffloader::CPUOffloader(const std::string &filename, const int64_t node_num,
     if(key==-1)
         fprintf(stderr, "ftok error %d: %d %s\n", key, errno, strerror(errno));
   
-    this->shmid = shmget(key, mem_size, 0666 | IPC_CREAT);
+    // Every rank asks for the same pages, so they all find the segment the
+    // first one created
+    HugePage page = parse_hugepage(hugepage);
+    size_t shm_size = mem_size;
+    this->shmid = huge_shmget(key, shm_size, page, 0666 | IPC_CREAT);
     if(this->shmid==-1)
         fprintf(stderr, "shmget error %d: %llu %d %s\n", key, mem_size, errno, strerror(errno));
+    if (page != parse_hugepage(hugepage))
+        fprintf(stderr, "CPUOffloader: no %s pages for the cache, using %s\n", hugepage.c_str(), hugepage_name(page));
 
     this->shared_mem = (char *)shmat(this->shmid, NULL, 0);
     if (this->shared_mem ==  (char *) -1)
         fprintf(stderr, "shmat error %d: %d %s\n", key, errno, strerror(errno));
+    else
+        huge_shm_advise(this->shared_mem, shm_size, page);
 
     this->cache_data = (float *)this->shared_mem;
     this->map_table = (map_info *)(this->shared_mem + cache_data_size);
@@ -425,8 +436,9 @@ PYBIND11_MODULE(offloadCPU, m)
 {
     py::class_<CPUOffloader>(m, "CPUOffloader")
         .def(py::init<const std::string &, const int64_t, const int64_t,
-             const int64_t, int, int>(),
-             py::arg("filename"), py::arg("node_num"), py::arg("dim"), py::arg("buffer_size"), py::arg("rank"), py::arg("world_size"))
+             const int64_t, int, int, const std::string &>(),
+             py::arg("filename"), py::arg("node_num"), py::arg("dim"), py::arg("buffer_size"), py::arg("rank"), py::arg("world_size"),
+             py::arg("hugepage") = "none")
         .def("async_load", &CPUOffloader::async_load, py::arg("tensor"))
         .def("release", &CPUOffloader::release, py::arg("tensor"))
         .def("get_tensor", &CPUOffloader::get_tensor);
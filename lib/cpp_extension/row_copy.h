@@ -0,0 +1,89 @@
+#pragma once
+#include <stdlib.h>
+#include <cstring>
+#include <inttypes.h>
+#include <immintrin.h>
+
+// Row-copy kernels for gathers of float32 feature rows, shared by gather.cpp and
+// update.cpp. Widths 100, 128, 256 and 768 have AVX2 kernels with the width fixed
+// at compile time, other widths an AVX2 loop, and CPUs without AVX2 use memcpy.
+// Large outputs are written with non-temporal stores so that they do not evict
+// the source rows from the cache.
+#define ROW_COPY_PREFETCH 8
+#define ROW_COPY_STREAM_BYTES (16*1024*1024)
+
+typedef void (*row_copy_fn)(float* dst, const float* src, int64_t dim);
+
+inline void row_copy_memcpy(float* dst, const float* src, int64_t dim) {
+    memcpy(dst, src, dim*sizeof(float));
+}
+
+// Streaming kernels store 16 bytes at a time, so they need dim % 4 == 0 and a
+// 16-byte aligned dst
+template <bool STREAM>
+__attribute__((target("avx2"))) inline void row_copy_avx2(float* dst, const float* src, int64_t dim) {
+    int64_t vec_end = dim & ~(int64_t)3;
+    int64_t i = 0;
+    if (STREAM) {
+        for (; i < vec_end; i += 4)
+            _mm_stream_ps(dst + i, _mm_loadu_ps(src + i));
+    }
+    else {
+        for (; i + 8 <= vec_end; i += 8)
+            _mm256_storeu_ps(dst + i, _mm256_loadu_ps(src + i));
+        if (i < vec_end)
+            _mm_storeu_ps(dst + i, _mm_loadu_ps(src + i));
+    }
+    for (i = vec_end; i < dim; i++)
+        dst[i] = src[i];
+}
+
+template <int DIM, bool STREAM>
+__attribute__((target("avx2"))) void row_copy_avx2_fixed(float* dst, const float* src, int64_t) {
+    row_copy_avx2<STREAM>(dst, src, DIM);
+}
+
+template <bool STREAM>
+row_copy_fn select_row_copy_avx2(int64_t dim) {
+    switch (dim) {
+    case 100: return row_copy_avx2_fixed<100, STREAM>;
+    case 128: return row_copy_avx2_fixed<128, STREAM>;
+    case 256: return row_copy_avx2_fixed<256, STREAM>;
+    case 768: return row_copy_avx2_fixed<768, STREAM>;
+    default: return row_copy_avx2<STREAM>;
+    }
+}
+
+// Copies rows of dim floats into an output of output_bytes bytes at output. Call
+// prefetch() for the row ROW_COPY_PREFETCH iterations ahead, and finish() on every
+// thread that copied before the output is read.
+struct RowCopier
+{
+    int64_t dim;
+    bool stream;
+    row_copy_fn copy;
+
+    RowCopier(int64_t dim, int64_t output_bytes, const void* output, bool use_memcpy = false)
+        : dim(dim), stream(false), copy(row_copy_memcpy)
+    {
+        static const bool has_avx2 = __builtin_cpu_supports("avx2");
+        if (use_memcpy || !has_avx2)
+            return;
+        this->stream = output_bytes >= ROW_COPY_STREAM_BYTES && dim % 4 == 0 && ((uintptr_t)output & 15) == 0;
+        this->copy = this->stream ? select_row_copy_avx2<true>(dim) : select_row_copy_avx2<false>(dim);
+    }
+
+    void operator()(float* dst, const float* src) const {
+        this->copy(dst, src, this->dim);
+    }
+
+    void prefetch(const float* src) const {
+        for (int64_t b = 0; b < this->dim*(int64_t)sizeof(float); b += 64)
+            _mm_prefetch((const char*)src + b, _MM_HINT_T0);
+    }
+
+    void finish() const {
+        if (this->stream)
+            _mm_sfence();
+    }
+};
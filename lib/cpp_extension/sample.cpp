@@ -3,25 +3,32 @@
 #include <torch/extension.h>
 #include <Python.h>
 #include <pybind11/pybind11.h>
+#include <pybind11/stl.h>
 #include <torch/script.h>
 #include <errno.h>
 #include <cstring>
 #include <inttypes.h>
 #include <omp.h>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <cmath>
+#include <liburing.h>
 #define ALIGNMENT 4096
-
-// return start index of buffer
-int64_t load_neighbors_into_buffer(int col_fd, int64_t row_start, int64_t row_count, int64_t* buffer){
-    int64_t size = (row_count*sizeof(int64_t) + 2*ALIGNMENT)&(long)~(ALIGNMENT-1);
-    int64_t offset = row_start*sizeof(int64_t);
-    int64_t aligned_offset = offset&(long)~(ALIGNMENT-1);
-
-    if(pread(col_fd, buffer, size, aligned_offset) == -1){
-        fprintf(stderr, "ERROR: %s\n", strerror(errno));
-    }
-
-    return (offset-aligned_offset)/sizeof(int64_t);
-}
+#define SAMPLE_IO_DEPTH 64
+#define SAMPLE_SMALL_FANOUT 64
+#define COMPRESSED_BLOCK_ROWS 16
+#define SAMPLE_MAX_READ (128*1024)
+#define BUILD_CHUNK_SIZE (8*1024*1024)
+#define BUILD_IO_DEPTH 4
+#define BUILD_TASKS_PER_THREAD 8
+#define BLOCK_CACHE_SHARDS 64
+#define SAMPLE_INSERTION_SORT 32
 
 std::tuple<int64_t*, int64_t*, int64_t> get_new_neighbor_buffer(int64_t row_count){
     int64_t size = (row_count*sizeof(int64_t) + 3*ALIGNMENT)&(long)~(ALIGNMENT-1);
@@ -31,307 +38,1687 @@ std::tuple<int64_t*, int64_t*, int64_t> get_new_neighbor_buffer(int64_t row_coun
     return std::make_tuple(neighbor_buffer, aligned_neighbor_buffer, size/sizeof(int64_t));
 }
 
-std::tuple<torch::Tensor, torch::Tensor, torch::Tensor, torch::Tensor>
-sample_adj_ginex(torch::Tensor rowptr, std::string col_file, torch::Tensor idx, 
-                  torch::Tensor cache, torch::Tensor cache_table,
-                  int64_t num_neighbors, bool replace) {
+// Compressed column file: each row is stored as zigzag varint deltas, the first
+// neighbor coded against 0, so rows keep their order and e_id stays valid.
+// Row n starts at byte blocks[n / COMPRESSED_BLOCK_ROWS] + offsets[n], and
+// offsets has num_nodes + 1 entries so that row n ends where row n + 1 starts.
+struct CompressedColumns
+{
+    const int64_t* blocks = NULL;
+    const uint32_t* offsets = NULL;
 
-  srand(time(NULL) + 1000 * getpid()); // Initialize random seed.
+    bool enabled() const { return this->blocks != NULL; }
 
-  // open file
-  int col_fd = open(col_file.c_str(), O_RDONLY | O_DIRECT);
+    int64_t row_begin(int64_t n) const {
+        return this->blocks[n / COMPRESSED_BLOCK_ROWS] + this->offsets[n];
+    }
+};
 
-  // prepare buffer
-  int64_t neighbor_buffer_size = 1<<15;
-  int64_t* neighbor_buffer = (int64_t*)malloc(neighbor_buffer_size*sizeof(int64_t) + 2*ALIGNMENT);
-  int64_t* aligned_neighbor_buffer = (int64_t*)(((long)neighbor_buffer+(long)ALIGNMENT)&(long)~(ALIGNMENT-1));
+// Encode a row into out, which holds at least 10 bytes per neighbor. Return the
+// number of bytes written.
+int64_t encode_varint_row(const int64_t* neighbors, int64_t count, uint8_t* out){
+    uint8_t* start = out;
+    int64_t prev = 0;
+    for (int64_t k = 0; k < count; k++) {
+        int64_t delta = neighbors[k] - prev;
+        uint64_t v = (static_cast<uint64_t>(delta) << 1) ^ static_cast<uint64_t>(delta >> 63);
+        while (v >= 0x80) {
+            *out++ = static_cast<uint8_t>(v | 0x80);
+            v >>= 7;
+        }
+        *out++ = static_cast<uint8_t>(v);
+        prev = neighbors[k];
+    }
+    return out - start;
+}
 
-  auto rowptr_data = rowptr.data_ptr<int64_t>();
-  auto idx_data = idx.data_ptr<int64_t>();
-  auto cache_data = cache.data_ptr<int64_t>();
-  auto cache_table_data = cache_table.data_ptr<int64_t>();
+void decode_varint_row(const uint8_t* in, int64_t count, int64_t* neighbors){
+    int64_t prev = 0;
+    for (int64_t k = 0; k < count; k++) {
+        uint64_t v = *in++;
+        if (v >= 0x80) {
+            v &= 0x7f;
+            int shift = 7;
+            uint8_t b;
+            do {
+                b = *in++;
+                v |= static_cast<uint64_t>(b & 0x7f) << shift;
+                shift += 7;
+            } while (b & 0x80);
+        }
+        prev += static_cast<int64_t>(v >> 1) ^ -static_cast<int64_t>(v & 1);
+        neighbors[k] = prev;
+    }
+}
 
-  auto out_rowptr = torch::empty(idx.numel() + 1, idx.options());
-  auto out_rowptr_data = out_rowptr.data_ptr<int64_t>();
-  out_rowptr_data[0] = 0;
+// Counters of the reads issued for rows missing from the neighbor cache
+struct IoStats
+{
+    std::atomic<int64_t> rows{0};
+    std::atomic<int64_t> bytes_requested{0};
+    std::atomic<int64_t> reads{0};
+    std::atomic<int64_t> bytes_read{0};
+};
 
-  std::vector<std::vector<std::tuple<int64_t, int64_t>>> cols; // col, e_id
-  std::vector<int64_t> n_ids;
-  std::unordered_map<int64_t, int64_t> n_id_map;
-
-  int64_t i;
-  for (int64_t n = 0; n < idx.numel(); n++) {
-    i = idx_data[n];
-    cols.push_back(std::vector<std::tuple<int64_t, int64_t>>());
-    n_id_map[i] = n;
-    n_ids.push_back(i);
-  }
+// How read_rows merges rows into reads. A read spans at most max_read bytes and
+// skips over at most max_gap bytes of rows it was not asked for. depth limits
+// the reads in flight, 0 for the io_depth of the reader.
+struct ReadOptions
+{
+    int64_t max_read;
+    int64_t max_gap;
+    int depth;
+    bool use_block_cache;
+};
 
-  int64_t n, c, e, row_start, row_end, row_count;
-  int64_t start_offset;
-  int64_t cache_entry;
+// Cache of ALIGNMENT-sized pages of the column file, shared by the reader threads
+// of a sampler. Pages are spread over up to BLOCK_CACHE_SHARDS shards by hash,
+// fewer if the budget cannot give each a frame, each with its own lock and a
+// fixed number of frames replaced by CLOCK. A page enters with its reference
+// bit clear, so pages read only once are the first to go.
+class BlockCache
+{
+public:
+    BlockCache(int64_t budget);
+    ~BlockCache();
 
-  if (num_neighbors < 0) { // Full neighbor sampling ======================================
+    // Copy page into dst and return true if it is cached
+    bool lookup(int64_t page, char* dst);
+    void insert(int64_t page, const char* src);
 
-    for (int64_t i = 0; i < idx.numel(); i++) {
-      n = idx_data[i];
-      cache_entry = cache_table_data[n];
-      if (cache_entry >= 0){
-          row_count = cache_data[cache_entry];
-          for (int64_t j = 0; j < row_count; j++){
-            e = cache_entry + 1 + j;
-            c = cache_data[e];
+    std::atomic<int64_t> hits{0};
+    std::atomic<int64_t> misses{0};
+    std::atomic<int64_t> evictions{0};
 
-            // if c does not exist in n_id_map
-            if (n_id_map.count(c) == 0) {
-              n_id_map[c] = n_ids.size();
-              n_ids.push_back(c);
+private:
+    typedef struct shard_s
+    {
+        std::mutex lock;
+        std::unordered_map<int64_t, int64_t> frames;
+        std::vector<int64_t> frame_page;
+        std::vector<uint8_t> referenced;
+        int64_t num_frames = 0;
+        int64_t used = 0;
+        int64_t hand = 0;
+        char* data = NULL;
+    } shard;
+
+    std::vector<shard> shards;
+
+    shard &get_shard(int64_t page) {
+        uint64_t h = static_cast<uint64_t>(page) * 0x9e3779b97f4a7c15ULL;
+        return this->shards[(h >> 32) % this->shards.size()];
+    }
+};
+
+
+BlockCache::BlockCache(int64_t budget)
+    : shards(std::max(std::min(budget / ALIGNMENT, (int64_t)BLOCK_CACHE_SHARDS), (int64_t)1))
+{
+    TORCH_CHECK(budget >= ALIGNMENT, "the block cache needs a budget of at least ", ALIGNMENT, " bytes, got ", budget);
+    int64_t num_frames = budget / ALIGNMENT / this->shards.size();
+    for (shard &sh : this->shards) {
+        sh.num_frames = num_frames;
+        sh.frame_page.assign(num_frames, -1);
+        sh.referenced.assign(num_frames, 0);
+        sh.frames.reserve(num_frames);
+        if (num_frames > 0)
+            sh.data = (char*)aligned_alloc(ALIGNMENT, num_frames * ALIGNMENT);
+    }
+}
+
+
+BlockCache::~BlockCache()
+{
+    for (shard &sh : this->shards)
+        free(sh.data);
+}
+
+
+bool BlockCache::lookup(int64_t page, char* dst)
+{
+    shard &sh = get_shard(page);
+    std::lock_guard<std::mutex> guard(sh.lock);
+
+    auto it = sh.frames.find(page);
+    if (it == sh.frames.end()) {
+        this->misses += 1;
+        return false;
+    }
+    memcpy(dst, sh.data + it->second * ALIGNMENT, ALIGNMENT);
+    sh.referenced[it->second] = 1;
+    this->hits += 1;
+    return true;
+}
+
+
+void BlockCache::insert(int64_t page, const char* src)
+{
+    shard &sh = get_shard(page);
+    std::lock_guard<std::mutex> guard(sh.lock);
+
+    if (sh.num_frames == 0 || sh.frames.count(page))
+        return;
+
+    int64_t frame;
+    if (sh.used < sh.num_frames) {
+        frame = sh.used++;
+    }
+    else {
+        while (sh.referenced[sh.hand]) {
+            sh.referenced[sh.hand] = 0;
+            sh.hand = (sh.hand + 1) % sh.num_frames;
+        }
+        frame = sh.hand;
+        sh.hand = (sh.hand + 1) % sh.num_frames;
+        sh.frames.erase(sh.frame_page[frame]);
+        this->evictions += 1;
+    }
+
+    memcpy(sh.data + frame * ALIGNMENT, src, ALIGNMENT);
+    sh.frame_page[frame] = page;
+    sh.referenced[frame] = 0;
+    sh.frames[page] = frame;
+}
+
+// Reads adjacency rows of the column file with up to io_depth io_uring reads in
+// flight. Every in-flight read owns a slot whose aligned buffer grows to the
+// largest read it has served. Falls back to blocking pread without io_uring.
+// A failed or short read raises an error once the reads in flight are done.
+// Rows of a compressed column file are decoded before on_row. With a block cache,
+// rows whose pages are all cached are served from it and pages read from the
+// file are added to it.
+class NeighborReader
+{
+public:
+    NeighborReader(int col_fd, int io_depth, CompressedColumns columns = CompressedColumns(),
+                   BlockCache* block_cache = NULL);
+    ~NeighborReader();
+
+    // Call on_row(k, neighbors) for rows[k] as soon as its read completes. Rows
+    // should be sorted by file offset: consecutive rows whose pages overlap or
+    // lie within max_gap bytes share one read.
+    template <typename F>
+    void read_rows(const int64_t* rowptr, const std::vector<int64_t> &rows,
+                   ReadOptions options, IoStats &stats, F on_row);
+
+private:
+    typedef struct read_slot_s
+    {
+        int64_t* buffer;
+        int64_t* aligned_buffer;
+        int64_t buffer_size;
+        int64_t e;
+    } read_slot;
+
+    // rows [first, last) within [aligned_offset, aligned_offset + size) of the file.
+    // The rows end at end, and the last page may run past the end of the file.
+    typedef struct read_extent_s
+    {
+        int64_t first;
+        int64_t last;
+        int64_t aligned_offset;
+        int64_t size;
+        int64_t end;
+    } read_extent;
+
+    int col_fd;
+    int io_depth;
+    CompressedColumns columns;
+    BlockCache* block_cache;
+    bool use_ring = false;
+    io_uring ring;
+    std::vector<read_slot> slots;
+    std::vector<int64_t> decoded;
+    std::vector<int64_t> cached_pages;
+
+    // Serve row n from the block cache, return false if a page is missing
+    template <typename F>
+    bool read_cached_row(const int64_t* rowptr, int64_t n, int64_t k, F &on_row) {
+        int64_t begin, end;
+        get_row_bytes(rowptr, n, &begin, &end);
+        int64_t first_page = begin / ALIGNMENT;
+        int64_t num_pages = (end + ALIGNMENT - 1) / ALIGNMENT - first_page;
+
+        this->cached_pages.resize(num_pages * ALIGNMENT / sizeof(int64_t));
+        char* data = (char*)this->cached_pages.data();
+        for (int64_t p = 0; p < num_pages; p++) {
+            if (!this->block_cache->lookup(first_page + p, data + p * ALIGNMENT))
+                return false;
+        }
+        on_row(k, get_row(data + (begin - first_page * ALIGNMENT), rowptr, n));
+        return true;
+    }
+
+    void prepare_slot(read_slot &slot, int64_t size) {
+        int64_t count = size/sizeof(int64_t);
+        if (count > slot.buffer_size) {
+            free(slot.buffer);
+            std::tie(slot.buffer, slot.aligned_buffer, slot.buffer_size) = get_new_neighbor_buffer(std::max(count, (int64_t)ALIGNMENT/8));
+        }
+    }
+
+    // byte range [begin, end) of row n in the column file
+    void get_row_bytes(const int64_t* rowptr, int64_t n, int64_t* begin, int64_t* end) const {
+        if (this->columns.enabled()) {
+            *begin = this->columns.row_begin(n);
+            *end = this->columns.row_begin(n + 1);
+        }
+        else {
+            *begin = rowptr[n]*sizeof(int64_t);
+            *end = rowptr[n + 1]*sizeof(int64_t);
+        }
+    }
+
+    // neighbors of row n stored at data
+    const int64_t* get_row(const char* data, const int64_t* rowptr, int64_t n) {
+        if (!this->columns.enabled())
+            return (const int64_t*)data;
+
+        this->decoded.resize(rowptr[n + 1] - rowptr[n]);
+        decode_varint_row((const uint8_t*)data, this->decoded.size(), this->decoded.data());
+        return this->decoded.data();
+    }
+
+    // A read of extent that returns fewer bytes misses some of its rows
+    static int64_t needed_bytes(const read_extent &extent) {
+        return extent.end - extent.aligned_offset;
+    }
+
+    // Call on_extent(extent, data) with the aligned data of each extent
+    template <typename F>
+    void read_extents(const std::vector<read_extent> &extents, int depth, F on_extent);
+};
+
+
+NeighborReader::NeighborReader(int col_fd, int io_depth, CompressedColumns columns, BlockCache* block_cache)
+    : col_fd(col_fd), io_depth(std::max(io_depth, 1)), columns(columns), block_cache(block_cache)
+{
+    int ret = io_uring_queue_init(this->io_depth, &this->ring, 0);
+    if (ret)
+    {
+        fprintf(stderr, "Unable to setup io_uring, fall back to pread: %s\n", strerror(-ret));
+        this->io_depth = 1;
+    }
+    else
+    {
+        this->use_ring = true;
+    }
+
+    this->slots.assign(this->io_depth, read_slot{NULL, NULL, 0, 0});
+}
+
+
+NeighborReader::~NeighborReader()
+{
+    if (this->use_ring)
+        io_uring_queue_exit(&this->ring);
+    for (read_slot &slot : this->slots)
+        free(slot.buffer);
+}
+
+
+template <typename F>
+void NeighborReader::read_rows(const int64_t* rowptr, const std::vector<int64_t> &rows,
+                               ReadOptions options, IoStats &stats, F on_row)
+{
+    BlockCache* block_cache = options.use_block_cache ? this->block_cache : NULL;
+    int64_t bytes_requested = 0;
+    int64_t bytes_read = 0;
+
+    // Rows not in the block cache, in order
+    std::vector<int64_t> row_k;
+    for (int64_t k = 0; k < (int64_t)rows.size(); k++) {
+        if (!block_cache || !read_cached_row(rowptr, rows[k], k, on_row))
+            row_k.push_back(k);
+    }
+    int64_t num_rows = row_k.size();
+
+    // Merge the page ranges of consecutive rows into extents
+    std::vector<read_extent> extents;
+    for (int64_t j = 0; j < num_rows; j++) {
+        int64_t begin, end;
+        get_row_bytes(rowptr, rows[row_k[j]], &begin, &end);
+        int64_t aligned_begin = begin&(long)~(ALIGNMENT-1);
+        int64_t aligned_end = (end + ALIGNMENT - 1)&(long)~(ALIGNMENT-1);
+        bytes_requested += end - begin;
+
+        if (!extents.empty()) {
+            read_extent &extent = extents.back();
+            int64_t extent_end = extent.aligned_offset + extent.size;
+            if (aligned_begin >= extent.aligned_offset && aligned_begin <= extent_end + options.max_gap &&
+                (aligned_end <= extent_end || aligned_end - extent.aligned_offset <= options.max_read)) {
+                extent.last = j + 1;
+                extent.size = std::max(extent_end, aligned_end) - extent.aligned_offset;
+                extent.end = std::max(extent.end, end);
+                continue;
             }
-            cols[i].push_back(std::make_tuple(n_id_map[c], rowptr_data[n] + j));
-          }
-      }
-      else {
-          row_start = rowptr_data[n], row_end = rowptr_data[n + 1];
-          row_count = row_end - row_start;
+        }
+        extents.push_back(read_extent{j, j + 1, aligned_begin, aligned_end - aligned_begin, end});
+    }
+    for (const read_extent &extent : extents)
+        bytes_read += extent.size;
 
-          if (row_count > neighbor_buffer_size){
-              free(neighbor_buffer);
-              std::tie(neighbor_buffer, aligned_neighbor_buffer, neighbor_buffer_size) = get_new_neighbor_buffer(row_count);
-          }
+    stats.rows += num_rows;
+    stats.bytes_requested += bytes_requested;
+    stats.reads += extents.size();
+    stats.bytes_read += bytes_read;
 
-          start_offset = load_neighbors_into_buffer(col_fd,  row_start, row_count, aligned_neighbor_buffer);
-          for (int64_t j = 0; j < row_count; j++) {
-            e = start_offset + j;
-            c = aligned_neighbor_buffer[e];
+    read_extents(extents, options.depth, [&](const read_extent &extent, const char* data) {
+        for (int64_t j = extent.first; j < extent.last; j++) {
+            int64_t k = row_k[j];
+            int64_t begin, end;
+            get_row_bytes(rowptr, rows[k], &begin, &end);
+            if (block_cache) {
+                int64_t first_page = begin / ALIGNMENT;
+                int64_t last_page = (end + ALIGNMENT - 1) / ALIGNMENT;
+                for (int64_t p = first_page; p < last_page; p++)
+                    block_cache->insert(p, data + (p * ALIGNMENT - extent.aligned_offset));
+            }
+            on_row(k, get_row(data + (begin - extent.aligned_offset), rowptr, rows[k]));
+        }
+    });
+}
 
-            // if c does not exist in n_id_map
-            if (n_id_map.count(c) == 0) {
-              n_id_map[c] = n_ids.size();
-              n_ids.push_back(c);
+
+template <typename F>
+void NeighborReader::read_extents(const std::vector<read_extent> &extents, int depth, F on_extent)
+{
+    int64_t num_extents = extents.size();
+    depth = depth > 0 ? std::min(depth, this->io_depth) : this->io_depth;
+
+    if (!this->use_ring) {
+        read_slot &slot = this->slots[0];
+        for (int64_t e = 0; e < num_extents; e++) {
+            prepare_slot(slot, extents[e].size);
+            ssize_t ret = pread(this->col_fd, slot.aligned_buffer, extents[e].size, extents[e].aligned_offset);
+            TORCH_CHECK(ret >= 0, "neighbor read at ", extents[e].aligned_offset, " failed: ", strerror(errno));
+            TORCH_CHECK(ret >= needed_bytes(extents[e]), "short neighbor read at ", extents[e].aligned_offset,
+                        ": ", ret, " of ", needed_bytes(extents[e]), " bytes");
+            on_extent(extents[e], (const char*)slot.aligned_buffer);
+        }
+        return;
+    }
+
+    std::vector<int> free_slots;
+    for (int s = depth - 1; s >= 0; s--)
+        free_slots.push_back(s);
+
+    // After an error no more reads are submitted, but the ones in flight are
+    // waited for, as they write into the slots
+    std::string error;
+    int64_t submitted = 0;
+    int64_t finished = 0;
+    while (finished < submitted || (submitted < num_extents && error.empty())) {
+        // Keep the ring full
+        int queued = 0;
+        while (submitted < num_extents && error.empty() && !free_slots.empty()) {
+            io_uring_sqe *sqe = io_uring_get_sqe(&this->ring);
+            if (!sqe)
+                break;
+
+            int s = free_slots.back();
+            free_slots.pop_back();
+            read_slot &slot = this->slots[s];
+
+            const read_extent &extent = extents[submitted];
+            prepare_slot(slot, extent.size);
+            slot.e = submitted;
+
+            io_uring_prep_read(sqe, this->col_fd, slot.aligned_buffer, extent.size, extent.aligned_offset);
+            sqe->user_data = static_cast<uint64_t>(s);
+            submitted += 1;
+            queued += 1;
+        }
+        if (queued > 0)
+            io_uring_submit(&this->ring);
+
+        // Sample rows in completion order
+        io_uring_cqe *cqe;
+        int ret = io_uring_wait_cqe(&this->ring, &cqe);
+        if (ret < 0)
+        {
+            if (ret == -EINTR)
+                continue;
+            // The reads in flight can no longer be waited for, so their slots
+            // give up their buffers rather than have the next call reuse them
+            for (int s = 0; s < depth; s++) {
+                if (std::find(free_slots.begin(), free_slots.end(), s) == free_slots.end())
+                    this->slots[s] = read_slot{NULL, NULL, 0, 0};
             }
-            cols[i].push_back(std::make_tuple(n_id_map[c], row_start + j));
-          }
-      }
-      out_rowptr_data[i + 1] = out_rowptr_data[i] + cols[i].size();
+            TORCH_CHECK(false, "waiting for neighbor reads failed: ", strerror(-ret));
+        }
+        do {
+            int s = static_cast<int>(cqe->user_data);
+            int res = cqe->res;
+            io_uring_cqe_seen(&this->ring, cqe);
+
+            read_slot &slot = this->slots[s];
+            const read_extent &extent = extents[slot.e];
+            if (error.empty()) {
+                if (res < 0)
+                    error = "neighbor read at " + std::to_string(extent.aligned_offset) + " failed: " + strerror(-res);
+                else if (res < needed_bytes(extent))
+                    error = "short neighbor read at " + std::to_string(extent.aligned_offset) + ": " +
+                            std::to_string(res) + " of " + std::to_string(needed_bytes(extent)) + " bytes";
+                else
+                    on_extent(extent, (const char*)slot.aligned_buffer);
+            }
+            free_slots.push_back(s);
+            finished += 1;
+        } while (io_uring_peek_cqe(&this->ring, &cqe) == 0);
     }
+    TORCH_CHECK(error.empty(), error);
+}
+
+
+// Linear-probing hash table from global to local node IDs. It is kept across
+// calls and clear() only resets the slots filled since the last clear, so the
+// cost of a reset is proportional to the previous batch, not the table size.
+class RemapTable
+{
+public:
+    RemapTable() { rehash(1<<12); }
+
+    int64_t size() const { return this->touched.size(); }
+
+    void clear() {
+        for (const int64_t &s : this->touched)
+            this->slots[s].key = -1;
+        this->touched.clear();
+    }
+
+    // Return the local ID of key, or -1 if it is absent.
+    int64_t find(int64_t key) const {
+        for (uint64_t s = hash(key) & this->mask; ; s = (s + 1) & this->mask) {
+            if (this->slots[s].key == key)
+                return this->slots[s].value;
+            if (this->slots[s].key < 0)
+                return -1;
+        }
+    }
+
+    // Map key to value unless it is present. Return the local ID of key and
+    // whether it was inserted.
+    std::pair<int64_t, bool> insert(int64_t key, int64_t value) {
+        if (2 * (this->size() + 1) > (int64_t)this->slots.size())
+            rehash(2 * this->slots.size());
+
+        uint64_t s = hash(key) & this->mask;
+        for (; this->slots[s].key >= 0; s = (s + 1) & this->mask) {
+            if (this->slots[s].key == key)
+                return std::make_pair(this->slots[s].value, false);
+        }
+        this->slots[s].key = key;
+        this->slots[s].value = value;
+        this->touched.push_back(s);
+        return std::make_pair(value, true);
+    }
+
+    // Map key to value, overwriting an existing entry.
+    void assign(int64_t key, int64_t value) {
+        std::pair<int64_t, bool> ret = insert(key, value);
+        if (!ret.second)
+            this->slots[locate(key)].value = value;
+    }
+
+    // Overwrite the value of key, which must be present. No slot moves, so
+    // threads may update different keys at the same time.
+    void update(int64_t key, int64_t value) {
+        this->slots[locate(key)].value = value;
+    }
+
+private:
+    typedef struct remap_slot_s
+    {
+        int64_t key;
+        int64_t value;
+    } remap_slot;
+
+    std::vector<remap_slot> slots;
+    std::vector<int64_t> touched;
+    uint64_t mask;
+
+    static uint64_t hash(int64_t key) {
+        uint64_t x = static_cast<uint64_t>(key);
+        x ^= x >> 33;
+        x *= 0xff51afd7ed558ccdULL;
+        x ^= x >> 33;
+        return x;
+    }
+
+    uint64_t locate(int64_t key) const {
+        uint64_t s = hash(key) & this->mask;
+        while (this->slots[s].key != key)
+            s = (s + 1) & this->mask;
+        return s;
+    }
+
+    void rehash(int64_t capacity) {
+        std::vector<remap_slot> old_slots;
+        old_slots.swap(this->slots);
+        std::vector<int64_t> old_touched;
+        old_touched.swap(this->touched);
+
+        this->slots.assign(capacity, remap_slot{-1, 0});
+        this->mask = capacity - 1;
+        for (const int64_t &s : old_touched)
+            insert(old_slots[s].key, old_slots[s].value);
+    }
+};
+
+
+// RemapTable split into shards by key, so that each thread can insert into a
+// shard of its own while the others are read
+class ShardedRemapTable
+{
+public:
+    void init(int num_shards) { this->shards.resize(num_shards); }
+
+    int num_shards() const { return this->shards.size(); }
+
+    int shard_of(int64_t key) const {
+        uint64_t h = static_cast<uint64_t>(key) * 0x9e3779b97f4a7c15ULL;
+        return (h >> 32) % this->shards.size();
+    }
+
+    RemapTable &shard(int s) { return this->shards[s]; }
+
+    void clear() {
+        for (RemapTable &table : this->shards)
+            table.clear();
+    }
+
+    int64_t find(int64_t key) const { return this->shards[shard_of(key)].find(key); }
+
+    void assign(int64_t key, int64_t value) { this->shards[shard_of(key)].assign(key, value); }
+
+    void update(int64_t key, int64_t value) { this->shards[shard_of(key)].update(key, value); }
+
+private:
+    std::vector<RemapTable> shards;
+};
+
+
+int ginex_num_threads(){
+    char* env = getenv("GINEX_NUM_THREADS");
+    return env ? atoi(env) : omp_get_max_threads();
+}
+
+// xoshiro256** generator whose state is expanded with splitmix64 from a
+// (seed, stream) pair. Each sampled row gets its own stream, so a batch draws the
+// same neighbors for a given seed regardless of the thread that samples a row or
+// the order in which reads complete. A row's stream is hash(key, row) with key a
+// hash of every node of its hop's frontier.
+class SampleRng
+{
+public:
+    SampleRng(uint64_t seed, uint64_t stream) {
+        uint64_t x = seed ^ (stream * 0xd1342543de82ef95ULL);
+        for (int k = 0; k < 4; k++)
+            this->s[k] = splitmix64(x);
+    }
+
+    uint64_t next() {
+        uint64_t result = rotl(this->s[1] * 5, 7) * 9;
+        uint64_t t = this->s[1] << 17;
+        this->s[2] ^= this->s[0];
+        this->s[3] ^= this->s[1];
+        this->s[1] ^= this->s[2];
+        this->s[0] ^= this->s[3];
+        this->s[2] ^= t;
+        this->s[3] = rotl(this->s[3], 45);
+        return result;
+    }
+
+    // Uniform draw from [0, range) by Lemire's multiply-and-reject method.
+    int64_t bounded(int64_t range) {
+        uint64_t r = static_cast<uint64_t>(range);
+        __uint128_t m = static_cast<__uint128_t>(next()) * r;
+        uint64_t low = static_cast<uint64_t>(m);
+        if (low < r) {
+            uint64_t threshold = -r % r;
+            while (low < threshold) {
+                m = static_cast<__uint128_t>(next()) * r;
+                low = static_cast<uint64_t>(m);
+            }
+        }
+        return static_cast<int64_t>(m >> 64);
+    }
+
+    static uint64_t splitmix64(uint64_t &x) {
+        uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        return z ^ (z >> 31);
+    }
+
+    // 64-bit hash of the pair (a, b)
+    static uint64_t hash(uint64_t a, uint64_t b) {
+        uint64_t x = a;
+        x = splitmix64(x) ^ b;
+        return splitmix64(x);
+    }
+
+private:
+    uint64_t s[4];
+
+    static uint64_t rotl(uint64_t x, int k) {
+        return (x << k) | (x >> (64 - k));
+    }
+};
+
+// Seed used when the caller does not pass one
+uint64_t get_random_seed(){
+    static std::atomic<uint64_t> counter(0);
+    uint64_t x = (static_cast<uint64_t>(time(NULL)) << 20) ^ (static_cast<uint64_t>(getpid()) << 40)
+                 ^ counter.fetch_add(1);
+    return SampleRng::splitmix64(x);
+}
+
+// Number of neighbors sample_row draws from a row of row_count neighbors
+inline int64_t sampled_row_count(int64_t row_count, int64_t num_neighbors, bool replace) {
+  if (row_count <= 0)
+    return 0;
+  if (num_neighbors < 0 || (!replace && row_count <= num_neighbors))
+    return row_count;
+  return num_neighbors;
+}
+
+// Sample one row whose neighbors are already in memory, as int64 or uint32 IDs.
+// The sampled_row_count(...) sampled neighbors are written to out_col as global
+// node IDs, and their edge IDs to out_e_id unless it is NULL.
+template <typename T>
+void sample_row(const T* neighbors, int64_t row_start, int64_t row_count,
+                int64_t num_neighbors, bool replace, SampleRng &rng,
+                int64_t* out_col, int64_t* out_e_id){
+
+  int64_t e = 0;
+  auto emit = [&](int64_t p) {
+    out_col[e] = neighbors[p];
+    if (out_e_id)
+      out_e_id[e] = row_start + p;
+    e++;
+  };
+
+  if (row_count <= 0)
+    return;
+
+  if (num_neighbors < 0 || (!replace && row_count <= num_neighbors)) { // Full neighbor sampling ==========
+    for (int64_t j = 0; j < row_count; j++)
+      emit(j);
   }
- /// 
   else if (replace) { // Sample with replacement ===============================
+    for (int64_t j = 0; j < num_neighbors; j++)
+      emit(rng.bounded(row_count));
+  }
+  else if (num_neighbors <= SAMPLE_SMALL_FANOUT) { // Robert Floyd algorithm on a stack array ===
+    int64_t perm[SAMPLE_SMALL_FANOUT];
+    int64_t num_perm = 0;
+    for (int64_t j = row_count - num_neighbors; j < row_count; j++) {
+      int64_t p = rng.bounded(j + 1);
+      for (int64_t k = 0; k < num_perm; k++) {
+        if (perm[k] == p) {
+          p = j;
+          break;
+        }
+      }
+      perm[num_perm++] = p;
+    }
 
-    for (int64_t i = 0; i < idx.numel(); i++) {
-      n = idx_data[i];
-      cache_entry = cache_table_data[n];
-      if (cache_entry >= 0){
-          row_count = cache_data[cache_entry];
-          for (int64_t j = 0; j < num_neighbors; j++){
-            e = cache_entry + 1 + rand() % row_count;
-            c = cache_data[e];
+    for (int64_t k = 0; k < num_perm; k++)
+      emit(perm[k]);
+  }
+  else { // Sample without replacement via Robert Floyd algorithm ============
+    std::unordered_set<int64_t> perm;
+    for (int64_t j = row_count - num_neighbors; j < row_count; j++) {
+      if (!perm.insert(rng.bounded(j + 1)).second)
+        perm.insert(j);
+    }
 
-            // if c does not exist in n_id_map
-            if (n_id_map.count(c) == 0) {
-              n_id_map[c] = n_ids.size();
-              n_ids.push_back(c);
-            }
-            cols[i].push_back(std::make_tuple(n_id_map[c], rowptr_data[n] + j));
-          }
+    for (const int64_t &p : perm)
+      emit(p);
+  }
+}
+
+// Sort a sampled row by col, moving e_id along if it is not NULL. Fanout-sized
+// rows use an insertion sort, which keeps equal cols in sampling order. Longer
+// rows are sorted as (col, e_id) pairs in scratch, which is reused across rows.
+inline void sort_row(int64_t* col, int64_t* e_id, int64_t count,
+                     std::vector<std::pair<int64_t, int64_t>> &scratch) {
+  if (count <= SAMPLE_INSERTION_SORT) {
+    for (int64_t j = 1; j < count; j++) {
+      int64_t c = col[j];
+      int64_t e = e_id ? e_id[j] : 0;
+      int64_t k = j - 1;
+      for (; k >= 0 && col[k] > c; k--) {
+        col[k + 1] = col[k];
+        if (e_id)
+          e_id[k + 1] = e_id[k];
       }
-      else {
-          row_start = rowptr_data[n], row_end = rowptr_data[n + 1];
-          row_count = row_end - row_start;
-
-          if (row_count > neighbor_buffer_size){
-              free(neighbor_buffer);
-              std::tie(neighbor_buffer, aligned_neighbor_buffer, neighbor_buffer_size) = get_new_neighbor_buffer(row_count);
-          }
-          if (row_count > 0) {
-            start_offset = load_neighbors_into_buffer(col_fd,  row_start, row_count, aligned_neighbor_buffer);
-            for (int64_t j = 0; j < num_neighbors; j++) {
-              e = start_offset + rand() % row_count;
-              c = aligned_neighbor_buffer[e];
-
-              if (n_id_map.count(c) == 0) {
-                n_id_map[c] = n_ids.size();
-                n_ids.push_back(c);
-              }
-              cols[i].push_back(std::make_tuple(n_id_map[c], row_start + j));
-            }
-          }
+      col[k + 1] = c;
+      if (e_id)
+        e_id[k + 1] = e;
+    }
+  }
+  else if (!e_id) {
+    std::sort(col, col + count);
+  }
+  else {
+    scratch.resize(count);
+    for (int64_t j = 0; j < count; j++)
+      scratch[j] = std::make_pair(col[j], e_id[j]);
+    std::sort(scratch.begin(), scratch.end());
+    for (int64_t j = 0; j < count; j++) {
+      col[j] = scratch[j].first;
+      e_id[j] = scratch[j].second;
+    }
+  }
+}
+
+// One sampled layer: rowptr, col, e_id (empty if not requested) and the number of
+// nodes after the hop
+typedef std::tuple<torch::Tensor, torch::Tensor, torch::Tensor, int64_t> SampledLayer;
+
+// Neighbor cache of full rows, stored in node ID order. Row n is cached if bit n
+// of bitmap is set, and then starts at offsets[k] of data, where k is the number
+// of cached rows before n. Its length is the degree of n. rank holds k for the
+// first node of each bitmap word. data holds uint32 IDs if the graph has at most
+// 2^32 nodes, and int64 IDs otherwise.
+struct NeighborCacheView
+{
+    const uint64_t* bitmap = NULL;
+    const int64_t* offsets = NULL;
+    const uint32_t* data32 = NULL;
+    const int64_t* data64 = NULL;
+    std::vector<uint32_t> rank;
+
+    void init(torch::Tensor data, torch::Tensor bitmap, torch::Tensor offsets) {
+        if (bitmap.numel() == 0)
+            return;
+        this->bitmap = (const uint64_t*)bitmap.data_ptr<int64_t>();
+        this->offsets = offsets.data_ptr<int64_t>();
+        if (data.scalar_type() == torch::kInt32)
+            this->data32 = (const uint32_t*)data.data_ptr<int32_t>();
+        else
+            this->data64 = data.data_ptr<int64_t>();
+
+        int64_t num_words = bitmap.numel();
+        this->rank.resize(num_words);
+        uint32_t count = 0;
+        for (int64_t w = 0; w < num_words; w++) {
+            this->rank[w] = count;
+            count += __builtin_popcountll(this->bitmap[w]);
+        }
+    }
+
+    // offset of row n in data, -1 if not cached
+    int64_t find(int64_t n) const {
+        if (!this->bitmap)
+            return -1;
+        uint64_t word = this->bitmap[n >> 6];
+        uint64_t bit = 1ULL << (n & 63);
+        if (!(word & bit))
+            return -1;
+        return this->offsets[this->rank[n >> 6] + __builtin_popcountll(word & (bit - 1))];
+    }
+};
+
+// State of one batch being sampled: a NeighborReader (io_uring and aligned read
+// buffers) and a first-seen table per thread, and the relabel table of the batch
+struct SampleContext
+{
+    int num_threads = 1;
+    std::vector<std::unique_ptr<NeighborReader>> readers;
+    std::vector<RemapTable> seen_tables;
+    ShardedRemapTable n_id_map;
+};
+
+// Index of a batch in the list given to sample_batches, its n_id and its layers
+typedef std::tuple<int64_t, torch::Tensor, std::vector<SampledLayer>> SampledBatch;
+
+class BatchStream;
+
+// Ginex neighbor sampler that keeps the column file open and a SampleContext
+// across calls, so a call only pays for the sampling itself. Calls on the
+// sampler are serialized, sample_batches samples batches concurrently.
+// A sampler built from an in-memory (or mmapped) col tensor reads rows directly.
+// col_blocks and col_offsets are the index of a compressed col_file. The rows a
+// hop misses in the neighbor cache are read in file order, in reads of up to
+// max_read bytes, through a block cache of block_cache_size bytes if it is not 0.
+class GinexSampler
+{
+public:
+    GinexSampler(torch::Tensor rowptr, const std::string &col_file,
+        torch::Tensor cache, torch::Tensor cache_bitmap, torch::Tensor cache_offsets,
+        int io_depth = SAMPLE_IO_DEPTH, int num_threads = -1,
+        c10::optional<torch::Tensor> col_blocks = c10::nullopt,
+        c10::optional<torch::Tensor> col_offsets = c10::nullopt,
+        int64_t max_read = SAMPLE_MAX_READ, int64_t block_cache_size = 0);
+    GinexSampler(torch::Tensor rowptr, torch::Tensor col, int num_threads = -1);
+    ~GinexSampler();
+
+    std::tuple<torch::Tensor, torch::Tensor, torch::Tensor, torch::Tensor>
+    sample_adj(torch::Tensor idx, int64_t num_neighbors, bool replace, int64_t seed = -1,
+        bool return_e_id = true);
+
+    std::tuple<torch::Tensor, std::vector<SampledLayer>>
+    sample_multi_hop(torch::Tensor idx, std::vector<int64_t> sizes, bool replace, int64_t seed = -1,
+        bool return_e_id = true);
+
+    BatchStream* sample_batches(std::vector<torch::Tensor> batches, std::vector<int64_t> sizes,
+        bool replace, int64_t seed = -1, int num_workers = -1, bool return_e_id = true);
+
+    std::tuple<int64_t, int64_t, double>
+    fill_neighbor_cache(torch::Tensor cache, torch::Tensor cached_idx,
+        torch::Tensor cache_offsets, int64_t num_entries, int64_t chunk_size = BUILD_CHUNK_SIZE);
+
+    // rows read, bytes of those rows, reads issued and bytes read
+    std::tuple<int64_t, int64_t, int64_t, int64_t> get_io_stats(bool reset);
+
+    // page hits, misses and evictions of the block cache
+    std::tuple<int64_t, int64_t, int64_t> get_block_cache_stats(bool reset);
+
+private:
+    friend class BatchStream;
+
+    torch::Tensor rowptr;
+    int64_t* rowptr_data;
+    const std::string col_file;
+    int col_fd = -1;
+    torch::Tensor col_blocks;
+    torch::Tensor col_offsets;
+    CompressedColumns columns;
+
+    // in-memory column array, NULL when rows are read from col_file
+    torch::Tensor col;
+    int64_t* col_data = NULL;
+
+    torch::Tensor cache;
+    torch::Tensor cache_bitmap;
+    torch::Tensor cache_offsets;
+    NeighborCacheView cache_view;
+
+    int io_depth = SAMPLE_IO_DEPTH;
+    int64_t max_read = SAMPLE_MAX_READ;
+    IoStats io_stats;
+    std::unique_ptr<BlockCache> block_cache;
+    SampleContext context;
+
+    std::mutex sample_mutex;
+
+    int64_t get_cache_entry(int64_t n) {
+        return this->cache_view.find(n);
+    }
+
+    void init_context(SampleContext &ctx, int num_threads);
+    void start_frontier(SampleContext &ctx, torch::Tensor idx, std::vector<int64_t> &n_ids);
+    std::tuple<torch::Tensor, torch::Tensor, torch::Tensor>
+    sample_hop(SampleContext &ctx, std::vector<int64_t> &n_ids, int64_t num_neighbors, bool replace,
+        uint64_t base_seed, bool return_e_id, torch::TensorOptions options);
+    std::tuple<torch::Tensor, std::vector<SampledLayer>>
+    sample_batch(SampleContext &ctx, torch::Tensor idx, const std::vector<int64_t> &sizes, bool replace,
+        int64_t seed, bool return_e_id);
+};
+
+
+// Samples a list of batches on num_workers native threads, each with its own
+// single-threaded SampleContext, and hands the batches out as they finish. Workers
+// stop taking new batches while 2 * num_workers finished ones wait to be taken.
+class BatchStream
+{
+public:
+    BatchStream(GinexSampler &sampler, std::vector<torch::Tensor> batches, std::vector<int64_t> sizes,
+        bool replace, int64_t seed, int num_workers, bool return_e_id);
+    ~BatchStream();
+
+    // Wait for the next finished batch, return false once all were handed out.
+    // An error raised by a worker is rethrown here.
+    bool next(SampledBatch &batch);
+
+    int64_t size() const {
+        return this->batches.size();
+    }
+
+private:
+    GinexSampler &sampler;
+    std::vector<torch::Tensor> batches;
+    std::vector<int64_t> sizes;
+    bool replace;
+    int64_t seed;
+    bool return_e_id;
+    int64_t max_pending;
+    std::vector<std::unique_ptr<SampleContext>> contexts;
+    std::vector<std::thread> workers;
+
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::condition_variable space;
+    std::deque<SampledBatch> finished;
+    int64_t next_batch = 0;
+    int64_t handed_out = 0;
+    bool stopping = false;
+    std::exception_ptr error;
+
+    void work(SampleContext &ctx);
+};
+
+
+GinexSampler::GinexSampler(torch::Tensor rowptr, const std::string &col_file,
+    torch::Tensor cache, torch::Tensor cache_bitmap, torch::Tensor cache_offsets, int io_depth, int num_threads,
+    c10::optional<torch::Tensor> col_blocks, c10::optional<torch::Tensor> col_offsets, int64_t max_read,
+    int64_t block_cache_size)
+    : rowptr(rowptr), col_file(col_file), cache(cache), cache_bitmap(cache_bitmap), cache_offsets(cache_offsets),
+      io_depth(io_depth), max_read(max_read)
+{
+    this->rowptr_data = this->rowptr.data_ptr<int64_t>();
+    this->cache_view.init(this->cache, this->cache_bitmap, this->cache_offsets);
+
+    if (col_blocks.has_value() && col_offsets.has_value()) {
+        int64_t num_nodes = this->rowptr.numel() - 1;
+        TORCH_CHECK(col_blocks->numel() == num_nodes / COMPRESSED_BLOCK_ROWS + 1 &&
+                    col_offsets->numel() == num_nodes + 1,
+                    "col_blocks and col_offsets do not match rowptr");
+        this->col_blocks = *col_blocks;
+        this->col_offsets = *col_offsets;
+        this->columns.blocks = this->col_blocks.data_ptr<int64_t>();
+        this->columns.offsets = (const uint32_t*)this->col_offsets.data_ptr<int32_t>();
+    }
+
+    this->col_fd = open(col_file.c_str(), O_RDONLY | O_DIRECT);
+    if (this->col_fd < 0)
+    {
+        fprintf(stderr, "open file %s failed %s\n", col_file.c_str(), strerror(errno));
+    }
+
+    if (block_cache_size > 0)
+        this->block_cache.reset(new BlockCache(block_cache_size));
+
+    init_context(this->context, num_threads > 0 ? num_threads : ginex_num_threads());
+}
+
+
+GinexSampler::GinexSampler(torch::Tensor rowptr, torch::Tensor col, int num_threads)
+    : rowptr(rowptr), col(col)
+{
+    this->rowptr_data = this->rowptr.data_ptr<int64_t>();
+    this->col_data = this->col.data_ptr<int64_t>();
+
+    init_context(this->context, num_threads > 0 ? num_threads : ginex_num_threads());
+}
+
+
+GinexSampler::~GinexSampler()
+{
+    this->context.readers.clear();
+    if (this->col_fd >= 0)
+        close(this->col_fd);
+}
+
+
+// Give ctx num_threads threads, with a reader each unless rows are in memory
+void GinexSampler::init_context(SampleContext &ctx, int num_threads) {
+    ctx.num_threads = num_threads;
+    if (!this->col_data) {
+        for (int t = 0; t < num_threads; t++)
+            ctx.readers.emplace_back(new NeighborReader(this->col_fd, this->io_depth, this->columns, this->block_cache.get()));
+    }
+    ctx.seen_tables.resize(num_threads);
+    ctx.n_id_map.init(num_threads);
+}
+
+
+// Reset the relabel state of ctx and make idx the first n_ids
+void GinexSampler::start_frontier(SampleContext &ctx, torch::Tensor idx, std::vector<int64_t> &n_ids) {
+  auto idx_data = idx.data_ptr<int64_t>();
+  int64_t num_idx = idx.numel();
+
+  ctx.n_id_map.clear();
+  n_ids.reserve(num_idx);
+  for (int64_t n = 0; n < num_idx; n++) {
+    ctx.n_id_map.assign(idx_data[n], n);
+    n_ids.push_back(idx_data[n]);
+  }
+}
+
+
+// Sample the rows n_ids holds on entry, whose local IDs n_id_map already maps,
+// and append the new nodes to both. The output size of every row follows from its
+// degree, so out_rowptr is computed first and rows are sampled straight into
+// out_col and out_e_id. Rows are split into one contiguous chunk per thread, and
+// each thread samples the cached rows of its chunk right away. The missing rows
+// of all chunks are then sorted by file offset and split again into one
+// contiguous file range per thread, which is read with coalesced io_uring reads,
+// sampling each row as its read completes. The neighbors seen for the first time
+// are collected per chunk in row order and merged in thread order, so n_id lists
+// new nodes in the same first-appearance order as a serial pass.
+std::tuple<torch::Tensor, torch::Tensor, torch::Tensor>
+GinexSampler::sample_hop(SampleContext &ctx, std::vector<int64_t> &n_ids, int64_t num_neighbors, bool replace,
+    uint64_t base_seed, bool return_e_id, torch::TensorOptions options) {
+
+  // n_ids only grows in the merge below, after the last use of idx_data
+  auto rowptr_data = this->rowptr_data;
+  auto idx_data = n_ids.data();
+  int64_t num_idx = n_ids.size();
+  // Row i of the frontier draws from stream hash(batch_key, i) of the seed, where
+  // batch_key hashes every node of the frontier with its position
+  uint64_t batch_key = SampleRng::hash(0, num_idx);
+  #pragma omp parallel for num_threads(ctx.num_threads) reduction(+:batch_key)
+  for (int64_t i = 0; i < num_idx; i++)
+    batch_key += SampleRng::hash(i, idx_data[i]);
+
+  // Count ==========================================================================
+  auto out_rowptr = torch::empty(num_idx + 1, options);
+  auto out_rowptr_data = out_rowptr.data_ptr<int64_t>();
+  out_rowptr_data[0] = 0;
+  for (int64_t i = 0; i < num_idx; i++) {
+    int64_t n = idx_data[i];
+    out_rowptr_data[i + 1] = out_rowptr_data[i] +
+        sampled_row_count(rowptr_data[n + 1] - rowptr_data[n], num_neighbors, replace);
+  }
+
+  int64_t E = out_rowptr_data[num_idx];
+  auto out_col = torch::empty(E, options);
+  auto out_col_data = out_col.data_ptr<int64_t>();
+  auto out_e_id = torch::empty(return_e_id ? E : 0, options);
+  auto out_e_id_data = return_e_id ? out_e_id.data_ptr<int64_t>() : NULL;
+
+  auto sample_into = [&](auto neighbors, int64_t i, int64_t n) {
+    SampleRng rng(base_seed, SampleRng::hash(batch_key, i));
+    int64_t e = out_rowptr_data[i];
+    sample_row(neighbors, rowptr_data[n], rowptr_data[n + 1] - rowptr_data[n], num_neighbors, replace, rng,
+               out_col_data + e, out_e_id_data ? out_e_id_data + e : NULL);
+  };
+
+  ShardedRemapTable &n_id_map = ctx.n_id_map;
+
+  // Per-thread sampling ==========================================================
+  std::vector<std::vector<int64_t>> new_n_ids(ctx.num_threads);
+  std::vector<std::vector<std::pair<int64_t, int64_t>>> thread_misses(ctx.num_threads); // offset, i
+  std::vector<std::pair<int64_t, int64_t>> misses;
+  // A read error can only leave the parallel region as an exception_ptr
+  std::vector<std::exception_ptr> read_errors(ctx.num_threads);
+
+  #pragma omp parallel num_threads(ctx.num_threads)
+  {
+    int t = omp_get_thread_num();
+    int num_team = omp_get_num_threads();
+    int64_t chunk = (num_idx + num_team - 1) / num_team;
+    int64_t begin = std::min(num_idx, chunk * t);
+    int64_t end = std::min(num_idx, begin + chunk);
+
+    // Cached and in-memory rows are sampled right away, missing rows are batched
+    for (int64_t i = begin; i < end; i++) {
+      int64_t n = idx_data[i];
+      int64_t cache_entry = get_cache_entry(n);
+
+      if (cache_entry >= 0) {
+        if (this->cache_view.data32)
+          sample_into(this->cache_view.data32 + cache_entry, i, n);
+        else
+          sample_into(this->cache_view.data64 + cache_entry, i, n);
       }
-      out_rowptr_data[i + 1] = out_rowptr_data[i] + cols[i].size();
-    }
-
-  } else { // Sample without replacement via Robert Floyd algorithm ============
-
-    for (int64_t i = 0; i < idx.numel(); i++) {
-      n = idx_data[i];
-      cache_entry = cache_table_data[n];
-      if (cache_entry >= 0){
-          row_count = cache_data[cache_entry];
-          if (row_count > 0){
-              std::unordered_set<int64_t> perm;
-              if (row_count <= num_neighbors) {
-                for (int64_t j = 0; j < row_count; j++)
-                  perm.insert(j);
-              } 
-              else {
-                for (int64_t j = row_count - num_neighbors; j < row_count; j++) {
-                  if (!perm.insert(rand() % j).second)
-                    perm.insert(j);
-                }
-              }
-
-              for (const int64_t &p : perm) {
-                e = cache_entry + 1 + p;
-                c = cache_data[e];
-
-                if (n_id_map.count(c) == 0) {
-                  n_id_map[c] = n_ids.size();
-                  n_ids.push_back(c);
-                }
-                cols[i].push_back(std::make_tuple(n_id_map[c], rowptr_data[n] + p));
-                //cols[i].push_back(std::make_tuple(n_id_map[c], e));
-              }
-          }
+      else if (this->col_data) {
+        sample_into(this->col_data + rowptr_data[n], i, n);
       }
-      else {
-          row_start = rowptr_data[n], row_end = rowptr_data[n + 1];
-          row_count = row_end - row_start;
-
-          if (row_count > neighbor_buffer_size){
-              free(neighbor_buffer);
-              std::tie(neighbor_buffer, aligned_neighbor_buffer, neighbor_buffer_size) = get_new_neighbor_buffer(row_count);
-          }
-
-          if (row_count > 0){
-              start_offset = load_neighbors_into_buffer(col_fd,  row_start, row_count, aligned_neighbor_buffer);
-
-              std::unordered_set<int64_t> perm;
-              if (row_count <= num_neighbors) {
-                for (int64_t j = 0; j < row_count; j++)
-                  perm.insert(j);
-              } 
-              else {
-                for (int64_t j = row_count - num_neighbors; j < row_count; j++) {
-                  if (!perm.insert(rand() % j).second)
-                    perm.insert(j);
-                }
-              }
-
-              for (const int64_t &p : perm) {
-                e = start_offset + p;
-                c = aligned_neighbor_buffer[e];
-
-                if (n_id_map.count(c) == 0) {
-                  n_id_map[c] = n_ids.size();
-                  n_ids.push_back(c);
-                }
-                cols[i].push_back(std::make_tuple(n_id_map[c], row_start + p));
-              }
-          }
+      else if (rowptr_data[n + 1] > rowptr_data[n]) {
+        int64_t offset = this->columns.enabled() ? this->columns.row_begin(n) : rowptr_data[n];
+        thread_misses[t].push_back(std::make_pair(offset, i));
       }
-      out_rowptr_data[i + 1] = out_rowptr_data[i] + cols[i].size();
+    }
+
+    // Sort the misses of the hop by file offset
+    #pragma omp barrier
+    #pragma omp single
+    {
+      for (std::vector<std::pair<int64_t, int64_t>> &v : thread_misses)
+        misses.insert(misses.end(), v.begin(), v.end());
+      std::sort(misses.begin(), misses.end());
+    }
+
+    // Each thread reads a contiguous range of the file
+    int64_t num_misses = misses.size();
+    int64_t miss_chunk = (num_misses + num_team - 1) / num_team;
+    int64_t miss_begin = std::min(num_misses, miss_chunk * t);
+    int64_t miss_end = std::min(num_misses, miss_begin + miss_chunk);
+
+    std::vector<int64_t> rows;
+    for (int64_t k = miss_begin; k < miss_end; k++)
+      rows.push_back(idx_data[misses[k].second]);
+
+    if (!rows.empty()) {
+      try {
+        ctx.readers[t]->read_rows(rowptr_data, rows, ReadOptions{this->max_read, 0, 0, true}, this->io_stats,
+                                  [&](int64_t k, const int64_t* neighbors) {
+          sample_into(neighbors, misses[miss_begin + k].second, rows[k]);
+        });
+      }
+      catch (...) {
+        read_errors[t] = std::current_exception();
+      }
+    }
+
+    // n_id_map is only written in the merge, so concurrent lookups are safe
+    #pragma omp barrier
+    RemapTable &seen = ctx.seen_tables[t];
+    seen.clear();
+    for (int64_t e = out_rowptr_data[begin]; e < out_rowptr_data[end]; e++) {
+      int64_t c = out_col_data[e];
+      if (n_id_map.find(c) < 0 && seen.insert(c, 0).second)
+        new_n_ids[t].push_back(c);
     }
   }
- ///
 
-  int64_t N = n_ids.size();
-  auto out_n_id = torch::from_blob(n_ids.data(), {N}, idx.options()).clone();
+  for (std::exception_ptr &error : read_errors) {
+    if (error)
+      std::rethrow_exception(error);
+  }
 
-  int64_t E = out_rowptr_data[idx.numel()];
-  auto out_col = torch::empty(E, idx.options());
-  auto out_col_data = out_col.data_ptr<int64_t>();
-  auto out_e_id = torch::empty(E, idx.options());
-  auto out_e_id_data = out_e_id.data_ptr<int64_t>();
-
-  i = 0;
-  for (std::vector<std::tuple<int64_t, int64_t>> &col_vec : cols) {
-    std::sort(col_vec.begin(), col_vec.end(),
-              [](const std::tuple<int64_t, int64_t> &a,
-                 const std::tuple<int64_t, int64_t> &b) -> bool {
-                return std::get<0>(a) < std::get<0>(b);
-              });
-    for (const std::tuple<int64_t, int64_t> &value : col_vec) {
-      out_col_data[i] = std::get<0>(value);
-      out_e_id_data[i] = std::get<1>(value);
-      i += 1;
+  // Merge in thread order to assign local IDs ===================================
+  // A node keeps the first of its appearances in thread order. The new nodes of
+  // every thread are bucketed by shard of n_id_map, and each shard inserts its
+  // buckets in thread order, so the first appearance is the one inserted. The
+  // kept nodes of each thread then get consecutive local IDs after those of the
+  // threads before it.
+  int num_shards = n_id_map.num_shards();
+  std::vector<std::vector<std::vector<int64_t>>> buckets(ctx.num_threads,
+      std::vector<std::vector<int64_t>>(num_shards)); // positions in new_n_ids[t]
+  std::vector<std::vector<uint8_t>> kept(ctx.num_threads);
+  std::vector<int64_t> first_id(ctx.num_threads + 1);
+
+  #pragma omp parallel num_threads(ctx.num_threads)
+  {
+    #pragma omp for
+    for (int t = 0; t < ctx.num_threads; t++) {
+      kept[t].assign(new_n_ids[t].size(), 0);
+      for (size_t k = 0; k < new_n_ids[t].size(); k++)
+        buckets[t][n_id_map.shard_of(new_n_ids[t][k])].push_back(k);
+    }
+
+    #pragma omp for
+    for (int s = 0; s < num_shards; s++) {
+      RemapTable &shard = n_id_map.shard(s);
+      for (int t = 0; t < ctx.num_threads; t++) {
+        for (const int64_t &k : buckets[t][s])
+          kept[t][k] = shard.insert(new_n_ids[t][k], 0).second;
+      }
+    }
+
+    #pragma omp for
+    for (int t = 0; t < ctx.num_threads; t++) {
+      size_t num_kept = 0;
+      for (size_t k = 0; k < new_n_ids[t].size(); k++) {
+        if (kept[t][k])
+          new_n_ids[t][num_kept++] = new_n_ids[t][k];
+      }
+      new_n_ids[t].resize(num_kept);
+    }
+
+    #pragma omp single
+    {
+      first_id[0] = n_ids.size();
+      for (int t = 0; t < ctx.num_threads; t++)
+        first_id[t + 1] = first_id[t] + new_n_ids[t].size();
+      n_ids.resize(first_id[ctx.num_threads]);
+    }
+
+    #pragma omp for
+    for (int t = 0; t < ctx.num_threads; t++) {
+      for (size_t k = 0; k < new_n_ids[t].size(); k++) {
+        n_ids[first_id[t] + k] = new_n_ids[t][k];
+        n_id_map.update(new_n_ids[t][k], first_id[t] + k);
+      }
     }
   }
 
-  free(neighbor_buffer);
-  close(col_fd);
+  // Relabel & sort each row in place ============================================
+  #pragma omp parallel num_threads(ctx.num_threads)
+  {
+    std::vector<std::pair<int64_t, int64_t>> scratch;
+    #pragma omp for schedule(dynamic, 64)
+    for (int64_t i = 0; i < num_idx; i++) {
+      int64_t begin = out_rowptr_data[i];
+      int64_t end = out_rowptr_data[i + 1];
+      for (int64_t e = begin; e < end; e++)
+        out_col_data[e] = n_id_map.find(out_col_data[e]);
+      sort_row(out_col_data + begin, out_e_id_data ? out_e_id_data + begin : NULL, end - begin, scratch);
+    }
+  }
 
-  return std::make_tuple(out_rowptr, out_col, out_n_id, out_e_id);
+  return std::make_tuple(out_rowptr, out_col, out_e_id);
 }
 
-torch::Tensor
-get_neighbors(torch::Tensor rowptr, std::string col_file, torch::Tensor idx) {
 
-  // open files
-  int col_fd = open(col_file.c_str(), O_RDONLY | O_DIRECT);
+std::tuple<torch::Tensor, torch::Tensor, torch::Tensor, torch::Tensor>
+GinexSampler::sample_adj(torch::Tensor idx, int64_t num_neighbors, bool replace, int64_t seed,
+    bool return_e_id) {
 
-  // prepare buffer
-  int64_t neighbor_buffer_size = 1<<15;
-  int64_t* neighbor_buffer = (int64_t*)malloc(neighbor_buffer_size*sizeof(int64_t) + 2*ALIGNMENT);
-  int64_t* aligned_neighbor_buffer = (int64_t*)(((long)neighbor_buffer+(long)ALIGNMENT)&(long)~(ALIGNMENT-1));
+  std::lock_guard<std::mutex> guard(this->sample_mutex);
 
-  auto rowptr_data = rowptr.data_ptr<int64_t>();
-  auto idx_data = idx.data_ptr<int64_t>()[0];
+  uint64_t base_seed = seed >= 0 ? static_cast<uint64_t>(seed) : get_random_seed();
 
   std::vector<int64_t> n_ids;
+  start_frontier(this->context, idx, n_ids);
+  auto out = sample_hop(this->context, n_ids, num_neighbors, replace, base_seed, return_e_id, idx.options());
+
+  int64_t N = n_ids.size();
+  auto out_n_id = torch::from_blob(n_ids.data(), {N}, idx.options()).clone();
 
-  int64_t i;
+  return std::make_tuple(std::get<0>(out), std::get<1>(out), out_n_id, std::get<2>(out));
+}
 
-  int64_t n, c, e, row_start, row_end, row_count;
-  int64_t start_offset;
 
-  row_start = rowptr_data[idx_data], row_end = rowptr_data[idx_data + 1]; 
-  row_count = row_end - row_start;
+// Sample all hops of a batch in one call. Hop h takes every node seen so far as
+// its rows, and the relabel state carries over, so only the nodes new at hop h
+// are hashed. Hop h uses seed * sizes.size() + h, the seed a per-hop sample_adj
+// loop would pass. Return n_id and one SampledLayer per hop, outermost last.
+std::tuple<torch::Tensor, std::vector<SampledLayer>>
+GinexSampler::sample_multi_hop(torch::Tensor idx, std::vector<int64_t> sizes, bool replace, int64_t seed,
+    bool return_e_id) {
 
-  if (row_count > neighbor_buffer_size){
-      free(neighbor_buffer);
-      std::tie(neighbor_buffer, aligned_neighbor_buffer, neighbor_buffer_size) = get_new_neighbor_buffer(row_count);
-  }
+  std::lock_guard<std::mutex> guard(this->sample_mutex);
+  return sample_batch(this->context, idx, sizes, replace, seed, return_e_id);
+}
+
+
+std::tuple<torch::Tensor, std::vector<SampledLayer>>
+GinexSampler::sample_batch(SampleContext &ctx, torch::Tensor idx, const std::vector<int64_t> &sizes,
+    bool replace, int64_t seed, bool return_e_id) {
+
+  uint64_t base_seed = seed >= 0 ? static_cast<uint64_t>(seed) * sizes.size() : get_random_seed();
+
+  std::vector<int64_t> n_ids;
+  start_frontier(ctx, idx, n_ids);
 
-  start_offset = load_neighbors_into_buffer(col_fd,  row_start, row_count, aligned_neighbor_buffer);
-  for (int64_t j = 0; j < row_count; j++) {
-    e = start_offset + j;
-    c = aligned_neighbor_buffer[e];
-    n_ids.push_back(c);
+  std::vector<SampledLayer> layers;
+  for (size_t hop = 0; hop < sizes.size(); hop++) {
+    auto out = sample_hop(ctx, n_ids, sizes[hop], replace, base_seed + hop, return_e_id, idx.options());
+    layers.push_back(std::make_tuple(std::get<0>(out), std::get<1>(out), std::get<2>(out),
+                                     static_cast<int64_t>(n_ids.size())));
   }
 
   int64_t N = n_ids.size();
   auto out_n_id = torch::from_blob(n_ids.data(), {N}, idx.options()).clone();
 
-  free(neighbor_buffer);
-  close(col_fd);
-  return out_n_id;
+  return std::make_tuple(out_n_id, layers);
+}
+
+
+// Sample batches[b] as sample_multi_hop would, for every b, on num_workers
+// threads (the sampler's thread count by default). With a seed, batch b uses
+// batch_seed(seed, b), so every batch has its own reproducible streams. The
+// stream keeps the sampler alive and returns the batches in the order they finish.
+// The seed of batch b of sample_batches, which is not negative unless seed is
+int64_t batch_seed(int64_t seed, int64_t b) {
+  if (seed < 0)
+    return seed;
+  return static_cast<int64_t>(SampleRng::hash(static_cast<uint64_t>(seed), static_cast<uint64_t>(b)) >> 1);
+}
+
+
+BatchStream* GinexSampler::sample_batches(std::vector<torch::Tensor> batches, std::vector<int64_t> sizes,
+    bool replace, int64_t seed, int num_workers, bool return_e_id) {
+
+  if (num_workers <= 0)
+    num_workers = this->context.num_threads;
+  return new BatchStream(*this, batches, sizes, replace, seed, num_workers, return_e_id);
+}
+
+
+BatchStream::BatchStream(GinexSampler &sampler, std::vector<torch::Tensor> batches, std::vector<int64_t> sizes,
+    bool replace, int64_t seed, int num_workers, bool return_e_id)
+    : sampler(sampler), batches(batches), sizes(sizes), replace(replace), seed(seed), return_e_id(return_e_id),
+      max_pending(2 * (int64_t)num_workers)
+{
+  num_workers = std::max(1, (int)std::min((int64_t)num_workers, this->size()));
+  for (int w = 0; w < num_workers; w++) {
+    this->contexts.emplace_back(new SampleContext());
+    this->sampler.init_context(*this->contexts.back(), 1);
+  }
+  for (int w = 0; w < num_workers; w++)
+    this->workers.emplace_back(&BatchStream::work, this, std::ref(*this->contexts[w]));
 }
 
-void fill_neighbor_cache(torch::Tensor cache, torch::Tensor rowptr, std::string col, 
-                torch::Tensor cached_idx, torch::Tensor cache_table, int64_t num_entries) {
 
+BatchStream::~BatchStream()
+{
+  {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->stopping = true;
+  }
+  this->space.notify_all();
+  for (std::thread &worker : this->workers)
+    worker.join();
+}
+
+
+void BatchStream::work(SampleContext &ctx) {
+  while (true) {
+    int64_t b;
+    {
+      std::unique_lock<std::mutex> lock(this->mutex);
+      this->space.wait(lock, [&] {
+        return this->stopping || (int64_t)this->finished.size() < this->max_pending;
+      });
+      if (this->stopping || this->next_batch == this->size())
+        return;
+      b = this->next_batch++;
+    }
+
+    try {
+      auto out = this->sampler.sample_batch(ctx, this->batches[b], this->sizes, this->replace,
+                                            batch_seed(this->seed, b), this->return_e_id);
+      std::lock_guard<std::mutex> lock(this->mutex);
+      this->finished.emplace_back(b, std::get<0>(out), std::get<1>(out));
+    }
+    catch (...) {
+      std::lock_guard<std::mutex> lock(this->mutex);
+      if (!this->error)
+        this->error = std::current_exception();
+      this->stopping = true;
+    }
+    this->ready.notify_all();
+  }
+}
+
+
+bool BatchStream::next(SampledBatch &batch) {
+  std::unique_lock<std::mutex> lock(this->mutex);
+  if (this->handed_out == this->size())
+    return false;
+  this->ready.wait(lock, [&] { return this->error || !this->finished.empty(); });
+  if (this->error)
+    std::rethrow_exception(this->error);
+
+  batch = std::move(this->finished.front());
+  this->finished.pop_front();
+  this->handed_out++;
+  lock.unlock();
+  this->space.notify_one();
+  return true;
+}
+
+
+// Fill the rows of cached_idx into cache, row cached_idx[k] at cache_offsets[k].
+// cache is int32 for uint32 neighbor IDs or int64. cached_idx must be sorted, so
+// the column file is streamed in order: rows are split into tasks of about the
+// same number of neighbors, and each task reads its range of the file in reads
+// of up to chunk_size bytes that also span the rows between cached ones.
+// Return the bytes stored, the bytes read and the time taken in seconds.
+std::tuple<int64_t, int64_t, double>
+GinexSampler::fill_neighbor_cache(torch::Tensor cache, torch::Tensor cached_idx,
+    torch::Tensor cache_offsets, int64_t num_entries, int64_t chunk_size) {
+
+    std::lock_guard<std::mutex> guard(this->sample_mutex);
+    auto start = std::chrono::steady_clock::now();
+
+    int64_t* rowptr_data = this->rowptr_data;
     int64_t* cached_idx_data = cached_idx.data_ptr<int64_t>();
-    int64_t* cache_table_data = cache_table.data_ptr<int64_t>();
-    int64_t* cache_data = cache.data_ptr<int64_t>();
+    int64_t* cache_offsets_data = cache_offsets.data_ptr<int64_t>();
+    uint32_t* cache_data32 = NULL;
+    int64_t* cache_data64 = NULL;
+    if (cache.scalar_type() == torch::kInt32)
+        cache_data32 = (uint32_t*)cache.data_ptr<int32_t>();
+    else
+        cache_data64 = cache.data_ptr<int64_t>();
 
-    #pragma omp parallel for num_threads(atoi(getenv("GINEX_NUM_THREADS")))
-    for (int64_t n=0; n<num_entries; n++){
-        int64_t idx = cached_idx_data[n];
-        auto neighbors = get_neighbors(rowptr, col, cached_idx[n]);  
-        int64_t num_neighbors = neighbors.numel();
+    auto store_row = [&](int64_t k, const int64_t* neighbors, int64_t num_neighbors) {
+        int64_t position = cache_offsets_data[k];
+        if (cache_data32) {
+            for (int64_t j = 0; j < num_neighbors; j++)
+                cache_data32[position + j] = static_cast<uint32_t>(neighbors[j]);
+        }
+        else {
+            memcpy(cache_data64+position, neighbors, num_neighbors*sizeof(int64_t));
+        }
+    };
 
-        int64_t position = cache_table_data[idx];
+    // Degree-balanced tasks ========================================================
+    int64_t num_neighbors_total = cache_offsets_data[num_entries] - cache_offsets_data[0];
+    int64_t num_tasks = std::max((int64_t)1, std::min(num_entries, (int64_t)this->context.num_threads * BUILD_TASKS_PER_THREAD));
+    std::vector<int64_t> task_begin(1, 0);
+    for (int64_t k = 0; k < num_entries && (int64_t)task_begin.size() < num_tasks; k++) {
+        if ((cache_offsets_data[k + 1] - cache_offsets_data[0]) * num_tasks >= num_neighbors_total * (int64_t)task_begin.size())
+            task_begin.push_back(k + 1);
+    }
+    task_begin.push_back(num_entries);
 
-        // cache update
-        cache_data[position] = num_neighbors;
-        memcpy(cache_data+position+1, (int64_t*)neighbors.data_ptr(), num_neighbors*sizeof(int64_t));                                                                                                   
-    }   
+    IoStats build_stats;
+    ReadOptions options{chunk_size, chunk_size, BUILD_IO_DEPTH, false};
+    std::vector<std::exception_ptr> read_errors(this->context.num_threads);
 
-    return;
+    #pragma omp parallel for num_threads(this->context.num_threads) schedule(dynamic, 1)
+    for (size_t task = 0; task < task_begin.size() - 1; task++) {
+        std::vector<int64_t> rows;
+        std::vector<int64_t> row_k;
+        for (int64_t k = task_begin[task]; k < task_begin[task + 1]; k++) {
+            int64_t idx = cached_idx_data[k];
+            int64_t num_neighbors = rowptr_data[idx + 1] - rowptr_data[idx];
+            if (this->col_data) {
+                store_row(k, this->col_data + rowptr_data[idx], num_neighbors);
+            }
+            else if (num_neighbors > 0) {
+                rows.push_back(idx);
+                row_k.push_back(k);
+            }
+        }
+
+        // cache update, rows is empty for an in-memory sampler
+        if (!rows.empty()) {
+            try {
+                this->context.readers[omp_get_thread_num()]->read_rows(rowptr_data, rows, options, build_stats,
+                                                               [&](int64_t k, const int64_t* neighbors) {
+                    int64_t idx = rows[k];
+                    store_row(row_k[k], neighbors, rowptr_data[idx + 1] - rowptr_data[idx]);
+                });
+            }
+            catch (...) {
+                read_errors[omp_get_thread_num()] = std::current_exception();
+            }
+        }
+    }
+    for (std::exception_ptr &error : read_errors) {
+        if (error)
+            std::rethrow_exception(error);
+    }
+
+    this->io_stats.rows += build_stats.rows.load();
+    this->io_stats.bytes_requested += build_stats.bytes_requested.load();
+    this->io_stats.reads += build_stats.reads.load();
+    this->io_stats.bytes_read += build_stats.bytes_read.load();
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    int64_t bytes_stored = num_neighbors_total * (cache_data32 ? sizeof(uint32_t) : sizeof(int64_t));
+    return std::make_tuple(bytes_stored, build_stats.bytes_read.load(), seconds);
 }
 
-PYBIND11_MODULE(sample, m) {
-	m.def("sample_adj_ginex", &sample_adj_ginex, "ginex version of sample_adj");
-    m.def("fill_neighbor_cache", &fill_neighbor_cache, "fetch neighbors of given indices into the cache and set the cache table");
+
+std::tuple<int64_t, int64_t, int64_t, int64_t> GinexSampler::get_io_stats(bool reset) {
+    if (reset)
+        return std::make_tuple(this->io_stats.rows.exchange(0), this->io_stats.bytes_requested.exchange(0),
+                               this->io_stats.reads.exchange(0), this->io_stats.bytes_read.exchange(0));
+    return std::make_tuple(this->io_stats.rows.load(), this->io_stats.bytes_requested.load(),
+                           this->io_stats.reads.load(), this->io_stats.bytes_read.load());
+}
+
+
+std::tuple<int64_t, int64_t, int64_t> GinexSampler::get_block_cache_stats(bool reset) {
+    if (!this->block_cache)
+        return std::make_tuple(0, 0, 0);
+    BlockCache &cache = *this->block_cache;
+    if (reset)
+        return std::make_tuple(cache.hits.exchange(0), cache.misses.exchange(0), cache.evictions.exchange(0));
+    return std::make_tuple(cache.hits.load(), cache.misses.load(), cache.evictions.load());
 }
 
+
+std::tuple<torch::Tensor, torch::Tensor, torch::Tensor, torch::Tensor>
+sample_adj_ginex(torch::Tensor rowptr, std::string col_file, torch::Tensor idx, 
+                  torch::Tensor cache, torch::Tensor cache_bitmap, torch::Tensor cache_offsets,
+                  int64_t num_neighbors, bool replace, int64_t io_depth, int64_t seed) {
+
+  GinexSampler sampler(rowptr, col_file, cache, cache_bitmap, cache_offsets, io_depth);
+  return sampler.sample_adj(idx, num_neighbors, replace, seed);
+}
+
+std::tuple<int64_t, int64_t, double>
+fill_neighbor_cache(torch::Tensor cache, torch::Tensor rowptr, std::string col, 
+                torch::Tensor cached_idx, torch::Tensor cache_offsets, int64_t num_entries,
+                int64_t io_depth, int64_t chunk_size) {
+
+    GinexSampler sampler(rowptr, col, torch::Tensor(), torch::empty(0, rowptr.options()), torch::Tensor(), io_depth);
+    return sampler.fill_neighbor_cache(cache, cached_idx, cache_offsets, num_entries, chunk_size);
+}
+
+// Write the rows of col to out_file in the compressed column format and return
+// its index (blocks, offsets). offsets holds uint32 values in an int32 tensor.
+std::tuple<torch::Tensor, torch::Tensor>
+compress_indices(torch::Tensor rowptr, torch::Tensor col, const std::string &out_file) {
+
+    int64_t num_nodes = rowptr.numel() - 1;
+    int64_t* rowptr_data = rowptr.data_ptr<int64_t>();
+    int64_t* col_data = col.data_ptr<int64_t>();
+
+    auto blocks = torch::empty(num_nodes / COMPRESSED_BLOCK_ROWS + 1, rowptr.options());
+    auto offsets = torch::empty(num_nodes + 1, rowptr.options().dtype(torch::kInt32));
+    int64_t* blocks_data = blocks.data_ptr<int64_t>();
+    uint32_t* offsets_data = (uint32_t*)offsets.data_ptr<int32_t>();
+
+    FILE* out = fopen(out_file.c_str(), "wb");
+    TORCH_CHECK(out != NULL, "cannot open ", out_file, ": ", strerror(errno));
+    setvbuf(out, NULL, _IOFBF, 1<<24);
+
+    // On an error the partial column file is removed
+    std::string error;
+    std::vector<uint8_t> buffer;
+    int64_t offset = 0;
+    for (int64_t n = 0; n <= num_nodes; n++) {
+        int64_t block = n / COMPRESSED_BLOCK_ROWS;
+        if (n % COMPRESSED_BLOCK_ROWS == 0)
+            blocks_data[block] = offset;
+        if (offset - blocks_data[block] > UINT32_MAX) {
+            error = "block " + std::to_string(block) + " of " + out_file + " exceeds the 4 GB its row offsets can address";
+            break;
+        }
+        offsets_data[n] = static_cast<uint32_t>(offset - blocks_data[block]);
+        if (n == num_nodes)
+            break;
+
+        int64_t row_count = rowptr_data[n + 1] - rowptr_data[n];
+        buffer.resize(std::max((int64_t)buffer.size(), row_count*10));
+        int64_t size = encode_varint_row(col_data + rowptr_data[n], row_count, buffer.data());
+        if ((int64_t)fwrite(buffer.data(), 1, size, out) != size) {
+            error = "cannot write " + out_file + ": " + strerror(errno);
+            break;
+        }
+        offset += size;
+    }
+
+    if (fclose(out) != 0 && error.empty())
+        error = "cannot write " + out_file + ": " + strerror(errno);
+    if (!error.empty())
+        remove(out_file.c_str());
+    TORCH_CHECK(error.empty(), error);
+    return std::make_tuple(blocks, offsets);
+}
+
+// Relabel num_batches batches of num_ids sampled node IDs with the node-based
+// std::unordered_map the sampler used before and with RemapTable. IDs follow a
+// power law over num_nodes nodes, as neighbors drawn from a power-law graph do.
+// Return the average time per ID in nanoseconds for both.
+std::tuple<double, double>
+benchmark_remap(int64_t num_nodes, int64_t num_ids, int64_t num_batches, double alpha) {
+
+    std::vector<int64_t> ids(num_ids);
+    uint64_t state = 0x9e3779b97f4a7c15ULL;
+    for (int64_t k = 0; k < num_ids; k++) {
+        state ^= state << 13; state ^= state >> 7; state ^= state << 17;
+        double u = (double)(state >> 11) / (double)(1ULL << 53);
+        int64_t rank = (int64_t)(num_nodes * pow(u, alpha));
+        ids[k] = (rank * 0x9e3779b97f4a7c15LL & 0x7fffffffffffffffLL) % num_nodes;
+    }
+
+    double map_ns = 0, table_ns = 0;
+    int64_t checksum = 0;
+    RemapTable table;
+    for (int64_t b = 0; b < num_batches; b++) {
+        auto start = std::chrono::steady_clock::now();
+        std::unordered_map<int64_t, int64_t> n_id_map;
+        for (const int64_t &c : ids) {
+            if (n_id_map.count(c) == 0) {
+                int64_t local_id = n_id_map.size();
+                n_id_map[c] = local_id;
+            }
+            checksum += n_id_map[c];
+        }
+        auto mid = std::chrono::steady_clock::now();
+        table.clear();
+        for (const int64_t &c : ids)
+            checksum -= table.insert(c, table.size()).first;
+        auto end = std::chrono::steady_clock::now();
+
+        map_ns += std::chrono::duration<double, std::nano>(mid - start).count();
+        table_ns += std::chrono::duration<double, std::nano>(end - mid).count();
+    }
+    if (checksum != 0)
+        fprintf(stderr, "benchmark_remap: local IDs differ (%ld)\n", checksum);
+
+    return std::make_tuple(map_ns / (num_ids * num_batches), table_ns / (num_ids * num_batches));
+}
+
+PYBIND11_MODULE(sample, m) {
+    py::class_<GinexSampler>(m, "GinexSampler")
+        .def(py::init<torch::Tensor, const std::string &, torch::Tensor, torch::Tensor, torch::Tensor, int, int,
+                      c10::optional<torch::Tensor>, c10::optional<torch::Tensor>, int64_t, int64_t>(),
+             py::arg("rowptr"), py::arg("col_file"), py::arg("cache"), py::arg("cache_bitmap"), py::arg("cache_offsets"),
+             py::arg("io_depth") = SAMPLE_IO_DEPTH, py::arg("num_threads") = -1,
+             py::arg("col_blocks") = py::none(), py::arg("col_offsets") = py::none(),
+             py::arg("max_read") = SAMPLE_MAX_READ, py::arg("block_cache_size") = 0)
+        .def(py::init<torch::Tensor, torch::Tensor, int>(),
+             py::arg("rowptr"), py::arg("col"), py::arg("num_threads") = -1)
+        .def("sample_adj", &GinexSampler::sample_adj,
+             py::arg("idx"), py::arg("num_neighbors"), py::arg("replace"), py::arg("seed") = -1,
+             py::arg("return_e_id") = true, py::call_guard<py::gil_scoped_release>())
+        .def("sample_multi_hop", &GinexSampler::sample_multi_hop,
+             py::arg("idx"), py::arg("sizes"), py::arg("replace"), py::arg("seed") = -1,
+             py::arg("return_e_id") = true, py::call_guard<py::gil_scoped_release>())
+        .def("sample_batches", &GinexSampler::sample_batches,
+             py::arg("batches"), py::arg("sizes"), py::arg("replace"), py::arg("seed") = -1, py::arg("num_workers") = -1,
+             py::arg("return_e_id") = true, py::return_value_policy::take_ownership, py::keep_alive<0, 1>(),
+             py::call_guard<py::gil_scoped_release>())
+        .def("fill_neighbor_cache", &GinexSampler::fill_neighbor_cache,
+             py::arg("cache"), py::arg("cached_idx"), py::arg("cache_offsets"), py::arg("num_entries"),
+             py::arg("chunk_size") = BUILD_CHUNK_SIZE, py::call_guard<py::gil_scoped_release>())
+        .def("get_io_stats", &GinexSampler::get_io_stats, py::arg("reset") = false)
+        .def("get_block_cache_stats", &GinexSampler::get_block_cache_stats, py::arg("reset") = false);
+
+    // Iterating yields (b, n_id, layers) with b the index of the batch in batches
+    py::class_<BatchStream>(m, "BatchStream")
+        .def("__len__", &BatchStream::size)
+        .def("__iter__", [](BatchStream &stream) -> BatchStream & { return stream; },
+             py::return_value_policy::reference_internal)
+        .def("__next__", [](BatchStream &stream) {
+            SampledBatch batch;
+            bool found;
+            {
+                py::gil_scoped_release release;
+                found = stream.next(batch);
+            }
+            if (!found)
+                throw py::stop_iteration();
+            return batch;
+        });
+
+	m.def("sample_adj_ginex", &sample_adj_ginex, "ginex version of sample_adj",
+          py::arg("rowptr"), py::arg("col_file"), py::arg("idx"), py::arg("cache"), py::arg("cache_bitmap"), py::arg("cache_offsets"),
+          py::arg("num_neighbors"), py::arg("replace"), py::arg("io_depth") = SAMPLE_IO_DEPTH,
+          py::arg("seed") = -1, py::call_guard<py::gil_scoped_release>());
+    m.def("fill_neighbor_cache", &fill_neighbor_cache, "fetch neighbors of given indices into the cache at the given offsets",
+          py::arg("cache"), py::arg("rowptr"), py::arg("col"), py::arg("cached_idx"), py::arg("cache_offsets"),
+          py::arg("num_entries"), py::arg("io_depth") = SAMPLE_IO_DEPTH, py::arg("chunk_size") = BUILD_CHUNK_SIZE,
+          py::call_guard<py::gil_scoped_release>());
+    m.def("compress_indices", &compress_indices, "write the column file in the compressed format and return its index",
+          py::arg("rowptr"), py::arg("col"), py::arg("out_file"), py::call_guard<py::gil_scoped_release>());
+    m.def("benchmark_remap", &benchmark_remap, "time node ID relabeling with std::unordered_map and RemapTable",
+          py::arg("num_nodes"), py::arg("num_ids"), py::arg("num_batches"), py::arg("alpha") = 3.0);
+}
@@ -0,0 +1,633 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/types.h>
+#include <torch/extension.h>
+#include <Python.h>
+#include <pybind11/pybind11.h>
+#include <pybind11/stl.h>
+#include <errno.h>
+#include <cstring>
+#include <inttypes.h>
+#include <limits.h>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+#define TRACE_MAGIC 0x45434152544e4447L
+#define TRACE_VERSION 1
+#define TRACE_ALIGNMENT 64
+#define TRACE_MAX_DIM 4
+
+// The runtime trace of a superbatch is a single append-only log of records and
+// an index file next to it (path + ".idx"). A record is the list of tensors the
+// sampler or the cache simulator produced for one kind (ids, adjs or update) of
+// one batch:
+//
+//   TraceRecordHeader | TraceTensorHeader * num_tensors | tensor data ...
+//
+// Records and tensor data start on TRACE_ALIGNMENT boundaries of the log, so a
+// reader can map the log and hand out tensors that point into the mapping. The
+// index is a flat array of TraceIndexEntry, appended after the record it points
+// to is complete, so a reader never sees a record that is being written. Writers
+// in different processes and threads may append to the same trace; each append
+// holds an exclusive flock on the log.
+//
+// A TraceStore keeps records in a shared in-memory arena instead, and appends
+// them to the log only once the arena is full (see below).
+enum TraceKind {
+    TRACE_IDS = 0,
+    TRACE_ADJS = 1,
+    TRACE_UPDATE = 2,
+    TRACE_NUM_KINDS = 3
+};
+
+struct TraceFileHeader
+{
+    int64_t magic;
+    int32_t version;
+    int32_t alignment;
+    char pad[TRACE_ALIGNMENT - 16];
+};
+
+struct TraceRecordHeader
+{
+    int32_t kind;
+    int32_t num_tensors;
+    int64_t batch;
+};
+
+struct TraceTensorHeader
+{
+    int32_t dtype;
+    int32_t ndim;
+    int64_t shape[TRACE_MAX_DIM];
+    // From the start of the record
+    int64_t offset;
+    int64_t nbytes;
+};
+
+struct TraceIndexEntry
+{
+    int32_t kind;
+    int32_t pad;
+    int64_t batch;
+    int64_t offset;
+    int64_t size;
+};
+
+static const torch::ScalarType trace_dtypes[] = {
+    torch::kInt64, torch::kInt32, torch::kInt16, torch::kInt8, torch::kUInt8,
+    torch::kFloat32, torch::kFloat64, torch::kFloat16, torch::kBFloat16, torch::kBool
+};
+static const int trace_num_dtypes = sizeof(trace_dtypes) / sizeof(trace_dtypes[0]);
+
+
+int trace_dtype_code(torch::ScalarType type){
+    for (int n = 0; n < trace_num_dtypes; n++)
+        if (trace_dtypes[n] == type)
+            return n;
+    TORCH_CHECK(false, "unsupported dtype in trace");
+}
+
+
+int64_t trace_align(int64_t size){
+    return (size + TRACE_ALIGNMENT - 1) & ~(int64_t)(TRACE_ALIGNMENT - 1);
+}
+
+
+std::string trace_index_path(const std::string &path){
+    return path + ".idx";
+}
+
+
+// Lay out the tensors of one kind of one batch as a record, filling in its
+// headers, and return the size of the record
+int64_t plan_record(int kind, int64_t batch, std::vector<torch::Tensor> &tensors,
+                    TraceRecordHeader &record, std::vector<TraceTensorHeader> &headers){
+    int num_tensors = tensors.size();
+    headers.resize(num_tensors);
+    int64_t offset = trace_align(sizeof(TraceRecordHeader) + num_tensors*sizeof(TraceTensorHeader));
+    for (int n = 0; n < num_tensors; n++) {
+        torch::Tensor &t = tensors[n];
+        TORCH_CHECK(!t.is_cuda(), "trace tensors must be on the CPU");
+        TORCH_CHECK(t.dim() <= TRACE_MAX_DIM, "trace tensors have at most ", TRACE_MAX_DIM, " dimensions");
+        t = t.contiguous();
+        memset(&headers[n], 0, sizeof(TraceTensorHeader));
+        headers[n].dtype = trace_dtype_code(t.scalar_type());
+        headers[n].ndim = t.dim();
+        for (int d = 0; d < t.dim(); d++)
+            headers[n].shape[d] = t.size(d);
+        headers[n].offset = offset;
+        headers[n].nbytes = t.numel()*t.element_size();
+        offset = trace_align(offset + headers[n].nbytes);
+    }
+
+    record.kind = kind;
+    record.num_tensors = num_tensors;
+    record.batch = batch;
+    return offset;
+}
+
+
+// The pieces of a record planned with plan_record, with the tensor data taken
+// from the tensors themselves and zeros for the padding
+std::vector<struct iovec> record_iov(TraceRecordHeader &record, std::vector<TraceTensorHeader> &headers,
+                                     std::vector<torch::Tensor> &tensors, int64_t size){
+    static const char padding[TRACE_ALIGNMENT] = {0};
+    int num_tensors = tensors.size();
+    std::vector<struct iovec> iov;
+    iov.push_back({&record, sizeof(record)});
+    if (num_tensors > 0)
+        iov.push_back({headers.data(), num_tensors*sizeof(TraceTensorHeader)});
+    int64_t written = sizeof(record) + num_tensors*sizeof(TraceTensorHeader);
+    for (int n = 0; n < num_tensors; n++) {
+        if (headers[n].offset > written)
+            iov.push_back({(void*)padding, (size_t)(headers[n].offset - written)});
+        if (headers[n].nbytes > 0)
+            iov.push_back({tensors[n].data_ptr(), (size_t)headers[n].nbytes});
+        written = headers[n].offset + headers[n].nbytes;
+    }
+    if (size > written)
+        iov.push_back({(void*)padding, (size_t)(size - written)});
+    return iov;
+}
+
+
+// The tensors of the record of kind for batch at record_ptr, which point into
+// the record and keep owner alive
+std::vector<torch::Tensor> record_tensors(char* record_ptr, int64_t size, int kind, int64_t batch,
+                                          std::shared_ptr<void> owner, const std::string &name){
+    TraceRecordHeader* record = (TraceRecordHeader*)record_ptr;
+    TraceTensorHeader* headers = (TraceTensorHeader*)(record_ptr + sizeof(TraceRecordHeader));
+    TORCH_CHECK(record->kind == kind && record->batch == batch, name, " has a corrupt record for batch ", batch);
+
+    std::vector<torch::Tensor> tensors;
+    for (int n = 0; n < record->num_tensors; n++) {
+        TraceTensorHeader &header = headers[n];
+        TORCH_CHECK(header.dtype >= 0 && header.dtype < trace_num_dtypes && header.ndim <= TRACE_MAX_DIM &&
+                    header.offset + header.nbytes <= size, name, " has a corrupt record for batch ", batch);
+        std::vector<int64_t> sizes(header.shape, header.shape + header.ndim);
+        auto options = torch::TensorOptions()
+            .dtype(trace_dtypes[header.dtype])
+            .layout(torch::kStrided)
+            .device(torch::kCPU)
+            .requires_grad(false);
+        tensors.push_back(torch::from_blob(record_ptr + header.offset, sizes,
+                                           [owner](void*) {}, options));
+    }
+    return tensors;
+}
+
+
+bool write_full(int fd, struct iovec* iov, int iovcnt){
+    while (iovcnt > 0) {
+        ssize_t ret = writev(fd, iov, std::min(iovcnt, IOV_MAX));
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0) {
+            fprintf(stderr, "trace: write failed: %s\n", strerror(errno));
+            return false;
+        }
+        while (iovcnt > 0 && (size_t)ret >= iov->iov_len) {
+            ret -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char*)iov->iov_base + ret;
+            iov->iov_len -= ret;
+        }
+    }
+    return true;
+}
+
+
+class TraceWriter
+{
+public:
+    TraceWriter(const std::string &path){
+        this->path = path;
+        this->fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        TORCH_CHECK(this->fd >= 0, "cannot open ", path, ": ", strerror(errno));
+        this->index_fd = open(trace_index_path(path).c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (this->index_fd < 0) {
+            close(this->fd);
+            TORCH_CHECK(false, "cannot open ", trace_index_path(path), ": ", strerror(errno));
+        }
+
+        // The first writer of a trace writes its header
+        flock(this->fd, LOCK_EX);
+        struct stat st;
+        fstat(this->fd, &st);
+        bool ok = true;
+        if (st.st_size == 0) {
+            TraceFileHeader header;
+            memset(&header, 0, sizeof(header));
+            header.magic = TRACE_MAGIC;
+            header.version = TRACE_VERSION;
+            header.alignment = TRACE_ALIGNMENT;
+            struct iovec iov = {&header, sizeof(header)};
+            ok = write_full(this->fd, &iov, 1);
+        }
+        flock(this->fd, LOCK_UN);
+        if (!ok) {
+            close(this->fd);
+            close(this->index_fd);
+            TORCH_CHECK(false, "cannot write ", path);
+        }
+    }
+
+    ~TraceWriter(){
+        close(this->fd);
+        close(this->index_fd);
+    }
+
+    // Append the tensors of one kind of one batch as a single record
+    void append(int kind, int64_t batch, std::vector<torch::Tensor> tensors){
+        TraceRecordHeader record;
+        std::vector<TraceTensorHeader> headers;
+        int64_t size = plan_record(kind, batch, tensors, record, headers);
+        std::vector<struct iovec> iov = record_iov(record, headers, tensors, size);
+
+        std::lock_guard<std::mutex> guard(this->append_mutex);
+        flock(this->fd, LOCK_EX);
+        TraceIndexEntry entry;
+        memset(&entry, 0, sizeof(entry));
+        entry.kind = kind;
+        entry.batch = batch;
+        entry.offset = lseek(this->fd, 0, SEEK_END);
+        entry.size = size;
+        bool ok = write_full(this->fd, iov.data(), iov.size());
+        if (ok) {
+            struct iovec index_iov = {&entry, sizeof(entry)};
+            ok = write_full(this->index_fd, &index_iov, 1);
+        }
+        flock(this->fd, LOCK_UN);
+        TORCH_CHECK(ok, "cannot append to ", this->path);
+    }
+
+private:
+    std::string path;
+    int fd;
+    int index_fd;
+    std::mutex append_mutex;
+};
+
+
+// A read-only view of the log, which stays mapped as long as any tensor of it
+// is alive. It is mapped copy-on-write, so tensors of it can be changed in place
+// without changing the log.
+struct TraceMapping
+{
+    void* ptr;
+    int64_t size;
+
+    ~TraceMapping(){
+        if (this->ptr != MAP_FAILED)
+            munmap(this->ptr, this->size);
+    }
+};
+
+
+class TraceReader
+{
+public:
+    TraceReader(const std::string &path){
+        this->path = path;
+        this->fd = open(path.c_str(), O_RDONLY);
+        TORCH_CHECK(this->fd >= 0, "cannot open ", path, ": ", strerror(errno));
+        this->index_fd = open(trace_index_path(path).c_str(), O_RDONLY);
+        if (this->index_fd < 0) {
+            close(this->fd);
+            TORCH_CHECK(false, "cannot open ", trace_index_path(path), ": ", strerror(errno));
+        }
+        this->index_size = 0;
+
+        TraceFileHeader header;
+        ssize_t ret = pread(this->fd, &header, sizeof(header), 0);
+        if (ret != sizeof(header) || header.magic != TRACE_MAGIC || header.version != TRACE_VERSION) {
+            close(this->fd);
+            close(this->index_fd);
+            TORCH_CHECK(false, path, " is not a trace");
+        }
+
+        std::lock_guard<std::mutex> guard(this->reader_mutex);
+        this->refresh();
+    }
+
+    ~TraceReader(){
+        close(this->fd);
+        close(this->index_fd);
+    }
+
+    // Whether a record of kind for batch has been appended
+    bool contains(int kind, int64_t batch){
+        std::lock_guard<std::mutex> guard(this->reader_mutex);
+        if (this->records.count({kind, batch}) == 0)
+            this->refresh();
+        return this->records.count({kind, batch}) > 0;
+    }
+
+    // The number of records of kind appended so far
+    int64_t num_records(int kind){
+        std::lock_guard<std::mutex> guard(this->reader_mutex);
+        this->refresh();
+        auto it = this->records.lower_bound({kind, INT64_MIN});
+        int64_t count = 0;
+        for (; it != this->records.end() && it->first.first == kind; it++)
+            count++;
+        return count;
+    }
+
+    // The tensors of the record of kind for batch, which point into the mapped
+    // log. The record is paged in ahead with MADV_WILLNEED.
+    std::vector<torch::Tensor> get(int kind, int64_t batch){
+        std::shared_ptr<TraceMapping> mapping;
+        TraceIndexEntry entry;
+        {
+            std::lock_guard<std::mutex> guard(this->reader_mutex);
+            auto it = this->records.find({kind, batch});
+            if (it == this->records.end()) {
+                this->refresh();
+                it = this->records.find({kind, batch});
+            }
+            TORCH_CHECK(it != this->records.end(), this->path, " has no record of kind ", kind, " for batch ", batch);
+            entry = it->second;
+            if (!this->mapping || entry.offset + entry.size > this->mapping->size)
+                this->remap();
+            mapping = this->mapping;
+        }
+
+        char* record_ptr = (char*)mapping->ptr + entry.offset;
+        uintptr_t page = (uintptr_t)record_ptr & ~(uintptr_t)(sysconf(_SC_PAGESIZE) - 1);
+        madvise((void*)page, (uintptr_t)record_ptr + entry.size - page, MADV_WILLNEED);
+        return record_tensors(record_ptr, entry.size, kind, batch, mapping, this->path);
+    }
+
+private:
+    // Read the index entries appended since the last refresh. A partly written
+    // entry at the end is left for the next one.
+    void refresh(){
+        struct stat st;
+        fstat(this->index_fd, &st);
+        int64_t num_entries = (st.st_size - this->index_size) / (int64_t)sizeof(TraceIndexEntry);
+        if (num_entries <= 0)
+            return;
+        std::vector<TraceIndexEntry> entries(num_entries);
+        ssize_t ret = pread(this->index_fd, entries.data(), num_entries*sizeof(TraceIndexEntry), this->index_size);
+        if (ret < 0) {
+            fprintf(stderr, "trace: cannot read %s: %s\n", trace_index_path(this->path).c_str(), strerror(errno));
+            return;
+        }
+        num_entries = ret / sizeof(TraceIndexEntry);
+        for (int64_t n = 0; n < num_entries; n++)
+            this->records[{entries[n].kind, entries[n].batch}] = entries[n];
+        this->index_size += num_entries*sizeof(TraceIndexEntry);
+    }
+
+    // Map the log as it is now. Tensors of the old mapping keep it alive.
+    void remap(){
+        struct stat st;
+        fstat(this->fd, &st);
+        std::shared_ptr<TraceMapping> mapping(new TraceMapping);
+        mapping->size = st.st_size;
+        mapping->ptr = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, this->fd, 0);
+        TORCH_CHECK(mapping->ptr != MAP_FAILED, "cannot map ", this->path, ": ", strerror(errno));
+        this->mapping = mapping;
+    }
+
+    std::string path;
+    int fd;
+    int index_fd;
+    int64_t index_size;
+    std::map<std::pair<int, int64_t>, TraceIndexEntry> records;
+    std::shared_ptr<TraceMapping> mapping;
+    std::mutex reader_mutex;
+};
+
+
+// Delete a trace and its index. Readers that have it mapped keep their view.
+void remove_trace(const std::string &path){
+    unlink(path.c_str());
+    unlink(trace_index_path(path).c_str());
+}
+
+
+// The state of a TraceStore record, which is published last
+enum TraceStoreState {
+    TRACE_EMPTY = 0,
+    TRACE_IN_MEMORY = 1,
+    TRACE_ON_DISK = 2
+};
+
+struct TraceArenaHeader
+{
+    std::atomic<int64_t> used;
+    std::atomic<int64_t> num_in_memory;
+    std::atomic<int64_t> num_spilled;
+};
+
+struct TraceStoreEntry
+{
+    std::atomic<int32_t> state;
+    int32_t pad;
+    int64_t offset;
+    int64_t size;
+};
+
+// Shared anonymous memory that stays mapped as long as the store or any tensor
+// of it is alive
+struct TraceArena
+{
+    void* ptr;
+    size_t size;
+
+    ~TraceArena(){
+        if (this->ptr != MAP_FAILED)
+            munmap(this->ptr, this->size);
+    }
+};
+
+
+// The runtime trace of a superbatch kept in memory. The store maps an arena of
+// budget bytes shared with every process forked after it is created, so the
+// DataLoader workers append to the same arena the main process reads from.
+// Appends reserve space with a compare-and-swap on the used bytes and copy the
+// record in without a lock, and a record that does not fit anymore is spilled
+// to the log at path instead. The records are indexed directly by kind and
+// batch, so batch must be below max_batches. A budget of 0 keeps every record
+// on disk.
+//
+// Tensors of in-memory records point into the shared arena, so changing them
+// in place changes the store.
+class TraceStore
+{
+public:
+    TraceStore(const std::string &path, int64_t max_batches, int64_t budget){
+        TORCH_CHECK(max_batches >= 0 && budget >= 0, "max_batches and budget must not be negative");
+        this->path = path;
+        this->max_batches = max_batches;
+        this->budget = budget;
+        this->writer_pid = -1;
+
+        // A trace left over from an earlier run is replaced
+        remove_trace(path);
+
+        this->index_offset = trace_align(sizeof(TraceArenaHeader));
+        this->data_offset = trace_align(this->index_offset + TRACE_NUM_KINDS*max_batches*sizeof(TraceStoreEntry));
+        std::shared_ptr<TraceArena> arena(new TraceArena);
+        arena->size = this->data_offset + budget;
+        arena->ptr = mmap(NULL, arena->size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        TORCH_CHECK(arena->ptr != MAP_FAILED, "cannot map a trace arena of ", arena->size, " bytes: ", strerror(errno));
+        this->arena = arena;
+
+        new (this->header()) TraceArenaHeader();
+        for (int64_t n = 0; n < TRACE_NUM_KINDS*max_batches; n++)
+            new (this->entry_at(n)) TraceStoreEntry();
+    }
+
+    // Append the tensors of one kind of one batch as a single record, in memory
+    // if it fits in the budget and to the log otherwise
+    void append(int kind, int64_t batch, std::vector<torch::Tensor> tensors){
+        TraceStoreEntry* entry = this->entry(kind, batch);
+        TORCH_CHECK(entry->state.load(std::memory_order_acquire) == TRACE_EMPTY,
+                    this->path, " already has a record of kind ", kind, " for batch ", batch);
+
+        TraceRecordHeader record;
+        std::vector<TraceTensorHeader> headers;
+        int64_t size = plan_record(kind, batch, tensors, record, headers);
+
+        TraceArenaHeader* header = this->header();
+        int64_t offset = header->used.load();
+        do {
+            if (offset + size > this->budget)
+                break;
+        } while (!header->used.compare_exchange_weak(offset, offset + size));
+
+        if (offset + size <= this->budget) {
+            char* dst = (char*)this->arena->ptr + this->data_offset + offset;
+            for (struct iovec &piece : record_iov(record, headers, tensors, size)) {
+                memcpy(dst, piece.iov_base, piece.iov_len);
+                dst += piece.iov_len;
+            }
+            entry->offset = offset;
+            entry->size = size;
+            entry->state.store(TRACE_IN_MEMORY, std::memory_order_release);
+            header->num_in_memory++;
+        }
+        else {
+            this->get_writer()->append(kind, batch, tensors);
+            entry->state.store(TRACE_ON_DISK, std::memory_order_release);
+            header->num_spilled++;
+        }
+    }
+
+    // Whether a record of kind for batch has been appended
+    bool contains(int kind, int64_t batch){
+        return this->entry(kind, batch)->state.load(std::memory_order_acquire) != TRACE_EMPTY;
+    }
+
+    // The tensors of the record of kind for batch, which point into the arena or
+    // the mapped log
+    std::vector<torch::Tensor> get(int kind, int64_t batch){
+        TraceStoreEntry* entry = this->entry(kind, batch);
+        int32_t state = entry->state.load(std::memory_order_acquire);
+        TORCH_CHECK(state != TRACE_EMPTY, this->path, " has no record of kind ", kind, " for batch ", batch);
+        if (state == TRACE_ON_DISK)
+            return this->get_reader()->get(kind, batch);
+
+        char* record_ptr = (char*)this->arena->ptr + this->data_offset + entry->offset;
+        return record_tensors(record_ptr, entry->size, kind, batch, this->arena, this->path);
+    }
+
+    // The records kept in memory, the bytes of them and the records spilled to
+    // the log
+    std::tuple<int64_t, int64_t, int64_t> get_stats(){
+        TraceArenaHeader* header = this->header();
+        return std::make_tuple(header->num_in_memory.load(), header->used.load(),
+                               header->num_spilled.load());
+    }
+
+private:
+    TraceArenaHeader* header(){
+        return (TraceArenaHeader*)this->arena->ptr;
+    }
+
+    TraceStoreEntry* entry_at(int64_t n){
+        return (TraceStoreEntry*)((char*)this->arena->ptr + this->index_offset) + n;
+    }
+
+    TraceStoreEntry* entry(int kind, int64_t batch){
+        TORCH_CHECK(kind >= 0 && kind < TRACE_NUM_KINDS, "unknown trace record kind ", kind);
+        TORCH_CHECK(batch >= 0 && batch < this->max_batches, "batch ", batch, " is out of the ", this->max_batches, " batches of ", this->path);
+        return this->entry_at(kind*this->max_batches + batch);
+    }
+
+    // A writer of the log for the calling process. A writer inherited across
+    // fork shares its flock with the parent, so each process opens its own.
+    TraceWriter* get_writer(){
+        std::lock_guard<std::mutex> guard(this->disk_mutex);
+        if (!this->writer || this->writer_pid != getpid()) {
+            this->writer.reset(new TraceWriter(this->path));
+            this->writer_pid = getpid();
+        }
+        return this->writer.get();
+    }
+
+    TraceReader* get_reader(){
+        std::lock_guard<std::mutex> guard(this->disk_mutex);
+        if (!this->reader)
+            this->reader.reset(new TraceReader(this->path));
+        return this->reader.get();
+    }
+
+    std::string path;
+    int64_t max_batches;
+    int64_t budget;
+    int64_t index_offset;
+    int64_t data_offset;
+    std::shared_ptr<TraceArena> arena;
+
+    std::unique_ptr<TraceWriter> writer;
+    pid_t writer_pid;
+    std::unique_ptr<TraceReader> reader;
+    std::mutex disk_mutex;
+};
+
+
+PYBIND11_MODULE(trace, m) {
+    m.attr("IDS") = (int)TRACE_IDS;
+    m.attr("ADJS") = (int)TRACE_ADJS;
+    m.attr("UPDATE") = (int)TRACE_UPDATE;
+
+    py::class_<TraceWriter>(m, "TraceWriter")
+        .def(py::init<const std::string &>(), py::arg("path"))
+        .def("append", &TraceWriter::append, py::arg("kind"), py::arg("batch"), py::arg("tensors"),
+             py::call_guard<py::gil_scoped_release>());
+
+    py::class_<TraceReader>(m, "TraceReader")
+        .def(py::init<const std::string &>(), py::arg("path"))
+        .def("contains", &TraceReader::contains, py::arg("kind"), py::arg("batch"))
+        .def("num_records", &TraceReader::num_records, py::arg("kind"))
+        .def("get", &TraceReader::get, py::arg("kind"), py::arg("batch"),
+             py::call_guard<py::gil_scoped_release>());
+
+    py::class_<TraceStore>(m, "TraceStore")
+        .def(py::init<const std::string &, int64_t, int64_t>(),
+             py::arg("path"), py::arg("max_batches"), py::arg("budget") = 0)
+        .def("append", &TraceStore::append, py::arg("kind"), py::arg("batch"), py::arg("tensors"),
+             py::call_guard<py::gil_scoped_release>())
+        .def("contains", &TraceStore::contains, py::arg("kind"), py::arg("batch"))
+        .def("get", &TraceStore::get, py::arg("kind"), py::arg("batch"),
+             py::call_guard<py::gil_scoped_release>())
+        .def("get_stats", &TraceStore::get_stats);
+
+    m.def("remove", &remove_trace, "delete a trace and its index", py::arg("path"));
+}
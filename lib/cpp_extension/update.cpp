@@ -11,6 +11,7 @@
 #include <cstring>
 #include <inttypes.h>
 #include <ATen/ATen.h>
+#include "row_copy.h"
 
 void cache_update(torch::Tensor cache, torch::Tensor address_table, torch::Tensor batch_inputs, torch::Tensor in_indices, torch::Tensor in_positions, torch::Tensor out_indices, int64_t num_features){
 
@@ -24,12 +25,21 @@ void cache_update(torch::Tensor cache, torch::Tensor address_table, torch::Tenso
         int64_t num_idx = in_indices.numel();
         int64_t feature_size = num_features*sizeof(float);
 
-        #pragma omp parallel for num_threads(torch::get_num_threads())
-        for (int64_t n = 0; n < num_idx; n++) {
-                int32_t cache_out_idx = address_table_data[out_indices_data[n]];
-                memcpy(cache_data+num_features*cache_out_idx, batch_inputs_data+num_features*in_positions_data[n], feature_size);
-                address_table_data[in_indices_data[n]] = cache_out_idx;
-                address_table_data[out_indices_data[n]] = -1;
+        RowCopier copy_row(num_features, num_idx*feature_size, cache_data);
+
+        #pragma omp parallel num_threads(torch::get_num_threads())
+        {
+                #pragma omp for
+                for (int64_t n = 0; n < num_idx; n++) {
+                        if (n + ROW_COPY_PREFETCH < num_idx)
+                                copy_row.prefetch(batch_inputs_data+num_features*in_positions_data[n + ROW_COPY_PREFETCH]);
+
+                        int32_t cache_out_idx = address_table_data[out_indices_data[n]];
+                        copy_row(cache_data+num_features*cache_out_idx, batch_inputs_data+num_features*in_positions_data[n]);
+                        address_table_data[in_indices_data[n]] = cache_out_idx;
+                        address_table_data[out_indices_data[n]] = -1;
+                }
+                copy_row.finish();
         }
 
         return;
@@ -3,10 +3,12 @@ from torch.utils.cpp_extension import load
 
 dir_path = os.path.dirname(os.path.realpath(__file__))
 
-sample = load(name='sample', sources=[os.path.join(dir_path, 'sample.cpp')], extra_cflags=['-fopenmp', '-O2'], extra_ldflags=['-lgomp','-lrt'])
-gather = load(name='gather', sources=[os.path.join(dir_path, 'gather.cpp')], extra_cflags=['-fopenmp', '-O2'], extra_ldflags=['-lgomp','-lrt'])
+sample = load(name='sample', sources=[os.path.join(dir_path, 'sample.cpp')], extra_cflags=['-fopenmp', '-O2'], extra_ldflags=['-lgomp','-lrt','-luring'])
+gather = load(name='gather', sources=[os.path.join(dir_path, 'gather.cpp')], extra_cflags=['-fopenmp', '-O2'], extra_ldflags=['-lgomp','-lrt','-luring'])
 mt_load = load(name='mt_load', sources=[os.path.join(dir_path, 'mt_load.cpp')], extra_cflags=['-fopenmp', '-O2'], extra_ldflags=['-lgomp','-lrt'])
 update = load(name='update', sources=[os.path.join(dir_path, 'update.cpp')], extra_cflags=['-fopenmp', '-O2'], extra_ldflags=['-lgomp','-lrt'])
+trace = load(name='trace', sources=[os.path.join(dir_path, 'trace.cpp')], extra_cflags=['-O2'])
+changeset = load(name='changeset', sources=[os.path.join(dir_path, 'changeset.cpp')], extra_cflags=['-fopenmp', '-O2'], extra_ldflags=['-lgomp'])
 free = load(name='free', sources=[os.path.join(dir_path, 'free.cpp')], extra_cflags=['-O2'])
 io_uring_support = load(name='io_uring_support', sources=[os.path.join(dir_path, 'io_uring_support.cpp')], extra_cflags=['-O2'])
 
@@ -5,6 +5,35 @@ import torch
 from lib.utils import *
 
 
+# The features file written by convert_features.py for dtype, or features.dat
+# for float32
+def get_features_path(path, dtype='float32'):
+    if dtype == 'float32':
+        return os.path.join(path, 'features.dat')
+    return os.path.join(path, 'features_' + dtype + '.dat')
+
+
+def get_feature_scales_path(path):
+    return os.path.join(path, 'features_int8_scales.dat')
+
+
+# Return the per-row scales of int8 features, or None for other dtypes
+def get_feature_scales(path, dtype='float32'):
+    if dtype != 'int8':
+        return None
+    return torch.from_numpy(np.fromfile(get_feature_scales_path(path), dtype=np.float32))
+
+
+# numpy has no bfloat16, so bfloat16 features are mapped as int16 and viewed as
+# bfloat16
+def mmap_features(features_path, shape, dtype='float32'):
+    np_dtype = {'float32': np.float32, 'float16': np.float16, 'bfloat16': np.int16, 'int8': np.int8}[dtype]
+    features = torch.from_numpy(np.memmap(features_path, mode='r', shape=tuple(shape), dtype=np_dtype))
+    if dtype == 'bfloat16':
+        features = features.view(torch.bfloat16)
+    return features
+
+
 def get_mmap_dataset(path='../data/dataset/ogbn-papers100M-ginex', split_idx_path=None, num_features=128):
     indptr_path = os.path.join(path, 'indptr.dat')
     indices_path = os.path.join(path, 'indices.dat')
@@ -101,14 +130,13 @@ def get_mmap_dataset_share2(path='../data/dataset/ogbn-papers100M-ginex', split_
     return indptr, indices, num_nodes, train_idx, val_idx, test_idx
 
 
-def get_mmap_x(path='../data/dataset/ogbn-papers100M-ginex', split_idx_path=None, num_features=128):
+def get_mmap_x(path='../data/dataset/ogbn-papers100M-ginex', split_idx_path=None, num_features=128, dtype='float32'):
     conf_path = os.path.join(path, 'conf' + '.json')
     conf = json.load(open(conf_path, 'r'))
 
-    features_path = os.path.join(path, 'features' + '.dat')
+    features_path = get_features_path(path, dtype)
     features_shape = conf['features_shape']
-    real_features = np.memmap(features_path, mode='r', shape=tuple(features_shape), dtype=conf['features_dtype'])
-    real_features = torch.from_numpy(real_features)
+    real_features = mmap_features(features_path, features_shape, dtype)
 
     return real_features
 
@@ -142,6 +170,9 @@ class GinexDataset():
     def __init__(self, path='../data/dataset/ogbn-papers100M-ginex', split_idx_path=None, score_path=None, num_features=128):
         self.indptr_path = os.path.join(path, 'indptr.dat')
         self.indices_path = os.path.join(path, 'indices.dat')
+        self.compressed_indices_path = os.path.join(path, 'indices_varint.dat')
+        self.compressed_blocks_path = os.path.join(path, 'indices_varint_blocks.dat')
+        self.compressed_offsets_path = os.path.join(path, 'indices_varint_offsets.dat')
         self.features_path = os.path.join(path, 'features' + '.dat')
         self.labels_path = os.path.join(path, 'labels.dat')
         conf_path = os.path.join(path, 'conf' + '.json')
@@ -179,9 +210,17 @@ class GinexDataset():
         return indices
 
 
-    def get_rowptr_mt(self):
+    # Return the index (blocks, offsets) of the compressed indices written by
+    # compress_indices.py
+    def get_compressed_index(self):
+        blocks = torch.from_numpy(np.fromfile(self.compressed_blocks_path, dtype=np.int64))
+        offsets = torch.from_numpy(np.fromfile(self.compressed_offsets_path, dtype=np.int32))
+        return blocks, offsets
+
+
+    def get_rowptr_mt(self, hugepage='none', shared=False):
         indptr_size = self.conf['indptr_shape'][0]
-        indptr = mt_load(self.indptr_path, indptr_size)
+        indptr = load_tensor(self.indptr_path, indptr_size, self.conf['indptr_dtype'], hugepage=hugepage, shared=shared)
         return indptr
 
 
@@ -192,7 +231,7 @@ class GinexDataset():
 
     def get_labels_mt(self):
         labels_size = self.conf['labels_shape'][0]
-        labels = mt_load_float(self.labels_path, labels_size)
+        labels = load_tensor(self.labels_path, labels_size, self.conf['labels_dtype'])
         return labels
 
 
@@ -200,11 +239,14 @@ class GinexDataset():
         self.shuffled_train_idx = self.train_idx[torch.randperm(self.train_idx.numel())]
 
 
-    def get_mmapped_features(self):
+    def get_mmapped_features(self, dtype='float32'):
         features_shape = self.conf['features_shape']
         features_shape[1] = self.num_features
-        features = np.memmap(self.features_path, mode='r', shape=tuple(features_shape), dtype=self.conf['features_dtype'])
-        features = torch.from_numpy(features)
+        if dtype == 'float32':
+            features = np.memmap(self.features_path, mode='r', shape=tuple(features_shape), dtype=self.conf['features_dtype'])
+            features = torch.from_numpy(features)
+        else:
+            features = mmap_features(get_features_path(os.path.dirname(self.features_path), dtype), features_shape, dtype)
         return features
 
 
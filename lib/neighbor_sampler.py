@@ -1,29 +1,12 @@
 from typing import List, Optional, Tuple, NamedTuple, Callable
 import os
+import math
 import torch
 from torch import Tensor
 import torch_sparse
 from torch_sparse import SparseTensor
 import torch.multiprocessing as mp
-from lib.cpp_extension.wrapper import sample
-
-
-def sample_adj_ginex(rowptr, col, subset, num_neighbors, replace, cache_data=None, address_table=None):
-    rowptr, col, n_id, indptr = sample.sample_adj_ginex(                                                   
-        rowptr, col, subset, cache_data, address_table, num_neighbors, replace)                                 
-    out = SparseTensor(rowptr=rowptr, row=None, col=col,                                                 
-                       sparse_sizes=(subset.size(0), n_id.size(0)),                                      
-                       is_sorted=True)                                                                   
-    return out, n_id                                                                                     
-
-
-def sample_adj_mmap(rowptr, col, subset: torch.Tensor, num_neighbors: int, replace: bool = False):
-    rowptr, col, n_id, e_id = torch.ops.torch_sparse.sample_adj(                                         
-    rowptr, col, subset, num_neighbors, replace)                                                         
-    out = SparseTensor(rowptr=rowptr, row=None, col=col, value=None,                                     
-                       sparse_sizes=(subset.size(0), n_id.size(0)),                                      
-                       is_sorted=True)
-    return out, n_id
+from lib.cpp_extension.wrapper import sample, trace
 
 
 class Adj(NamedTuple):
@@ -38,32 +21,75 @@ class Adj(NamedTuple):
         return Adj(adj_t, e_id, self.size)
 
 
+def layers_to_adjs(layers):
+    # Adj takes e_id from the SparseTensor value, so the layers' e_id is not needed
+    adjs = []
+    for rowptr, col, e_id, num_cols in layers:
+        adj_t = SparseTensor(rowptr=rowptr, row=None, col=col,
+                             sparse_sizes=(rowptr.numel() - 1, num_cols),
+                             is_sorted=True)
+        adjs.append(Adj(adj_t, adj_t.storage.value(), adj_t.sparse_sizes()[::-1]))
+    return adjs
+
+
+# The layers of a batch as a trace record: the rowptr and col of every layer,
+# then the number of columns of the layers
+def layers_to_trace(layers):
+    tensors = []
+    for rowptr, col, e_id, num_cols in layers:
+        tensors += [rowptr, col]
+    tensors.append(torch.tensor([num_cols for _, _, _, num_cols in layers], dtype=torch.int64))
+    return tensors
+
+
+# The adjs of a batch from its trace record, in the order sample returns them
+def trace_to_adjs(tensors):
+    num_cols = tensors[-1].tolist()
+    layers = [(tensors[2*l], tensors[2*l+1], None, num_cols[l]) for l in range(len(num_cols))]
+    adjs = layers_to_adjs(layers)
+    return adjs[0] if len(adjs) == 1 else adjs[::-1]
+
+
 class GinexNeighborSampler(torch.utils.data.DataLoader):
     '''
     Neighbor sampler of Ginex. We modified NeighborSampler class of PyG.
 
     Args:
         indptr (Tensor): the indptr tensor.
-        indices (Tensor): the (memory-mapped) indices tensor.
-        exp_name (str): the name of the experiments used to designate the path of the
-            runtime trace files.
-        sb (int): the superbatch number.
+        indices (str): the path of the indices file.
+        trace_store (TraceStore): the runtime trace of the superbatch, which the ids 
+            and adjs of its batches are appended to.
         sizes ([int]): The number of neighbors to sample for each node in each layer. 
             If set to sizes[l] = -1`, all neighbors are included in layer `l`.
         node_idx (Tensor): The nodes that should be considered for creating mini-batches.
         cache_data (Tensor): the data array of the neighbor cache.
-        address_table (Tensor): the address table of the neighbor cache.
+        cache_bitmap (Tensor): the bitmap of the nodes in the neighbor cache.
+        cache_offsets (Tensor): the offsets of the cached rows in cache_data.
         num_nodes (int): the number of nodes in the graph.
+        io_depth (int): the number of neighbor reads each sampling thread keeps in 
+            flight. (default: 64)
+        max_read (int): the largest read in bytes that neighbor rows on adjacent 
+            pages of the indices file are merged into. (default: 131072)
+        block_cache_size (int): the size in bytes of the page cache for the indices 
+            file in each worker process, in front of the disk. 0 disables it, and 
+            any other size must hold at least one 4096-byte page. (default: 0)
+        seed (int, optional): the seed of the neighbor sampling RNG. A batch is then 
+            sampled the same way on every run. If not set, a random seed is used 
+            for every call. (default: None)
+        compressed_index ((Tensor, Tensor), optional): the (blocks, offsets) index 
+            if indices is a compressed indices file written by compress_indices.py. 
+            (default: None)
         transform (callable, optional): A function/transform that takes in a sampled 
             mini-batch and returns a transformed version. (default: None) 
         **kwargs (optional): Additional arguments of
             `torch.utils.data.DataLoader`, such as `batch_size`,
             `shuffle`, `drop_last`m `num_workers`.
     '''
-    def __init__(self, indptr, indices, exp_name, sb, trace_dir,
+    def __init__(self, indptr, indices, trace_store,
                  sizes: List[int], node_idx: Tensor,
-                 cache_data = None, address_table = None,
-                 num_nodes: Optional[int] = None,
+                 cache_data = None, cache_bitmap = None, cache_offsets = None,
+                 num_nodes: Optional[int] = None, io_depth: int = 64,
+                 max_read: int = 131072, block_cache_size: int = 0, seed: Optional[int] = None, compressed_index = None,
                  transform: Callable = None, **kwargs):
 
         if 'collate_fn' in kwargs:
@@ -73,14 +99,18 @@ class GinexNeighborSampler(torch.utils.data.DataLoader):
 
         self.indptr = indptr
         self.indices = indices
-        self.exp_name = exp_name
-        self.sb = sb
+        self.trace_store = trace_store
         self.node_idx = node_idx
         self.num_nodes = num_nodes
-        self.trace_dir = trace_dir
 
         self.cache_data = cache_data
-        self.address_table = address_table
+        self.cache_bitmap = cache_bitmap
+        self.cache_offsets = cache_offsets
+        self.io_depth = io_depth
+        self.max_read = max_read
+        self.block_cache_size = block_cache_size
+        self.seed = seed
+        self.compressed_index = compressed_index
 
         self.sizes = sizes
         self.transform = transform
@@ -89,26 +119,42 @@ class GinexNeighborSampler(torch.utils.data.DataLoader):
             node_idx = node_idx.nonzero(as_tuple=False).view(-1)
 
         self.batch_count = torch.zeros(1, dtype=torch.int).share_memory_()
+        # Rows read, bytes of those rows, reads issued and bytes read, over all workers
+        self.io_stats = torch.zeros(4, dtype=torch.int64).share_memory_()
+        # Page hits, misses and evictions of the block caches
+        self.block_cache_stats = torch.zeros(3, dtype=torch.int64).share_memory_()
         self.lock = mp.Lock()
+
+        # The native sampler owns an io_uring instance per thread, which must not be
+        # shared across fork. Each worker process creates its own on first use.
+        self.sampler = None
+        self.sampler_pid = None
     
         super(GinexNeighborSampler, self).__init__(
             node_idx.view(-1).tolist(), collate_fn=self.sample, **kwargs)
 
 
+    def get_sampler(self):
+        if self.sampler is None or self.sampler_pid != os.getpid():
+            col_blocks, col_offsets = self.compressed_index if self.compressed_index is not None else (None, None)
+            # One thread per worker, as the DataLoader workers already sample in parallel
+            self.sampler = sample.GinexSampler(self.indptr, self.indices, self.cache_data, self.cache_bitmap, self.cache_offsets, self.io_depth,
+                                               num_threads=1, col_blocks=col_blocks, col_offsets=col_offsets, max_read=self.max_read,
+                                               block_cache_size=self.block_cache_size)
+            self.sampler_pid = os.getpid()
+        return self.sampler
+
+
     def sample(self, batch):
         if not isinstance(batch, Tensor):
             batch = torch.tensor(batch)
 
         batch_size: int = len(batch)
+        sampler = self.get_sampler()
 
-        adjs = []
-        n_id = batch
-        for size in self.sizes:
-            adj_t, n_id = sample_adj_ginex(self.indptr, self.indices, n_id, size, False, self.cache_data, self.address_table)
-            
-            e_id = adj_t.storage.value()
-            size = adj_t.sparse_sizes()[::-1]
-            adjs.append(Adj(adj_t, e_id, size))
+        seed = -1 if self.seed is None else self.seed
+        n_id, layers = sampler.sample_multi_hop(batch, self.sizes, False, seed, return_e_id=False)
+        adjs = layers_to_adjs(layers)
 
         adjs = adjs[0] if len(adjs) == 1 else adjs[::-1]
         out = (batch_size, n_id, adjs)
@@ -116,13 +162,15 @@ class GinexNeighborSampler(torch.utils.data.DataLoader):
         
         self.lock.acquire()
         batch_count = self.batch_count.item()
-        n_id_filename = os.path.join(self.trace_dir, self.exp_name, 'sb_' + str(self.sb) + '_ids_' + str(self.batch_count.item()) + '.pth')
-        adjs_filename = os.path.join(self.trace_dir, self.exp_name, 'sb_' + str(self.sb) + '_adjs_' + str(self.batch_count.item()) + '.pth')
         self.batch_count += 1
+        self.io_stats += torch.tensor(sampler.get_io_stats(True))
+        self.block_cache_stats += torch.tensor(sampler.get_block_cache_stats(True))
         self.lock.release()
 
-        torch.save(n_id, n_id_filename)
-        torch.save(adjs, adjs_filename)
+        # The worker processes are forked after the store, so they append to the
+        # same arena
+        self.trace_store.append(trace.IDS, batch_count, [n_id])
+        self.trace_store.append(trace.ADJS, batch_count, layers_to_trace(layers))
 
 
     def __repr__(self):
@@ -167,24 +215,31 @@ class MMAPNeighborSampler(torch.utils.data.DataLoader):
         if node_idx.dtype == torch.bool:
             node_idx = node_idx.nonzero(as_tuple=False).view(-1)
 
+        # Created lazily per worker process, like GinexNeighborSampler's sampler
+        self.sampler = None
+        self.sampler_pid = None
+
         super(MMAPNeighborSampler, self).__init__(
             node_idx.view(-1).tolist(), collate_fn=self.sample, **kwargs)
 
 
+    def get_sampler(self):
+        if self.sampler is None or self.sampler_pid != os.getpid():
+            # One thread per worker, as the DataLoader workers already sample in parallel
+            self.sampler = sample.GinexSampler(self.indptr, self.indices, 1)
+            self.sampler_pid = os.getpid()
+        return self.sampler
+
+
     def sample(self, batch):
         if not isinstance(batch, Tensor):
             batch = torch.tensor(batch)
 
         batch_size: int = len(batch)
+        sampler = self.get_sampler()
 
-        adjs = []
-        n_id = batch
-        for size in self.sizes:
-            adj_t, n_id = sample_adj_mmap(self.indptr, self.indices, n_id, size, False)
-            e_id = adj_t.storage.value()
-            size = adj_t.sparse_sizes()[::-1]
-
-            adjs.append(Adj(adj_t, e_id, size))
+        n_id, layers = sampler.sample_multi_hop(batch, self.sizes, False, return_e_id=False)
+        adjs = layers_to_adjs(layers)
 
         adjs = adjs[0] if len(adjs) == 1 else adjs[::-1]
         out = (batch_size, n_id, adjs)
@@ -194,3 +249,67 @@ class MMAPNeighborSampler(torch.utils.data.DataLoader):
 
     def __repr__(self):
         return '{}(sizes={})'.format(self.__class__.__name__, self.sizes)
+
+
+class ThreadedNeighborSampler(object):
+    '''
+    Sampler for the baseline that samples mini-batches on native threads of a single
+    sampler instead of DataLoader worker processes. The GIL is released while
+    sampling, so it can be driven from a Python thread. Mini-batches are yielded
+    as (batch_size, n_id, adjs) in the order they finish.
+
+    Args:
+        indptr (Tensor): the indptr tensor.
+        indices (Tensor): the (memory-mapped) indices tensor.
+        sizes ([int]): The number of neighbors to sample for each node in each layer. 
+            If set to sizes[l] = -1`, all neighbors are included in layer `l`.
+        node_idx (Tensor): The nodes that should be considered for creating mini-batches.
+        batch_size (int): the number of nodes in a mini-batch. (default: 1)
+        shuffle (bool): whether to shuffle node_idx at every epoch. (default: False)
+        num_threads (int): the number of sampling threads. (default: 1)
+        seed (int, optional): the seed of the neighbor sampling RNG. (default: None)
+        transform (callable, optional): A function/transform that takes in a sampled 
+            mini-batch and returns a transformed version. (default: None) 
+    '''
+    def __init__(self, indptr, indices,
+                 sizes: List[int], node_idx: Tensor,
+                 batch_size: int = 1, shuffle: bool = False,
+                 num_threads: int = 1, seed: Optional[int] = None,
+                 transform: Callable = None):
+
+        if node_idx.dtype == torch.bool:
+            node_idx = node_idx.nonzero(as_tuple=False).view(-1)
+
+        self.node_idx = node_idx.view(-1)
+        self.sizes = sizes
+        self.batch_size = batch_size
+        self.shuffle = shuffle
+        self.num_threads = num_threads
+        self.seed = seed
+        self.transform = transform
+
+        self.sampler = sample.GinexSampler(indptr, indices, 1)
+
+
+    def __len__(self):
+        return math.ceil(self.node_idx.numel() / self.batch_size)
+
+
+    def __iter__(self):
+        node_idx = self.node_idx
+        if self.shuffle:
+            node_idx = node_idx[torch.randperm(node_idx.numel())]
+        batches = list(node_idx.split(self.batch_size))
+
+        seed = -1 if self.seed is None else self.seed
+        stream = self.sampler.sample_batches(batches, self.sizes, False, seed, self.num_threads,
+                                             return_e_id=False)
+        for b, n_id, layers in stream:
+            adjs = layers_to_adjs(layers)
+            adjs = adjs[0] if len(adjs) == 1 else adjs[::-1]
+            out = (batches[b].numel(), n_id, adjs)
+            yield self.transform(*out) if self.transform is not None else out
+
+
+    def __repr__(self):
+        return '{}(sizes={})'.format(self.__class__.__name__, self.sizes)
@@ -1,3 +1,5 @@
+import os
+import torch
 from lib.cpp_extension.wrapper import *
 
 
@@ -5,12 +7,16 @@ def tensor_free(t):
     free.tensor_free(t)
 
 
-def gather_ginex(feature_file, idx, feature_dim, cache):
-    return gather.gather_ginex(feature_file, idx, feature_dim, cache.cache, cache.address_table)
+def get_feature_reader(feature_file, feature_dim, io_depth=256, dtype='float32', scales=None, max_gap=8192):
+    return gather.FeatureReader(feature_file, feature_dim, io_depth, dtype=dtype, scales=scales, max_gap=max_gap)
 
 
-def gather_mmap(features, idx):
-    return gather.gather_mmap(features, idx, features.shape[1])
+def gather_ginex(reader, idx, cache, out=None):
+    return reader.gather(idx, cache.cache, cache.address_table, out)
+
+
+def gather_mmap(features, idx, out=None, scales=None):
+    return gather.gather_mmap(features, idx, features.shape[1], out, scales)
 
 
 def load_float32(path, size):
@@ -21,9 +27,33 @@ def load_int64(path, size):
     return mt_load.load_int64(path, size)
 
 
+# Load size values of dtype from path, or the whole file if size is -1, with
+# chunk_size reads on parallel threads. hugepage ('none', 'thp', '2mb' or '1gb')
+# selects the pages of the result, and shared puts it in shared memory that can
+# be passed to other processes instead.
+def load_tensor(path, size=-1, dtype='int64', chunk_size=16*1024*1024, hugepage='none', shared=False):
+    out = None
+    if shared:
+        if size < 0:
+            size = os.path.getsize(path) // torch.empty(0, dtype=getattr(torch, dtype)).element_size()
+        out = torch.empty(size, dtype=getattr(torch, dtype)).share_memory_()
+    return mt_load.load(path, size, dtype, chunk_size, hugepage, out)
+
+
+# A zeroed tensor of size values of dtype with the pages of hugepage
+def alloc_tensor(size, dtype='int64', hugepage='none'):
+    return mt_load.empty(size, dtype, hugepage)
+
+
+# The runtime trace of superbatch sb, which holds the ids and adjs of its batches
+# and their changesets (see trace.cpp)
+def get_trace_path(trace_dir, exp_name, sb):
+    return os.path.join(trace_dir, exp_name, 'sb_' + str(sb) + '.trace')
+
+
 def cache_update(cache, batch_inputs, in_indices, in_positions, out_indices):
     update.cache_update(cache.cache, cache.address_table, batch_inputs, in_indices, in_positions, out_indices, cache.cache.shape[1])
 
 
-def fill_neighbor_cache(cache, rowptr, col, cached_idx, address_table, num_entries):
-    sample.fill_neighbor_cache(cache, rowptr, col, cached_idx, address_table, num_entries)
+def fill_neighbor_cache(cache, rowptr, col, cached_idx, offsets, num_entries, io_depth=64, chunk_size=8*1024*1024):
+    return sample.fill_neighbor_cache(cache, rowptr, col, cached_idx, offsets, num_entries, io_depth, chunk_size)
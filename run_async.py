@@ -10,7 +10,7 @@ from sage import SAGE,GAT,GCN
 import math
 
 from lib.data import *
-from lib.neighbor_sampler import MMAPNeighborSampler
+from lib.neighbor_sampler import MMAPNeighborSampler, ThreadedNeighborSampler
 from lib.utils import *
 
 from lib.offload import *
@@ -32,6 +32,11 @@ argparser.add_argument('--features', type=int, default=128)
 argparser.add_argument('--compute-type', type=str, default="gpu")
 argparser.add_argument('--buffer-size', type=float, default=1)
 argparser.add_argument('--fallback', type=int, default=0)
+argparser.add_argument('--native-sampling', dest='native_sampling', default=False, action='store_true')
+argparser.add_argument('--feature-dtype', type=str, default='float32', choices=['float32', 'float16', 'bfloat16', 'int8'])
+argparser.add_argument('--cache-dtype', type=str, default='float32', choices=['float32', 'float16', 'bfloat16'])
+argparser.add_argument('--read-max-gap', type=int, default=8192)
+argparser.add_argument('--hugepage', type=str, default='none', choices=['none', 'thp', '2mb', '1gb'])
 args = argparser.parse_args()
 
 # Set environment and path
@@ -39,7 +44,8 @@ dataset_path = os.path.join(args.dataset_root, args.dataset + '-ginex')
 split_idx_path = os.path.join(dataset_path, 'split_idx.pth')
 
 # Prepare dataset
-features_path = os.path.join(dataset_path, 'features' + '.dat')
+features_path = get_features_path(dataset_path, args.feature_dtype)
+feature_scales = get_feature_scales(dataset_path, args.feature_dtype)
 sizes = [int(size) for size in args.sizes.split(',')]
 
 sample_worker_num = 2
@@ -71,14 +77,17 @@ indptr, indices, y, num_features, num_classes, num_nodes, train_idx, valid_idx,
 # Define model
 if args.compute_type == 'cpu':
     device = torch.device('cpu')
-    offloader = offload.Offloader(features_path, num_nodes, num_features, cache_size, 'cpu', 0, 0)
+    offloader = offload.Offloader(features_path, num_nodes, num_features, cache_size, 'cpu', 0, 0,
+                                  args.feature_dtype, args.cache_dtype, feature_scales, args.read_max_gap, args.hugepage)
 else:
     device = torch.device('cuda:%d' % args.gpu)
     torch.cuda.set_device(device)
     if (fallback_mode):
-        offloader = offload.Offloader(features_path, num_nodes, num_features, cache_size, 'cpu', args.gpu, 0)
+        offloader = offload.Offloader(features_path, num_nodes, num_features, cache_size, 'cpu', args.gpu, 0,
+                                      args.feature_dtype, args.cache_dtype, feature_scales, args.read_max_gap, args.hugepage)
     else:
-        offloader = offload.Offloader(features_path, num_nodes, num_features, cache_size, 'gpu', args.gpu, stage_size)
+        offloader = offload.Offloader(features_path, num_nodes, num_features, cache_size, 'gpu', args.gpu, stage_size,
+                                      args.feature_dtype, args.cache_dtype, feature_scales)
 
 x = offloader.get_tensor()
 
@@ -107,9 +116,14 @@ model = model.to(device)
 
 def sampling(res_list, sampling_q, adjs_map, t_id, batch_size, 
              indptr, indices, sizes, node_idx, num_workers):
-    train_loader = MMAPNeighborSampler(indptr, indices, node_idx=node_idx,
-                               sizes=sizes, batch_size=batch_size,
-                               shuffle=True, num_workers=num_workers)
+    if args.native_sampling:
+        train_loader = ThreadedNeighborSampler(indptr, indices, node_idx=node_idx,
+                                   sizes=sizes, batch_size=batch_size,
+                                   shuffle=True, num_threads=num_workers)
+    else:
+        train_loader = MMAPNeighborSampler(indptr, indices, node_idx=node_idx,
+                                   sizes=sizes, batch_size=batch_size,
+                                   shuffle=True, num_workers=num_workers)
     for step, (batch_size, ids, adjs) in enumerate(train_loader):
         key = t_id * 10000 + step
         # GPU
@@ -150,13 +164,13 @@ def executing(loading_q, releasing_q, adjs_map, t_id, pbar, total_list):
 
         # Forward
         if fallback_mode:
-            cuda_x = x[remap_ids].to(device)
+            cuda_x = x[remap_ids].to(device).float()
             cuda_y = y[ids[:batch_size]].to(device)
             cuda_adjs = [adj.to(device) for adj in adjs]
             out = model(cuda_x, cuda_adjs)
             loss = F.nll_loss(out, cuda_y)
         else:
-            out = model(x[remap_ids], adjs)
+            out = model(x[remap_ids].float(), adjs)
             loss = F.nll_loss(out, y[ids[:batch_size]])
 
         # Backward
@@ -316,11 +330,11 @@ def inference(mode='test'):
                             sizes=sizes, batch_size=args.batch_size,
                             shuffle=False, num_workers=args.num_workers)
 
-    mmap_x = get_mmap_x(path=dataset_path, split_idx_path=split_idx_path, num_features=args.features)
+    mmap_x = get_mmap_x(path=dataset_path, split_idx_path=split_idx_path, num_features=args.features, dtype=args.feature_dtype)
     # Sample
     for step, (batch_size, ids, adjs) in enumerate(inference_loader):
         # Gather
-        batch_inputs = gather_mmap(mmap_x, ids).to(device)
+        batch_inputs = gather_mmap(mmap_x, ids, scales=feature_scales).to(device)
         batch_labels = y[ids[:batch_size]].to(device)
 
         adjs = [adj.to(device) for adj in adjs]
@@ -36,6 +36,7 @@ argparser.add_argument('--train-only', dest='train_only', default=True, action='
 argparser.add_argument('--features', type=int, default=128)
 argparser.add_argument('--compute-type', type=str, default="gpu")
 argparser.add_argument('--world-size', type=int, default=2)
+argparser.add_argument('--hugepage', type=str, default='none', choices=['none', 'thp', '2mb', '1gb'])
 args = argparser.parse_args()
 
 # Set environment and path
@@ -265,7 +266,7 @@ def run(rank, world_size, total_list, num_features, num_classes, compute_type):
     
     if compute_type == 'cpu':
         device = torch.device('cpu')
-        offloader = offloadCPU.CPUOffloader(features_path, num_nodes, num_features, cache_size, rank, world_size)
+        offloader = offloadCPU.CPUOffloader(features_path, num_nodes, num_features, cache_size, rank, world_size, args.hugepage)
         device_in = None
     else:
         device = torch.device('cuda:%d' % device_id)
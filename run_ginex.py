@@ -1,7 +1,6 @@
 import argparse
 import time
 import os
-import glob
 from datetime import datetime
 import torch
 import torch.nn.functional as F
@@ -13,12 +12,13 @@ from sage import SAGE,GAT,GCN
 from lib.data import *
 from lib.cache import *
 from lib.utils import *
-from lib.neighbor_sampler import GinexNeighborSampler
+from lib.neighbor_sampler import GinexNeighborSampler, trace_to_adjs
 
 
 # Parse arguments
 argparser = argparse.ArgumentParser()
 argparser.add_argument('--gpu', type=int, default=0)
+argparser.add_argument('--compute-type', type=str, default='gpu', choices=['gpu', 'cpu'])
 argparser.add_argument('--num-epochs', type=int, default=10)
 argparser.add_argument('--batch-size', type=int, default=1000)
 argparser.add_argument('--num-workers', type=int, default=os.environ.get('SLURM_CPUS_PER_TASK', len(os.sched_getaffinity(0))))
@@ -33,9 +33,19 @@ argparser.add_argument('--sizes', type=str, default='10,10,10')
 argparser.add_argument('--sb-size', type=int, default='1000')
 argparser.add_argument('--feature-cache-size', type=float, default=500000000)
 argparser.add_argument('--trace-load-num-threads', type=int, default=4)
+argparser.add_argument('--trace-memory-budget', type=int, default=0)
 argparser.add_argument('--neigh-cache-size', type=int, default=45000000000)
+argparser.add_argument('--sample-io-depth', type=int, default=64)
+argparser.add_argument('--sample-max-read', type=int, default=131072)
+argparser.add_argument('--sample-block-cache-size', type=int, default=0)
+argparser.add_argument('--sample-seed', type=int, default=None)
+argparser.add_argument('--gather-io-depth', type=int, default=256)
+argparser.add_argument('--gather-max-gap', type=int, default=8192)
+argparser.add_argument('--hugepage', type=str, default='none', choices=['none', 'thp', '2mb', '1gb'])
+argparser.add_argument('--compressed-indices', dest='compressed_indices', default=False, action='store_true')
 argparser.add_argument('--ginex-num-threads', type=int, default=os.environ.get('SLURM_CPUS_PER_TASK', len(os.sched_getaffinity(0)))*4)
 argparser.add_argument('--features', type=int, default=128)
+argparser.add_argument('--feature-dtype', type=str, default='float32', choices=['float32', 'float16', 'bfloat16', 'int8'])
 argparser.add_argument('--verbose', dest='verbose', default=False, action='store_true')
 argparser.add_argument('--train-only', dest='train_only', default=False, action='store_true')
 args = argparser.parse_args()
@@ -56,10 +66,19 @@ sizes = [int(size) for size in args.sizes.split(',')]
 dataset = GinexDataset(path=dataset_path, split_idx_path=split_idx_path, num_features=args.features)
 num_nodes = dataset.num_nodes
 num_features = dataset.num_features
-features = dataset.features_path
+features = get_features_path(dataset_path, args.feature_dtype)
+feature_scales = get_feature_scales(dataset_path, args.feature_dtype)
+feature_reader = get_feature_reader(features, num_features, args.gather_io_depth, args.feature_dtype, feature_scales,
+                                    args.gather_max_gap)
 num_classes = dataset.num_classes
-mmapped_features = dataset.get_mmapped_features()
-indptr, indices = dataset.get_adj_mat()
+mmapped_features = dataset.get_mmapped_features(args.feature_dtype)
+indptr = dataset.get_rowptr_mt()
+if args.compressed_indices:
+    indices_path = dataset.compressed_indices_path
+    compressed_index = dataset.get_compressed_index()
+else:
+    indices_path = dataset.indices_path
+    compressed_index = None
 labels = dataset.get_labels()
 
 print(args.dataset, num_features, args.model)
@@ -68,8 +87,11 @@ if args.verbose:
     tqdm.write('Done!')
 
 # Define model
-device = torch.device('cuda:%d' % args.gpu)
-torch.cuda.set_device(device)
+if args.compute_type == 'cpu':
+    device = torch.device('cpu')
+else:
+    device = torch.device('cuda:%d' % args.gpu)
+    torch.cuda.set_device(device)
 
 if args.model == 'sage':
     model = SAGE(num_features, args.num_hiddens, num_classes, num_layers=len(sizes))
@@ -85,6 +107,29 @@ else:
 model = model.to(device)
 
 
+def synchronize(empty_cache=False):
+    if device.type == 'cuda':
+        torch.cuda.synchronize()
+        if empty_cache:
+            torch.cuda.empty_cache()
+
+
+def load_neighbor_cache(name):
+    path = str(dataset_path) + '/' + name + '_size_' + str(args.neigh_cache_size)
+    conf = json.load(open(path + '_conf.json', 'r'))
+    return load_tensor(path + '.dat', conf['shape'][0], conf['dtype'], hugepage=args.hugepage)
+
+
+# The runtime traces of the superbatches being sampled and executed. Up to
+# --trace-memory-budget bytes of each are kept in memory, and the rest is
+# spilled to --trace-dir.
+trace_stores = {}
+
+
+def open_trace(i):
+    return trace.TraceStore(get_trace_path(args.trace_dir, args.exp_name, i), args.sb_size, args.trace_memory_budget)
+
+
 def inspect(i, last, mode='train'):
     # Same effect of `sysctl -w vm.drop_caches=1`
     # Requires sudo
@@ -104,44 +149,58 @@ def inspect(i, last, mode='train'):
     # No changeset precomputation when i == 0
     if i != 0:
         effective_sb_size = int((node_idx.numel()%(args.sb_size*args.batch_size) + args.batch_size-1) / args.batch_size) if last else args.sb_size
-        cache = FeatureCache(args.feature_cache_size, effective_sb_size, num_nodes, mmapped_features, num_features, args.exp_name, i - 1, args.trace_dir, args.verbose)
+        cache = FeatureCache(args.feature_cache_size, effective_sb_size, num_nodes, mmapped_features, num_features, trace_stores[i - 1], args.verbose, feature_scales)
         # Pass 1 and 2 are executed before starting sb sample.
         # We overlap only the pass 3 of changeset precomputation, 
         # which is the most time consuming part, with sb sample.
-        iterptr, iters, initial_cache_indices = cache.pass_1_and_2()
+        access_ptr, accesses, initial_cache_indices = cache.pass_1_and_2()
         
         # Only changset precomputation at the last superbatch in epoch
         if last:
-            cache.pass_3(iterptr, iters, initial_cache_indices)
-            torch.cuda.empty_cache()
+            cache.pass_3(access_ptr, accesses, initial_cache_indices)
+            synchronize(empty_cache=True)
             return cache, initial_cache_indices.cpu()
         else:
-            torch.cuda.empty_cache()
+            synchronize(empty_cache=True)
 
     # Load neighbor cache
-    neighbor_cache_path = str(dataset_path) + '/nc' + '_size_' + str(args.neigh_cache_size) + '.dat'
-    neighbor_cache_conf_path = str(dataset_path) + '/nc' + '_size_' + str(args.neigh_cache_size) + '_conf.json'
-    neighbor_cache_numel = json.load(open(neighbor_cache_conf_path, 'r'))['shape'][0]
-    neighbor_cachetable_path = str(dataset_path) + '/nctbl' + '_size_' + str(args.neigh_cache_size) + '.dat'
-    neighbor_cachetable_conf_path = str(dataset_path) + '/nctbl' + '_size_' + str(args.neigh_cache_size) + '_conf.json'
-    neighbor_cachetable_numel = json.load(open(neighbor_cachetable_conf_path, 'r'))['shape'][0]
-    neighbor_cache = load_int64(neighbor_cache_path, neighbor_cache_numel)
-    neighbor_cachetable = load_int64(neighbor_cachetable_path, neighbor_cachetable_numel)
+    neighbor_cache = load_neighbor_cache('nc')
+    neighbor_cache_bitmap = load_neighbor_cache('ncbits')
+    neighbor_cache_offsets = load_neighbor_cache('ncoffs')
 
     start_idx = i * args.batch_size * args.sb_size 
     end_idx = min((i+1) * args.batch_size * args.sb_size, node_idx.numel())
-    loader = GinexNeighborSampler(indptr, dataset.indices_path, args.exp_name, i, args.trace_dir, node_idx=node_idx[start_idx:end_idx],
+    trace_stores[i] = open_trace(i)
+    loader = GinexNeighborSampler(indptr, indices_path, trace_stores[i], node_idx=node_idx[start_idx:end_idx],
                                        sizes=sizes, num_nodes = num_nodes,
-                                       cache_data = neighbor_cache, address_table = neighbor_cachetable,
+                                       cache_data = neighbor_cache, cache_bitmap = neighbor_cache_bitmap,
+                                       cache_offsets = neighbor_cache_offsets,
+                                       io_depth = args.sample_io_depth, max_read = args.sample_max_read,
+                                       block_cache_size = args.sample_block_cache_size,
+                                       seed = args.sample_seed,
+                                       compressed_index = compressed_index,
                                        batch_size=args.batch_size,
                                        shuffle=False, num_workers=args.num_workers, prefetch_factor=1<<20)
 
     for step, _ in enumerate(loader):
         if i != 0 and step == 0:
-            cache.pass_3(iterptr, iters, initial_cache_indices)
-
-    tensor_free(neighbor_cache)
-    tensor_free(neighbor_cachetable)
+            cache.pass_3(access_ptr, accesses, initial_cache_indices)
+
+    if args.verbose:
+        rows, bytes_requested, reads, bytes_read = loader.io_stats.tolist()
+        tqdm.write('Neighbor reads: {} rows in {} reads, {} bytes requested, {} bytes read'.format(
+            rows, reads, bytes_requested, bytes_read))
+        if args.sample_block_cache_size > 0:
+            hits, misses, evictions = loader.block_cache_stats.tolist()
+            tqdm.write('Block cache: {} hits, {} misses ({:.1f}% hit rate), {} evictions'.format(
+                hits, misses, 100 * hits / max(hits + misses, 1), evictions))
+        in_memory, bytes_in_memory, spilled = trace_stores[i].get_stats()
+        tqdm.write('Trace: {} records in memory ({} bytes), {} spilled to disk'.format(
+            in_memory, bytes_in_memory, spilled))
+
+    # The neighbor cache is unmapped once the loader drops it
+    del loader
+    del neighbor_cache, neighbor_cache_bitmap, neighbor_cache_offsets
 
     if i != 0:
         return cache, initial_cache_indices.cpu()
@@ -154,43 +213,24 @@ def switch(cache, initial_cache_indices):
     return cache
 
 
-def trace_load(q, indices, sb):
+def trace_load(q, trace_store, indices):
     for i in indices:
         q.put((
-            torch.load(args.trace_dir + args.exp_name + '/' + 'sb_' + str(sb) + '_ids_' + str(i) + '.pth'),
-            torch.load(args.trace_dir + args.exp_name + '/' + 'sb_' + str(sb) + '_adjs_' + str(i) + '.pth'),
-            torch.load(args.trace_dir + args.exp_name + '/' + 'sb_' + str(sb) + '_update_' + str(i) + '.pth'),
+            trace_store.get(trace.IDS, i)[0],
+            trace_to_adjs(trace_store.get(trace.ADJS, i)),
+            tuple(trace_store.get(trace.UPDATE, i)),
             ))
 
 
 def gather(gather_q, n_id, cache, batch_size):
-    batch_inputs = gather_ginex(features, n_id, num_features, cache)
+    batch_inputs = gather_ginex(feature_reader, n_id, cache)
     batch_labels = labels[n_id[:batch_size]]
     gather_q.put((batch_inputs, batch_labels))
 
 
 def delete_trace(i):
-    n_id_filelist = glob.glob(args.trace_dir + args.exp_name + '/sb_' + str(i - 1) + '_ids_*')
-    adjs_filelist = glob.glob(args.trace_dir + args.exp_name + '/sb_' + str(i - 1) + '_adjs_*')
-    cache_filelist = glob.glob(args.trace_dir + args.exp_name + '/sb_' + str(i - 1) + '_update_*')
-
-    for n_id_file in n_id_filelist:
-        try:
-            os.remove(n_id_file)
-        except:
-            tqdm.write('Error while deleting file : ', n_id_file)
-
-    for adjs_file in adjs_filelist:
-        try:
-            os.remove(adjs_file)
-        except:
-            tqdm.write('Error while deleting file : ', adjs_file)
-
-    for cache_file in cache_filelist:
-        try:
-            os.remove(cache_file)
-        except:
-            tqdm.write('Error while deleting file : ', cache_file)
+    del(trace_stores[i - 1])
+    trace.remove(get_trace_path(args.trace_dir, args.exp_name, i - 1))
 
 
 def execute(i, cache, pbar, total_loss, total_correct, last, mode='train'):
@@ -204,12 +244,13 @@ def execute(i, cache, pbar, total_loss, total_correct, last, mode='train'):
     else:
         num_iter = args.sb_size
 
-    # Multi-threaded load of sets of (ids, adj, update)
+    # Multi-threaded load of sets of (ids, adj, update) from the trace
+    trace_store = trace_stores[i - 1]
     q = list()
     loader = list()
     for t in range(args.trace_load_num_threads):
         q.append(Queue(maxsize=2))
-        loader.append(threading.Thread(target=trace_load, args=(q[t], list(range(t, num_iter, args.trace_load_num_threads)), i-1), daemon=True))
+        loader.append(threading.Thread(target=trace_load, args=(q[t], trace_store, list(range(t, num_iter, args.trace_load_num_threads))), daemon=True))
         loader[t].start()
 
     n_id_q = Queue(maxsize=2)
@@ -235,7 +276,7 @@ def execute(i, cache, pbar, total_loss, total_correct, last, mode='train'):
                 out_indices_q.put(out_indices)
 
             # Gather
-            batch_inputs = gather_ginex(features, n_id, num_features, cache)
+            batch_inputs = gather_ginex(feature_reader, n_id, cache)
             batch_labels = labels[n_id[:batch_size]]
 
             # Cache
@@ -296,7 +337,7 @@ def execute(i, cache, pbar, total_loss, total_correct, last, mode='train'):
         del(in_positions)
         del(out_indices)
         del(adjs_host)
-        tensor_free(batch_inputs)
+        del(batch_inputs)
         pbar.update(batch_size)
 
     return total_loss, total_correct
@@ -322,7 +363,7 @@ def train(epoch):
         if args.verbose:
             tqdm.write ('Step 1: Superbatch Sample')
         cache, initial_cache_indices  = inspect(i, last=(i==num_sb), mode='train')
-        torch.cuda.synchronize()
+        synchronize()
         if args.verbose:
             tqdm.write ('Step 1: Done')
 
@@ -333,7 +374,7 @@ def train(epoch):
         if args.verbose:
             tqdm.write ('Step 2: Switch')
         cache = switch(cache, initial_cache_indices)
-        torch.cuda.synchronize()
+        synchronize()
         if args.verbose:
             tqdm.write ('Step 2: Done')
 
@@ -342,6 +383,9 @@ def train(epoch):
             tqdm.write ('Step 3: Main Loop')
         total_loss, total_correct = execute(i, cache, pbar, total_loss, total_correct, last=(i==num_sb), mode='train')
         if args.verbose:
+            rows, bytes_requested, reads, bytes_read = feature_reader.get_io_stats(True)
+            tqdm.write('Feature reads: {} rows in {} reads, {} bytes requested, {} bytes read'.format(
+                rows, reads, bytes_requested, bytes_read))
             tqdm.write ('Step 3: Done')
 
         # Delete obsolete runtime files
@@ -381,7 +425,7 @@ def inference(mode='test'):
         if args.verbose:
             tqdm.write ('Step 1: Superbatch Sample')
         cache, initial_cache_indices = inspect(i, last=(i==num_sb), mode=mode)
-        torch.cuda.synchronize()
+        synchronize()
         if args.verbose:
             tqdm.write ('Step 1: Done')
 
@@ -392,7 +436,7 @@ def inference(mode='test'):
         if args.verbose:
             tqdm.write ('Step 2: Switch')
         cache = switch(cache, initial_cache_indices)
-        torch.cuda.synchronize()
+        synchronize()
         if args.verbose:
             tqdm.write ('Step 2: Done')
 